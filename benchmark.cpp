@@ -0,0 +1,381 @@
+/// kmcuda-benchmark runs kmeans_cuda_ex() over synthetic datasets and sweeps
+/// the parameters. Each comma separated option is a sweep axis, every
+/// combination is run and reported as a CSV or JSON line.
+///
+/// The profile columns (the phase times, the distance evaluations, etc.) are
+/// only reported if the library and the benchmark are built with PROFILE,
+/// the Yinyang refreshes are always counted.
+///
+/// Example:
+///   kmcuda-benchmark --generator blobs,uniform --samples 300000
+///     --features 480 --clusters 5000 --yinyang-t 0,0.1 --format csv
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "kmcuda.h"
+
+namespace {
+
+#ifdef PROFILE
+const char *phase_names[kmcudaPhaseCount] = {
+  "init", "lloyd", "yinyang_groups", "yinyang_refresh", "drifts",
+  "global_filter", "local_filter", "adjust", "kmeans_pp_step", "neighbors",
+  "reorder"
+};
+#endif
+
+const char *stop_reason_names[] = {
+  "tolerance", "centroid_shift", "max_iterations", "time_budget", "cancelled"
+};
+
+struct Config {
+  std::vector<std::string> generators = {"blobs"};
+  std::vector<KMCUDASampleIndex> samples = {100000};
+  std::vector<uint32_t> features = {32};
+  std::vector<uint32_t> clusters = {100};
+  std::vector<float> yinyang_t = {0.1f};
+  std::vector<float> tolerance = {0.01f};
+  std::vector<uint32_t> neighbors = {0};
+  std::vector<std::string> inits = {"kmeans++"};
+  uint32_t seed = 777;
+  uint32_t repeat = 1;
+  uint32_t device = 0;
+  int32_t verbosity = 0;
+  bool json = false;
+  const char *output = nullptr;
+};
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Comma separated values are swept over.\n"
+          "  --generator  blobs,uniform,heavy,duplicates  (blobs)\n"
+          "  --samples    N[,N...]                        (100000)\n"
+          "  --features   D[,D...]                        (32)\n"
+          "  --clusters   K[,K...]                        (100)\n"
+          "  --yinyang-t  T[,T...]                        (0.1)\n"
+          "  --tolerance  T[,T...]                        (0.01)\n"
+          "  --neighbors  M[,M...]                        (0)\n"
+          "  --init       random,kmeans++                 (kmeans++)\n"
+          "  --seed       S                               (777)\n"
+          "  --repeat     R                               (1)\n"
+          "  --device     I                               (0)\n"
+          "  --verbosity  V                               (0)\n"
+          "  --format     csv|json                        (csv)\n"
+          "  --output     PATH                            (stdout)\n",
+          argv0);
+}
+
+std::vector<std::string> split(const char *value) {
+  std::vector<std::string> result;
+  std::string item;
+  for (const char *p = value; ; p++) {
+    if (*p == ',' || *p == 0) {
+      if (!item.empty()) {
+        result.push_back(item);
+      }
+      item.clear();
+      if (*p == 0) {
+        break;
+      }
+    } else {
+      item.push_back(*p);
+    }
+  }
+  return result;
+}
+
+template <typename T>
+bool parse_list(const char *value, std::vector<T> *list) {
+  list->clear();
+  for (auto &item : split(value)) {
+    char *end;
+    double number = strtod(item.c_str(), &end);
+    if (*end != 0 || number < 0) {
+      return false;
+    }
+    list->push_back(static_cast<T>(number));
+  }
+  return !list->empty();
+}
+
+bool parse_args(int argc, char *argv[], Config *config) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+      return false;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "%s requires a value\n", arg);
+      return false;
+    }
+    const char *value = argv[++i];
+    bool ok = true;
+    if (!strcmp(arg, "--generator")) {
+      config->generators = split(value);
+      for (auto &g : config->generators) {
+        ok &= g == "blobs" || g == "uniform" || g == "heavy" || g == "duplicates";
+      }
+    } else if (!strcmp(arg, "--samples")) {
+      ok = parse_list(value, &config->samples);
+    } else if (!strcmp(arg, "--features")) {
+      ok = parse_list(value, &config->features);
+    } else if (!strcmp(arg, "--clusters")) {
+      ok = parse_list(value, &config->clusters);
+    } else if (!strcmp(arg, "--yinyang-t")) {
+      ok = parse_list(value, &config->yinyang_t);
+    } else if (!strcmp(arg, "--tolerance")) {
+      ok = parse_list(value, &config->tolerance);
+    } else if (!strcmp(arg, "--neighbors")) {
+      ok = parse_list(value, &config->neighbors);
+    } else if (!strcmp(arg, "--init")) {
+      config->inits = split(value);
+      for (auto &init : config->inits) {
+        ok &= init == "random" || init == "kmeans++";
+      }
+    } else if (!strcmp(arg, "--seed")) {
+      config->seed = strtoul(value, nullptr, 10);
+    } else if (!strcmp(arg, "--repeat")) {
+      config->repeat = strtoul(value, nullptr, 10);
+    } else if (!strcmp(arg, "--device")) {
+      config->device = strtoul(value, nullptr, 10);
+    } else if (!strcmp(arg, "--verbosity")) {
+      config->verbosity = strtol(value, nullptr, 10);
+    } else if (!strcmp(arg, "--format")) {
+      ok = !strcmp(value, "csv") || !strcmp(value, "json");
+      config->json = !strcmp(value, "json");
+    } else if (!strcmp(arg, "--output")) {
+      config->output = value;
+    } else {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return false;
+    }
+    if (!ok) {
+      fprintf(stderr, "invalid value of %s: %s\n", arg, value);
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Fills samples_size x features_size matrix. The same seed always yields
+/// the same data.
+/// blobs - isotropic Gaussian blobs around clusters_size centers.
+/// uniform - uniform in the unit hypercube.
+/// heavy - Student's t with 2 degrees of freedom, lots of outliers.
+/// duplicates - blobs where every row is repeated 10 times.
+void generate(const std::string &generator, KMCUDASampleIndex samples_size,
+              KMCUDAFeatureIndex features_size, uint32_t clusters_size, uint32_t seed,
+              std::vector<float> *samples) {
+  std::mt19937 rng(seed);
+  samples->resize(static_cast<uint64_t>(samples_size) * features_size);
+  float *data = samples->data();
+  if (generator == "uniform") {
+    std::uniform_real_distribution<float> dist(0, 1);
+    for (auto &v : *samples) {
+      v = dist(rng);
+    }
+    return;
+  }
+  if (generator == "heavy") {
+    std::student_t_distribution<float> dist(2);
+    for (auto &v : *samples) {
+      v = dist(rng);
+    }
+    return;
+  }
+  std::vector<float> centers(static_cast<uint64_t>(clusters_size) * features_size);
+  std::uniform_real_distribution<float> center_dist(-10, 10);
+  for (auto &v : centers) {
+    v = center_dist(rng);
+  }
+  std::uniform_int_distribution<uint32_t> center_choice(0, clusters_size - 1);
+  std::normal_distribution<float> noise(0, 1);
+  uint32_t period = generator == "duplicates"? 10 : 1;
+  for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+    float *row = data + static_cast<uint64_t>(i) * features_size;
+    if (i % period != 0) {
+      memcpy(row, row - features_size, features_size * sizeof(float));
+      continue;
+    }
+    const float *center =
+        centers.data() + static_cast<uint64_t>(center_choice(rng)) * features_size;
+    for (KMCUDAFeatureIndex f = 0; f < features_size; f++) {
+      row[f] = center[f] + noise(rng);
+    }
+  }
+}
+
+struct Run {
+  std::string generator;
+  KMCUDASampleIndex samples_size;
+  KMCUDAFeatureIndex features_size;
+  uint32_t clusters_size;
+  float yinyang_t;
+  float tolerance;
+  uint32_t neighbors;
+  std::string init;
+  uint32_t seed;
+  int result;
+  double time;
+  KMCUDAStatistics statistics;
+};
+
+void print_header(FILE *fout, const Config &config) {
+  if (config.json) {
+    return;
+  }
+  fprintf(fout, "generator,samples,features,clusters,yinyang_t,tolerance,neighbors,"
+                "init,"
+                "seed,result,time,iterations,stop_reason,inertia,refreshes");
+#ifdef PROFILE
+  fprintf(fout, ",distance_evaluations,passed,bytes_touched");
+  for (auto name : phase_names) {
+    fprintf(fout, ",time_%s", name);
+  }
+#endif
+  fprintf(fout, "\n");
+}
+
+void print_run(FILE *fout, const Config &config, const Run &run) {
+  const KMCUDAStatistics &st = run.statistics;
+  const char *stop_reason = stop_reason_names[st.stop_reason];
+  // KMCUDASampleIndex is 32-bit or 64-bit, see KMCUDA_INDEX64
+  const uint64_t samples_size = run.samples_size;
+#ifdef PROFILE
+  const KMCUDAProfile &pr = st.profile;
+#endif
+  if (config.json) {
+    fprintf(fout,
+            "{\"generator\": \"%s\", \"samples\": %" PRIu64 ", \"features\": %d, "
+            "\"clusters\": %" PRIu32 ", \"yinyang_t\": %g, \"tolerance\": %g, "
+            "\"neighbors\": %" PRIu32 ", \"init\": \"%s\", \"seed\": %" PRIu32 ", \"result\": %d, "
+            "\"time\": %.6f, \"iterations\": %" PRIu32 ", \"stop_reason\": \"%s\", "
+            "\"inertia\": %.9g, \"refreshes\": %" PRIu32,
+            run.generator.c_str(), samples_size, run.features_size,
+            run.clusters_size, run.yinyang_t, run.tolerance, run.neighbors,
+            run.init.c_str(),
+            run.seed, run.result, run.time, st.iterations, stop_reason,
+            st.inertia, st.profile.refreshes);
+#ifdef PROFILE
+    fprintf(fout,
+            ", \"distance_evaluations\": %" PRIu64 ", "
+            "\"passed\": %" PRIu64 ", "
+            "\"bytes_touched\": %" PRIu64 ", \"phase_times\": {",
+            pr.distance_evaluations, pr.passed, pr.bytes_touched);
+    for (int i = 0; i < kmcudaPhaseCount; i++) {
+      fprintf(fout, "%s\"%s\": %.6f", i > 0? ", " : "", phase_names[i],
+              pr.phase_times[i]);
+    }
+    fprintf(fout, "}");
+#endif
+    fprintf(fout, "}\n");
+  } else {
+    fprintf(fout,
+            "%s,%" PRIu64 ",%d,%" PRIu32 ",%g,%g,%" PRIu32 ",%s,%" PRIu32 ",%d,%.6f,%" PRIu32
+            ",%s,%.9g,%" PRIu32,
+            run.generator.c_str(), samples_size, run.features_size,
+            run.clusters_size, run.yinyang_t, run.tolerance, run.neighbors,
+            run.init.c_str(),
+            run.seed, run.result, run.time, st.iterations, stop_reason,
+            st.inertia, st.profile.refreshes);
+#ifdef PROFILE
+    fprintf(fout, ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+            pr.distance_evaluations, pr.passed, pr.bytes_touched);
+    for (double t : pr.phase_times) {
+      fprintf(fout, ",%.6f", t);
+    }
+#endif
+    fprintf(fout, "\n");
+  }
+  fflush(fout);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  Config config;
+  if (!parse_args(argc, argv, &config)) {
+    usage(argv[0]);
+    return 1;
+  }
+  FILE *fout = stdout;
+  if (config.output != nullptr) {
+    fout = fopen(config.output, "w");
+    if (fout == nullptr) {
+      fprintf(stderr, "failed to open %s\n", config.output);
+      return 1;
+    }
+  }
+#ifndef PROFILE
+  fprintf(stderr, "built without PROFILE: the phase times and the distance "
+                  "evaluations are not reported\n");
+#endif
+  print_header(fout, config);
+  int status = 0;
+  std::vector<float> samples, centroids;
+  std::vector<uint32_t> assignments;
+  for (auto &generator : config.generators)
+  for (KMCUDASampleIndex samples_size : config.samples)
+  for (uint32_t features_size : config.features)
+  for (uint32_t clusters_size : config.clusters)
+  for (uint32_t r = 0; r < config.repeat; r++) {
+    uint32_t seed = config.seed + r;
+    if (features_size == 0 || features_size >
+        std::numeric_limits<KMCUDAFeatureIndex>::max() || clusters_size < 2) {
+      fprintf(stderr, "invalid problem size: %" PRIu32 " features, %" PRIu32
+                      " clusters\n", features_size, clusters_size);
+      return 1;
+    }
+    generate(generator, samples_size, features_size, clusters_size, seed,
+             &samples);
+    centroids.resize(static_cast<uint64_t>(clusters_size) * features_size);
+    assignments.resize(samples_size);
+    for (float yinyang_t : config.yinyang_t)
+    for (float tolerance : config.tolerance)
+    for (uint32_t neighbors : config.neighbors)
+    for (auto &init : config.inits) {
+      KMCUDAOptions options = {};
+      options.kmpp = init == "kmeans++";
+      options.tolerance = tolerance;
+      options.yinyang_t = yinyang_t;
+      options.neighbors = neighbors;
+      options.seed = seed;
+      options.device = config.device;
+      options.verbosity = config.verbosity;
+      Run run = {};
+      run.generator = generator;
+      run.samples_size = samples_size;
+      run.features_size = features_size;
+      run.clusters_size = clusters_size;
+      run.yinyang_t = yinyang_t;
+      run.tolerance = tolerance;
+      run.neighbors = neighbors;
+      run.init = init;
+      run.seed = seed;
+      auto start = std::chrono::steady_clock::now();
+      run.result = kmeans_cuda_ex(
+          &options, samples_size, features_size, clusters_size, samples.data(),
+          centroids.data(), assignments.data(), &run.statistics);
+      run.time = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+      if (run.result != kmcudaSuccess) {
+        status = 1;
+      }
+      print_run(fout, config, run);
+    }
+  }
+  if (fout != stdout) {
+    fclose(fout);
+  }
+  return status;
+}
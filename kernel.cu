@@ -4,21 +4,43 @@
 #include <cinttypes>
 #include <cinttypes>
 #include <algorithm>
+#include <exception>
+#include <limits>
 #include <memory>
+#include <new>
+#include <type_traits>
+
+#include <thrust/execution_policy.h>
+#include <thrust/sort.h>
+#include <thrust/system_error.h>
+#include <thrust/system/cuda/execution_policy.h>
 
 #include "private.h"
 
 #define BS_KMPP 512
-#define BS_LL_ASS 256
+#define BS_LL_ASS BS_STATS  // the blocks of the fused statistics
 #define BS_LL_CNT 256
 #define BS_YY_INI 256
 #define BS_YY_GFL 512
 #define BS_YY_LFL 512
 #define BLOCK_SIZE 1024  // for all the rest of the kernels
+#define PACK_TILE 32  // the side of the square tile of kmeans_pack_columns
+#define PACK_ROWS 8  // each thread of kmeans_pack_columns moves 4 elements
+// the static shared memory of kmeans_yy_local_filter in 32-bit words,
+// kmeans_cuda_setup() leaves it out of ctx.shmem_size
+#define LFL_QUEUE_WORDS 4
+// the first chunks of kmeans_yy_local_filter take 1/LFL_GUIDED_FACTOR of the
+// remaining passed samples per block, the last ones a single block round
+#define LFL_GUIDED_FACTOR 2
 
 #define YINYANG_GROUP_TOLERANCE 0.02
 #define YINYANG_DRAFT_REASSIGNMENTS 0.11
 #define YINYANG_REFRESH_EPSILON 1e-4
+#define NEIGHBORS_CERTIFICATE_MARGIN 1e-3f
+
+// each reassignment record packs (sample << ctx.cluster_bits) | previous
+// cluster, the new cluster is read from assignments
+#define REASSIGNMENTS_CAPACITY(size) ((size) / 2)
 
 #define CUCH(cuda_call, ret) \
 do { \
@@ -29,33 +51,301 @@ do { \
   } \
 } while (false)
 
-__device__ uint32_t changed;
-__device__ uint32_t passed_number;
-__constant__ uint32_t samples_size;
-__constant__ uint16_t features_size;
-__constant__ uint32_t clusters_size;
-__constant__ uint32_t yy_groups_size;
-__constant__ int shmem_size;
+// every kernel receives the KMCUDAContext of its run by value,
+// so concurrent runs never share the sizes or the counters
+
+#ifdef PROFILE
+#define COUNT_DISTANCES(n) \
+  atomicAdd(&ctx.counters->distance_evaluations, \
+            static_cast<unsigned long long>(n))
+#else
+#define COUNT_DISTANCES(n) do { (void)(n); } while (false)
+#endif
+
+/// The dynamic shared memory of the block as an array of F. The single
+/// declaration for all the element types avoids the conflicting redeclarations
+/// of extern __shared__ arrays in the template instantiations.
+template <typename F>
+__device__ __forceinline__ F *shared_memory() {
+  // float4 reads of Features<float, D> need 16-byte alignment
+  extern __shared__ __align__(16) double shared_memory_storage[];
+  return reinterpret_cast<F*>(shared_memory_storage);
+}
+
+/// The number of F which fit into the shared memory of the block.
+template <typename F>
+__device__ __forceinline__ uint32_t shmem_capacity(const KMCUDAContext &ctx) {
+  return ctx.shmem_size * sizeof(uint32_t) / sizeof(F);
+}
+
+/// The loops over the features of a sample or a centroid. D is the number of
+/// features if it is known at compile time (see pick_features_kernel()) or 0,
+/// then the loops run to ctx.features_size. The specialized loops are fully
+/// unrolled.
+template <typename F, int D,
+          bool V = (D > 0 && D % 4 == 0 && std::is_same<F, float>::value)>
+struct Features {
+  __device__ __forceinline__ static KMCUDAFeatureIndex size(
+      const KMCUDAContext &ctx) {
+    return D > 0? D : ctx.features_size;
+  }
+
+  /// The dot product of a and b.
+  __device__ __forceinline__ static F dot(
+      const KMCUDAContext &ctx, const F *__restrict__ a,
+      const F *__restrict__ b) {
+    F sum = 0;
+    #pragma unroll (D > 0? D : 4)
+    for (KMCUDAFeatureIndex f = 0; f < size(ctx); f++) {
+      sum += a[f] * b[f];
+    }
+    return sum;
+  }
+
+  /// The squared Euclidean distance between a and b.
+  __device__ __forceinline__ static F distance(
+      const KMCUDAContext &ctx, const F *__restrict__ a,
+      const F *__restrict__ b) {
+    F sum = 0;
+    #pragma unroll (D > 0? D : 4)
+    for (KMCUDAFeatureIndex f = 0; f < size(ctx); f++) {
+      F d = a[f] - b[f];
+      sum += d * d;
+    }
+    return sum;
+  }
+
+  /// Copies src to dest and returns the squared norm.
+  __device__ __forceinline__ static F copy(
+      const KMCUDAContext &ctx, const F *__restrict__ src,
+      F *__restrict__ dest) {
+    F sum = 0;
+    #pragma unroll (D > 0? D : 4)
+    for (KMCUDAFeatureIndex f = 0; f < size(ctx); f++) {
+      F v = src[f];
+      dest[f] = v;
+      sum += v * v;
+    }
+    return sum;
+  }
+};
+
+/// The float rows of a multiple of 4 features are 16-byte aligned, so they
+/// are read by float4. The summation order is the same as in the generic
+/// loops, thus the results do not depend on the specialization.
+template <int D>
+struct Features<float, D, true> {
+  __device__ __forceinline__ static KMCUDAFeatureIndex size(
+      const KMCUDAContext &) {
+    return D;
+  }
+
+  __device__ __forceinline__ static float dot(
+      const KMCUDAContext &, const float *__restrict__ a,
+      const float *__restrict__ b) {
+    auto a4 = reinterpret_cast<const float4*>(a);
+    auto b4 = reinterpret_cast<const float4*>(b);
+    float sum = 0;
+    #pragma unroll
+    for (int f = 0; f < D / 4; f++) {
+      float4 x = a4[f], y = b4[f];
+      sum += x.x * y.x;
+      sum += x.y * y.y;
+      sum += x.z * y.z;
+      sum += x.w * y.w;
+    }
+    return sum;
+  }
+
+  __device__ __forceinline__ static float distance(
+      const KMCUDAContext &, const float *__restrict__ a,
+      const float *__restrict__ b) {
+    auto a4 = reinterpret_cast<const float4*>(a);
+    auto b4 = reinterpret_cast<const float4*>(b);
+    float sum = 0;
+    #pragma unroll
+    for (int f = 0; f < D / 4; f++) {
+      float4 x = a4[f], y = b4[f];
+      float d = x.x - y.x;
+      sum += d * d;
+      d = x.y - y.y;
+      sum += d * d;
+      d = x.z - y.z;
+      sum += d * d;
+      d = x.w - y.w;
+      sum += d * d;
+    }
+    return sum;
+  }
+
+  __device__ __forceinline__ static float copy(
+      const KMCUDAContext &, const float *__restrict__ src,
+      float *__restrict__ dest) {
+    auto src4 = reinterpret_cast<const float4*>(src);
+    auto dest4 = reinterpret_cast<float4*>(dest);
+    float sum = 0;
+    #pragma unroll
+    for (int f = 0; f < D / 4; f++) {
+      float4 v = src4[f];
+      dest4[f] = v;
+      sum += v.x * v.x;
+      sum += v.y * v.y;
+      sum += v.z * v.z;
+      sum += v.w * v.w;
+    }
+    return sum;
+  }
+};
+
+/// The global index of the thread, it exceeds 32 bits with KMCUDA_INDEX64.
+__device__ __forceinline__ KMCUDASampleIndex thread_sample() {
+  return static_cast<KMCUDASampleIndex>(blockIdx.x) * blockDim.x + threadIdx.x;
+}
+
+__device__ __forceinline__ void log_reassignment(
+    const KMCUDAContext &ctx, KMCUDASampleIndex sample, uint32_t prev,
+    uint64_t *reassignments) {
+  KMCUDACounter index = atomicAdd(&ctx.counters->changed, 1);
+  // on overflow, kmeans_recalculate() is used instead of kmeans_adjust()
+  if (index < REASSIGNMENTS_CAPACITY(ctx.samples_size)) {
+    // the unassigned label is truncated to all ones which is never a cluster
+    uint64_t mask = (1ull << ctx.cluster_bits) - 1;
+    reassignments[index] =
+        (static_cast<uint64_t>(sample) << ctx.cluster_bits) | (prev & mask);
+  }
+}
+
+/// the shared memory of accumulate_stats() for the block of the given size.
+#define STATS_SHMEM_SIZE(block) (4 * (block) * sizeof(uint32_t))
+
+/// stats are ctx.clusters_size counts (KMCUDACounter), then ctx.clusters_size
+/// sums of squared distances, then ctx.clusters_size squared radiuses. The
+/// float sums are only reported per cluster, the inertia is summed separately
+/// in double by accumulate_inertia().
+/// dist is the squared distance from the sample to cluster which the caller
+/// has already calculated, cluster is UINT32_MAX if the thread has nothing to
+/// add. The block first merges the samples of the same cluster in shared
+/// memory (scratch of STATS_SHMEM_SIZE(blockDim.x) bytes): the first thread
+/// with the cluster leads. So only the distinct clusters of the block reach
+/// the global atomics. The cost is three block barriers and a scan of up to
+/// blockDim.x shared words per thread: kmeans_assign_lloyd() pays it, plus
+/// one direct distance per sample, in every Lloyd pass because any pass may
+/// be the last, kmeans_calc_stats() once.
+/// Every thread which has not exited must call this. The exited threads must
+/// be the trailing ones of the block, as it is for the samples out of range.
+__device__ void accumulate_stats(
+    const KMCUDAContext &ctx, uint32_t cluster, float dist, uint32_t *scratch,
+    uint32_t *stats) {
+  uint32_t *keys = scratch;
+  uint32_t *local_counts = keys + blockDim.x;
+  float *local_sums = reinterpret_cast<float*>(local_counts + blockDim.x);
+  uint32_t *local_maxs = reinterpret_cast<uint32_t*>(local_sums + blockDim.x);
+  // the caller may still read the shared memory
+  __syncthreads();
+  keys[threadIdx.x] = cluster;
+  local_counts[threadIdx.x] = 0;
+  local_sums[threadIdx.x] = 0;
+  local_maxs[threadIdx.x] = 0;
+  __syncthreads();
+  if (cluster < ctx.clusters_size) {
+    // the leader is not after this thread, so it has not exited
+    uint32_t leader = 0;
+    while (keys[leader] != cluster) {
+      leader++;
+    }
+    // the expanded distance formula may go slightly below zero
+    dist = dist > 0? dist : 0;
+    atomicAdd(local_counts + leader, 1);
+    atomicAdd(local_sums + leader, dist);
+    // non-negative floats are ordered the same way as their bits
+    atomicMax(local_maxs + leader, __float_as_uint(dist));
+  }
+  __syncthreads();
+  if (local_counts[threadIdx.x] > 0) {
+    KMCUDACounter *counts = reinterpret_cast<KMCUDACounter*>(stats);
+    atomicAdd(counts + cluster,
+              static_cast<KMCUDACounter>(local_counts[threadIdx.x]));
+    uint32_t *sums = reinterpret_cast<uint32_t*>(counts + ctx.clusters_size);
+    atomicAdd(reinterpret_cast<float*>(sums) + cluster,
+              local_sums[threadIdx.x]);
+    atomicMax(sums + ctx.clusters_size + cluster, local_maxs[threadIdx.x]);
+  }
+}
+
+/// The squared distance which the statistics report: the direct difference,
+/// unlike the expanded formula of the assignment, which loses the precision
+/// far from the origin. Every path calls this, so the same clustering always
+/// gets the same statistics.
+template <typename F>
+__device__ __forceinline__ F stats_distance(
+    const KMCUDAContext &ctx, const F *__restrict__ sample,
+    const F *__restrict__ centroid) {
+  F dist = 0;
+  #pragma unroll 4
+  for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
+    F d = sample[f] - centroid[f];
+    dist += d * d;
+  }
+  return dist;
+}
 
+/// Writes the sum of dist over the block to inertias[blockIdx.x] in the same
+/// sequential order in every run, unlike the atomics. sample is the sample
+/// of the thread in the natural order, dist is 0 if it has nothing to add.
+/// Needs blockDim.x doubles of shared memory and the same calling discipline
+/// as accumulate_stats().
+__device__ void accumulate_inertia(
+    const KMCUDAContext &ctx, KMCUDASampleIndex sample, double dist,
+    double *inertias) {
+  double *local_dists = shared_memory<double>();
+  // the caller may still read the shared memory
+  __syncthreads();
+  local_dists[threadIdx.x] = dist;
+  uint32_t end = blockDim.x;
+  KMCUDASampleIndex block_begin = sample - threadIdx.x;
+  if (block_begin + blockDim.x > ctx.samples_size) {
+    end = ctx.samples_size - block_begin;
+  }
+  __syncthreads();
+  if (threadIdx.x % 16 == 0) {
+    double psum = 0;
+    for (uint32_t i = threadIdx.x; i < end && i < threadIdx.x + 16; i++) {
+      psum += local_dists[i];
+    }
+    local_dists[threadIdx.x] = psum;
+  }
+  __syncthreads();
+  if (threadIdx.x == 0) {
+    double block_sum = 0;
+    for (uint32_t i = 0; i < end; i += 16) {
+      block_sum += local_dists[i];
+    }
+    inertias[blockIdx.x] = block_sum;
+  }
+}
+
+template <typename F>
 __global__ void kmeans_plus_plus(
-    uint32_t cc, const float *__restrict__ samples,
-    const float *__restrict__ centroids, float *dists,
-    float *dist_sums) {
-  uint32_t sample = blockIdx.x * blockDim.x + threadIdx.x;
-  if (sample >= samples_size) {
+    const KMCUDAContext ctx, uint32_t cc, const F *__restrict__ samples,
+    const F *__restrict__ centroids, float *dists, float *dist_sums) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
     return;
   }
-  samples += static_cast<uint64_t>(sample) * features_size;
+  samples += static_cast<uint64_t>(sample) * ctx.features_size;
   extern __shared__ float local_dists[];
   float dist = 0;
   if (samples[0] == samples[0]) {
-    uint32_t coffset = (cc - 1) * features_size;
+    uint64_t coffset = static_cast<uint64_t>(cc - 1) * ctx.features_size;
+    F precise_dist = 0;
     #pragma unroll 4
-    for (uint16_t f = 0; f < features_size; f++) {
-      float d = samples[f] - centroids[coffset + f];
-      dist += d * d;
+    for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
+      F d = samples[f] - centroids[coffset + f];
+      precise_dist += d * d;
     }
-    dist = sqrt(dist);
+    // the sampling weights do not need more precision
+    dist = sqrt(precise_dist);
+    COUNT_DISTANCES(1);
   }
   float prev_dist = dists[sample];
   if (dist < prev_dist || cc == 1) {
@@ -65,8 +355,9 @@ __global__ void kmeans_plus_plus(
   }
   local_dists[threadIdx.x] = dist;
   uint32_t end = blockDim.x;
-  if ((blockIdx.x + 1) * blockDim.x > samples_size) {
-    end = samples_size - blockIdx.x * blockDim.x;
+  KMCUDASampleIndex block_begin = sample - threadIdx.x;
+  if (block_begin + blockDim.x > ctx.samples_size) {
+    end = ctx.samples_size - block_begin;
   }
   __syncthreads();
   if (threadIdx.x % 16 == 0) {
@@ -86,47 +377,52 @@ __global__ void kmeans_plus_plus(
   }
 }
 
+/// If passed is not nullptr, only the samples listed there are assigned,
+/// their number is ctx.counters->passed_number.
+/// stats is either nullptr or the buffer described in kmeans_cuda_yy() which
+/// receives the statistics of the new assignments, the caller clears it. The
+/// distance to the nearest centroid is recalculated with stats_distance(). Only with passed == nullptr: the blocks must
+/// cover the samples in the natural order, BS_LL_ASS is BS_STATS.
+/// D is the number of features known at compile time or 0, see Features.
+template <typename F, typename L, int D>
 __global__ void kmeans_assign_lloyd(
-    const float *__restrict__ samples, const float *__restrict__ centroids,
-    uint32_t *assignments_prev, uint32_t *assignments) {
-  uint32_t sample = blockIdx.x * blockDim.x + threadIdx.x;
-  if (sample >= samples_size) {
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const F *__restrict__ centroids, const KMCUDASampleIndex *__restrict__ passed,
+    uint64_t *reassignments, L *assignments, uint32_t *stats) {
+  typedef Features<F, D> features;
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= (passed == nullptr? ctx.samples_size
+                                  : ctx.counters->passed_number)) {
     return;
   }
+  if (passed != nullptr) {
+    sample = passed[sample];
+  }
+  const KMCUDAFeatureIndex features_size = features::size(ctx);
   samples += static_cast<uint64_t>(sample) * features_size;
-  float min_dist = FLT_MAX;
+  F min_dist = FLT_MAX;
   uint32_t nearest = UINT32_MAX;
-  extern __shared__ float shared_centroids[];
-  const uint32_t cstep = shmem_size / (features_size + 1);
-  float *csqrs = shared_centroids + cstep * features_size;
+  F *shared_centroids = shared_memory<F>();
+  const uint32_t cstep = shmem_capacity<F>(ctx) / (features_size + 1);
+  F *csqrs = shared_centroids + cstep * features_size;
   const uint32_t size_each = cstep / blockDim.x + 1;
   bool insane = samples[0] != samples[0];
-  float ssqr = 0;
+  F ssqr = 0;
   if (!insane) {
-    #pragma unroll 4
-    for (int f = 0; f < features_size; f++) {
-      float v = samples[f];
-      ssqr += v * v;
-    }
+    ssqr = features::dot(ctx, samples, samples);
   }
 
-  for (uint32_t gc = 0; gc < clusters_size; gc += cstep) {
-    uint32_t coffset = gc * features_size;
+  for (uint32_t gc = 0; gc < ctx.clusters_size; gc += cstep) {
+    uint64_t coffset = static_cast<uint64_t>(gc) * features_size;
     __syncthreads();
     if (threadIdx.x * size_each < cstep) {
       for (uint32_t i = 0; i < size_each; i++) {
         uint32_t ci = threadIdx.x * size_each + i;
         uint32_t local_offset = ci * features_size;
-        uint32_t global_offset = coffset + local_offset;
-        if (global_offset < clusters_size * features_size) {
-          float csqr = 0;
-          #pragma unroll 4
-          for (int f = 0; f < features_size; f++) {
-            float v = centroids[global_offset + f];
-            shared_centroids[local_offset + f] = v;
-            csqr += v * v;
-          }
-          csqrs[ci] = csqr;
+        uint64_t global_offset = coffset + local_offset;
+        if (global_offset < static_cast<uint64_t>(ctx.clusters_size) * features_size) {
+          csqrs[ci] = features::copy(
+              ctx, centroids + global_offset, shared_centroids + local_offset);
         }
       }
     }
@@ -134,13 +430,9 @@ __global__ void kmeans_assign_lloyd(
     if (insane) {
       continue;
     }
-    for (uint32_t c = gc; c < gc + cstep && c < clusters_size; c++) {
-      float dist = 0;
-      coffset = (c - gc) * features_size;
-      #pragma unroll 4
-      for (int f = 0; f < features_size; f++) {
-        dist += samples[f] * shared_centroids[coffset + f];
-      }
+    for (uint32_t c = gc; c < gc + cstep && c < ctx.clusters_size; c++) {
+      F dist = features::dot(
+          ctx, samples, shared_centroids + (c - gc) * features_size);
       dist = ssqr + csqrs[c - gc] - 2 * dist;
       if (dist < min_dist) {
         min_dist = dist;
@@ -148,51 +440,246 @@ __global__ void kmeans_assign_lloyd(
       }
     }
   }
+  if (!insane) {
+    COUNT_DISTANCES(ctx.clusters_size);
+  }
+  bool found = true;
   if (nearest == UINT32_MAX) {
     if (!insane) {
       printf("CUDA kernel kmeans_assign: nearest neighbor search failed for "
-             "sample %" PRIu32 "\n", sample);
-      return;
+             "sample %" PRIuSAMPLE "\n", sample);
+      // no return: the rest of the block may still accumulate the stats
+      found = false;
     } else {
-      nearest = clusters_size;
+      nearest = ctx.clusters_size;
     }
   }
-  uint32_t ass = assignments[sample];
-  assignments_prev[sample] = ass;
-  if (ass != nearest) {
-    assignments[sample] = nearest;
-    atomicAdd(&changed, 1);
+  if (found) {
+    L ass = assignments[sample];
+    if (ass != nearest) {
+      assignments[sample] = nearest;
+      log_reassignment(ctx, sample, ass, reassignments);
+    }
+  }
+  if (stats != nullptr) {
+    bool counted = found && !insane;
+    F dist = 0;
+    if (counted) {
+      // min_dist is only good for the comparison, see stats_distance()
+      dist = stats_distance(
+          ctx, samples, centroids + static_cast<uint64_t>(nearest) * features_size);
+      COUNT_DISTANCES(1);
+    }
+    accumulate_stats(ctx, counted? nearest : UINT32_MAX, dist,
+                     shared_memory<uint32_t>(),
+                     stats + gridDim.x * sizeof(double) / sizeof(uint32_t));
+    accumulate_inertia(ctx, sample, dist, reinterpret_cast<double*>(stats));
   }
 }
 
-__global__ void kmeans_adjust(
-    const float *__restrict__ samples, const uint32_t *__restrict__ assignments_prev,
-    const uint32_t *__restrict__ assignments, float *centroids, uint32_t *ccounts) {
+/// Builds the k-NN graph over the centroids: the neighbors_size nearest
+/// other centroids of each centroid in ascending order of the distance,
+/// the distance to the farthest of them and the squared norm of the centroid.
+/// If there are fewer other centroids, the rest of the row repeats the centroid
+/// itself and the radius is FLT_MAX.
+/// D is the number of features known at compile time or 0, see Features.
+template <typename F, int D>
+__global__ void kmeans_centroid_neighbors(
+    const KMCUDAContext ctx, const F *__restrict__ centroids,
+    uint32_t neighbors_size, uint32_t *neighbors, F *radiuses,
+    F *csqrs) {
+  typedef Features<F, D> features;
+  const KMCUDAFeatureIndex features_size = features::size(ctx);
   uint32_t c = blockIdx.x * blockDim.x + threadIdx.x;
-  if (c >= clusters_size) {
+  bool active = c < ctx.clusters_size;
+  F dists[KMCUDA_MAX_NEIGHBORS];
+  uint32_t ids[KMCUDA_MAX_NEIGHBORS];
+  for (uint32_t i = 0; i < neighbors_size; i++) {
+    dists[i] = FLT_MAX;
+    ids[i] = c;
+  }
+  const F *centroid = centroids + static_cast<uint64_t>(c) * features_size;
+  F *shared_centroids = shared_memory<F>();
+  const uint32_t cstep = shmem_capacity<F>(ctx) / features_size;
+  const uint32_t size_each = cstep / blockDim.x + 1;
+
+  for (uint32_t gc = 0; gc < ctx.clusters_size; gc += cstep) {
+    uint64_t coffset = static_cast<uint64_t>(gc) * features_size;
+    __syncthreads();
+    if (threadIdx.x * size_each < cstep) {
+      for (uint32_t i = 0; i < size_each; i++) {
+        uint32_t local_offset = (threadIdx.x * size_each + i) * features_size;
+        uint64_t global_offset = coffset + local_offset;
+        if (global_offset < static_cast<uint64_t>(ctx.clusters_size) * features_size) {
+          features::copy(ctx, centroids + global_offset,
+                         shared_centroids + local_offset);
+        }
+      }
+    }
+    __syncthreads();
+    if (!active) {
+      continue;
+    }
+    for (uint32_t other = gc; other < gc + cstep && other < ctx.clusters_size;
+         other++) {
+      if (other == c) {
+        continue;
+      }
+      F dist = features::distance(
+          ctx, centroid, shared_centroids + (other - gc) * features_size);
+      // insane (NaN) centroids never get into the graph
+      if (!(dist < dists[neighbors_size - 1])) {
+        continue;
+      }
+      uint32_t i = neighbors_size - 1;
+      for (; i > 0 && dists[i - 1] > dist; i--) {
+        dists[i] = dists[i - 1];
+        ids[i] = ids[i - 1];
+      }
+      dists[i] = dist;
+      ids[i] = other;
+    }
+  }
+  if (!active) {
+    return;
+  }
+  neighbors += c * neighbors_size;
+  for (uint32_t i = 0; i < neighbors_size; i++) {
+    neighbors[i] = ids[i];
+  }
+  F dist = dists[neighbors_size - 1];
+  radiuses[c] = dist < FLT_MAX? sqrt(dist) : FLT_MAX;
+  // the same sum as features::copy() gives kmeans_assign_lloyd()
+  csqrs[c] = features::dot(ctx, centroid, centroid);
+}
+
+/// Searches the nearest centroid among the current one and its graph
+/// neighbors. Any other centroid o is at least radiuses[current] far from
+/// the current centroid, so by the triangle inequality it is at least
+/// radiuses[current] - d(sample, current) far from the sample. If the best
+/// candidate is closer than that, the result is exact. Otherwise (or if the
+/// sample has not been assigned yet) the sample is passed to the full scan,
+/// unless approximate is true, and UINT32_MAX is returned.
+/// The distances are calculated by the same Features<F, D> routines as in
+/// kmeans_assign_lloyd(), so both kernels agree on the ties.
+template <typename F, int D>
+__device__ uint32_t neighbors_nearest(
+    const KMCUDAContext &ctx, KMCUDASampleIndex sample,
+    const F *__restrict__ samples, uint32_t cluster,
+    const F *__restrict__ centroids, uint32_t neighbors_size,
+    const uint32_t *__restrict__ neighbors, const F *__restrict__ radiuses,
+    const F *__restrict__ csqrs, bool approximate, KMCUDASampleIndex *passed) {
+  if (cluster >= ctx.clusters_size) {
+    passed[atomicAdd(&ctx.counters->passed_number, 1)] = sample;
+    return UINT32_MAX;
+  }
+  typedef Features<F, D> features;
+  const KMCUDAFeatureIndex features_size = features::size(ctx);
+  F ssqr = features::dot(ctx, samples, samples);
+  // the same formula as in kmeans_assign_lloyd(), ties go to the lower index
+  F min_dist = FLT_MAX;
+  uint32_t nearest = cluster;
+  neighbors += cluster * neighbors_size;
+  for (uint32_t i = 0; i <= neighbors_size; i++) {
+    uint32_t c = i == 0? cluster : neighbors[i - 1];
+    F dist = features::dot(
+        ctx, samples, centroids + static_cast<uint64_t>(c) * features_size);
+    dist = ssqr + csqrs[c] - 2 * dist;
+    if (dist < min_dist || (dist == min_dist && c < nearest)) {
+      min_dist = dist;
+      nearest = c;
+    }
+  }
+  COUNT_DISTANCES(neighbors_size + 1);
+  if (!approximate) {
+    F own_dist = features::distance(
+        ctx, samples,
+        centroids + static_cast<uint64_t>(cluster) * features_size);
+    COUNT_DISTANCES(1);
+    F bound = radiuses[cluster] - sqrt(own_dist);
+    // the margin covers the rounding errors of the two distance formulas
+    if (!(sqrt(fmax(min_dist, F(0))) <
+          bound * (1 - NEIGHBORS_CERTIFICATE_MARGIN))) {
+      passed[atomicAdd(&ctx.counters->passed_number, 1)] = sample;
+      return UINT32_MAX;
+    }
+  }
+  return nearest;
+}
+
+/// Assigns the samples with neighbors_nearest().
+/// D is the number of features known at compile time or 0, see Features.
+template <typename F, typename L, int D>
+__global__ void kmeans_assign_neighbors(
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const F *__restrict__ centroids, uint32_t neighbors_size,
+    const uint32_t *__restrict__ neighbors, const F *__restrict__ radiuses,
+    const F *__restrict__ csqrs, bool approximate, KMCUDASampleIndex *passed,
+    uint64_t *reassignments, L *assignments) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
+    return;
+  }
+  uint32_t cluster = assignments[sample];
+  // insane samples keep the invalid cluster assigned by the full scan,
+  // the sentinel is checked first to skip reading them at all
+  if (cluster == ctx.clusters_size) {
     return;
   }
-  uint32_t my_count = ccounts[c];
-  centroids += c * features_size;
-  for (int f = 0; f < features_size; f++) {
-    centroids[f] *= my_count;
+  samples += static_cast<uint64_t>(sample) * Features<F, D>::size(ctx);
+  if (samples[0] != samples[0]) {
+    return;
   }
-  extern __shared__ uint32_t ass[];
-  int step = shmem_size / 2;
-  for (uint32_t sbase = 0; sbase < samples_size; sbase += step) {
+  uint32_t nearest = neighbors_nearest<F, D>(
+      ctx, sample, samples, cluster, centroids, neighbors_size, neighbors,
+      radiuses, csqrs, approximate, passed);
+  if (nearest == UINT32_MAX) {
+    return;
+  }
+  if (cluster != nearest) {
+    assignments[sample] = nearest;
+    log_reassignment(ctx, sample, cluster, reassignments);
+  }
+}
+
+template <typename F, typename L>
+__global__ void kmeans_adjust(
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const uint64_t *__restrict__ reassignments,
+    KMCUDASampleIndex reassignments_number, const L *__restrict__ assignments,
+    F *centroids, KMCUDASampleIndex *ccounts) {
+  uint32_t c = blockIdx.x * blockDim.x + threadIdx.x;
+  bool active = c < ctx.clusters_size;
+  KMCUDASampleIndex my_count = 0;
+  if (active) {
+    my_count = ccounts[c];
+    centroids += static_cast<uint64_t>(c) * ctx.features_size;
+    for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
+      centroids[f] *= my_count;
+    }
+  }
+  // the records followed by the new clusters, 3 words per reassignment
+  const uint32_t step = ctx.shmem_size / 3;
+  uint64_t *records = shared_memory<uint64_t>();
+  uint32_t *news = reinterpret_cast<uint32_t*>(records + step);
+  const uint64_t mask = (1ull << ctx.cluster_bits) - 1;
+  for (KMCUDASampleIndex rbase = 0; rbase < reassignments_number;
+       rbase += step) {
     __syncthreads();
-    if (threadIdx.x == 0) {
-      int pos = sbase;
-      for (int i = 0; i < step && sbase + i < samples_size; i++) {
-        ass[2 * i] = assignments[pos + i];
-        ass[2 * i + 1] = assignments_prev[pos + i];
-      }
+    for (uint32_t i = threadIdx.x; i < step && rbase + i < reassignments_number;
+         i += blockDim.x) {
+      uint64_t record = reassignments[rbase + i];
+      records[i] = record;
+      news[i] = assignments[record >> ctx.cluster_bits];
     }
     __syncthreads();
-    for (int i = 0; i < step && sbase + i < samples_size; i++) {
-      uint32_t this_ass = ass[2 * i];
-      uint32_t  prev_ass = ass[2 * i + 1];
-      float sign = 0;
+    if (!active) {
+      continue;
+    }
+    for (uint32_t i = 0; i < step && rbase + i < reassignments_number; i++) {
+      uint32_t prev_ass = records[i] & mask;
+      uint32_t this_ass = news[i];
+      F sign = 0;
       if (prev_ass == c && this_ass != c) {
         sign = -1;
         my_count--;
@@ -201,74 +688,123 @@ __global__ void kmeans_adjust(
         my_count++;
       }
       if (sign != 0) {
-        uint64_t soffset = sbase + i;
-        soffset *= features_size;
+        uint64_t soffset = records[i] >> ctx.cluster_bits;
+        soffset *= ctx.features_size;
         #pragma unroll 4
-        for (int f = 0; f < features_size; f++) {
+        for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
           centroids[f] += samples[soffset + f] * sign;
         }
       }
     }
   }
+  if (!active) {
+    return;
+  }
   // my_count can be 0 => we get NaN and never use this cluster again
   // this is a feature, not a bug
   #pragma unroll 4
-  for (int f = 0; f < features_size; f++) {
+  for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
     centroids[f] /= my_count;
   }
   ccounts[c] = my_count;
 }
 
+template <typename F, typename L>
+__global__ void kmeans_recalculate(
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const L *__restrict__ assignments, F *centroids,
+    KMCUDASampleIndex *ccounts) {
+  uint32_t c = blockIdx.x * blockDim.x + threadIdx.x;
+  bool active = c < ctx.clusters_size;
+  KMCUDASampleIndex my_count = 0;
+  if (active) {
+    centroids += static_cast<uint64_t>(c) * ctx.features_size;
+    for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
+      centroids[f] = 0;
+    }
+  }
+  extern __shared__ uint32_t shmem[];
+  L *ass = reinterpret_cast<L*>(shmem);
+  const uint32_t step = ctx.shmem_size * sizeof(uint32_t) / sizeof(L);
+  for (KMCUDASampleIndex sbase = 0; sbase < ctx.samples_size; sbase += step) {
+    __syncthreads();
+    for (uint32_t i = threadIdx.x; i < step && sbase + i < ctx.samples_size;
+         i += blockDim.x) {
+      ass[i] = assignments[sbase + i];
+    }
+    __syncthreads();
+    if (!active) {
+      continue;
+    }
+    for (uint32_t i = 0; i < step && sbase + i < ctx.samples_size; i++) {
+      if (ass[i] == c) {
+        my_count++;
+        uint64_t soffset = sbase + i;
+        soffset *= ctx.features_size;
+        #pragma unroll 4
+        for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
+          centroids[f] += samples[soffset + f];
+        }
+      }
+    }
+  }
+  if (!active) {
+    return;
+  }
+  // see kmeans_adjust() about my_count == 0
+  #pragma unroll 4
+  for (KMCUDAFeatureIndex f = 0; f < ctx.features_size; f++) {
+    centroids[f] /= my_count;
+  }
+  ccounts[c] = my_count;
+}
+
+/// D is the number of features known at compile time or 0, see Features.
+template <typename F, typename L, int D>
 __global__ void kmeans_yy_init(
-    const float *__restrict__ samples, const float *__restrict__ centroids,
-    const uint32_t *__restrict__ assignments, const uint32_t *__restrict__ groups,
-    float *bounds) {
-  uint32_t sample = blockIdx.x * blockDim.x + threadIdx.x;
-  if (sample >= samples_size) {
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const F *__restrict__ centroids, const L *__restrict__ assignments,
+    const L *__restrict__ groups, F *bounds) {
+  typedef Features<F, D> features;
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
     return;
   }
-  bounds += static_cast<uint64_t>(sample) * (yy_groups_size + 1);
-  for (uint32_t i = 0; i < yy_groups_size + 1; i++) {
+  bounds += static_cast<uint64_t>(sample) * (ctx.yy_groups_size + 1);
+  for (uint32_t i = 0; i < ctx.yy_groups_size + 1; i++) {
     bounds[i] = FLT_MAX;
   }
   bounds++;
+  const KMCUDAFeatureIndex features_size = features::size(ctx);
   samples += static_cast<uint64_t>(sample) * features_size;
   uint32_t nearest = assignments[sample];
-  extern __shared__ float shared_centroids[];
-  const uint32_t cstep = shmem_size / features_size;
+  F *shared_centroids = shared_memory<F>();
+  const uint32_t cstep = shmem_capacity<F>(ctx) / features_size;
   const uint32_t size_each = cstep / blockDim.x + 1;
 
-  for (uint32_t gc = 0; gc < clusters_size; gc += cstep) {
-    uint32_t coffset = gc * features_size;
+  for (uint32_t gc = 0; gc < ctx.clusters_size; gc += cstep) {
+    uint64_t coffset = static_cast<uint64_t>(gc) * features_size;
     __syncthreads();
     if (threadIdx.x * size_each < cstep) {
       for (uint32_t i = 0; i < size_each; i++) {
         uint32_t local_offset = (threadIdx.x * size_each + i) * features_size;
-        uint32_t global_offset = coffset + local_offset;
-        if (global_offset < clusters_size * features_size) {
-          #pragma unroll 4
-          for (int f = 0; f < features_size; f++) {
-            shared_centroids[local_offset + f] = centroids[global_offset + f];
-          }
+        uint64_t global_offset = coffset + local_offset;
+        if (global_offset < static_cast<uint64_t>(ctx.clusters_size) * features_size) {
+          features::copy(
+              ctx, centroids + global_offset, shared_centroids + local_offset);
         }
       }
     }
     __syncthreads();
 
-    for (uint32_t c = gc; c < gc + cstep && c < clusters_size; c++) {
-      float dist = 0;
-      coffset = (c - gc) * features_size;
+    for (uint32_t c = gc; c < gc + cstep && c < ctx.clusters_size; c++) {
       uint32_t group = groups[c];
-      if (group >= yy_groups_size) {
+      if (group >= ctx.yy_groups_size) {
         // this may happen if the centroid is insane (NaN)
         continue;
       }
-      #pragma unroll 4
-      for (int f = 0; f < features_size; f++) {
-        float d = samples[f] - shared_centroids[coffset + f];
-        dist += d * d;
-      }
-      dist = sqrt(dist);
+      F dist = sqrt(features::distance(
+          ctx, samples, shared_centroids + (c - gc) * features_size));
       if (c != nearest) {
         if (dist < bounds[group]) {
           bounds[group] = dist;
@@ -278,79 +814,110 @@ __global__ void kmeans_yy_init(
       }
     }
   }
+  COUNT_DISTANCES(ctx.clusters_size);
 }
 
+/// If max_shift is not nullptr, also raises it to the maximal drift, so that
+/// the host reads a single float, see fetch_max_shift(). The caller clears it.
+template <typename F>
 __global__ void kmeans_yy_calc_drifts(
-    const float *__restrict__ centroids, float *drifts) {
+    const KMCUDAContext ctx, const F *__restrict__ centroids,
+    F *drifts, float *max_shift) {
   uint32_t c = blockIdx.x * blockDim.x + threadIdx.x;
-  if (c >= clusters_size) {
+  __shared__ uint32_t block_max;
+  if (threadIdx.x == 0) {
+    block_max = 0;
+  }
+  float drift = 0;
+  if (c < ctx.clusters_size) {
+    uint64_t coffset = static_cast<uint64_t>(c) * ctx.features_size;
+    F sum = 0;
+    for (uint64_t f = coffset; f < coffset + ctx.features_size; f++) {
+      F d = centroids[f] - drifts[f];
+      sum += d * d;
+    }
+    F precise_drift = sqrt(sum);
+    drifts[static_cast<uint64_t>(ctx.clusters_size) * ctx.features_size + c] =
+        precise_drift;
+    drift = precise_drift;
+  }
+  if (max_shift == nullptr) {
     return;
   }
-  uint32_t coffset = c * features_size;
-  float sum = 0;
-  for (uint32_t f = coffset; f < coffset + features_size; f++) {
-    float d = centroids[f] - drifts[f];
-    sum += d * d;
+  __syncthreads();
+  // NaN-s are skipped, non-negative floats are ordered the same way as
+  // their bits
+  if (drift > 0) {
+    atomicMax(&block_max, __float_as_uint(drift));
+  }
+  __syncthreads();
+  if (threadIdx.x == 0 && block_max > 0) {
+    atomicMax(reinterpret_cast<uint32_t*>(max_shift), block_max);
   }
-  drifts[clusters_size * features_size + c] = sqrt(sum);
 }
 
+template <typename F, typename L>
 __global__ void kmeans_yy_find_group_max_drifts(
-    const uint32_t *__restrict__ groups, float *drifts) {
+    const KMCUDAContext ctx, const L *__restrict__ groups, F *drifts) {
   uint32_t group = blockIdx.x * blockDim.x + threadIdx.x;
-  if (group >= yy_groups_size) {
-    return;
-  }
-  const uint32_t doffset = clusters_size * features_size;
-  const uint32_t size_each = shmem_size / (2 * blockDim.x);
+  // the rest of the threads still stage the drifts
+  const bool active = group < ctx.yy_groups_size;
+  const uint64_t doffset =
+      static_cast<uint64_t>(ctx.clusters_size) * ctx.features_size;
+  const uint32_t size_each = ctx.shmem_size * sizeof(uint32_t) /
+      ((sizeof(F) + sizeof(uint32_t)) * blockDim.x);
   const uint32_t step = size_each * blockDim.x;
   extern __shared__ uint32_t shmem[];
-  float *cd = (float *)shmem;
-  uint32_t *cg = shmem + shmem_size / 2;
-  float my_max = FLT_MIN;
-  for (uint32_t offset = 0; offset < clusters_size; offset += step) {
+  F *cd = reinterpret_cast<F*>(shmem);
+  uint32_t *cg = reinterpret_cast<uint32_t*>(cd + step);
+  F my_max = FLT_MIN;
+  for (uint32_t offset = 0; offset < ctx.clusters_size; offset += step) {
     __syncthreads();
     for (uint32_t i = 0; i < size_each; i++) {
       uint32_t local_offset = threadIdx.x * size_each + i;
       uint32_t global_offset = offset + local_offset;
-      if (global_offset < clusters_size) {
+      if (global_offset < ctx.clusters_size) {
         cd[local_offset] = drifts[doffset + global_offset];
         cg[local_offset] = groups[global_offset];
       }
     }
     __syncthreads();
-    for (uint32_t i = 0; i < step; i++) {
+    for (uint32_t i = 0; active && i < step && offset + i < ctx.clusters_size;
+         i++) {
       if (cg[i] == group) {
-        float d = cd[i];
+        F d = cd[i];
         if (my_max < d) {
           my_max = d;
         }
       }
     }
   }
-  drifts[group] = my_max;
+  if (active) {
+    drifts[group] = my_max;
+  }
 }
 
+template <typename F, typename L>
 __global__ void kmeans_yy_global_filter(
-    const float *__restrict__ samples, const float *__restrict__ centroids,
-    const uint32_t *__restrict__ groups, const float *__restrict__ drifts,
-    const uint32_t *__restrict__ assignments,
-    uint32_t *assignments_prev, float *bounds, uint32_t *passed) {
-  uint32_t sample = blockIdx.x * blockDim.x + threadIdx.x;
-  if (sample >= samples_size) {
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const F *__restrict__ centroids, const L *__restrict__ groups,
+    const F *__restrict__ drifts, const L *__restrict__ assignments,
+    F *bounds, KMCUDASampleIndex *passed) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
     return;
   }
-  bounds += static_cast<uint64_t>(sample) * (yy_groups_size + 1);
+  bounds += static_cast<uint64_t>(sample) * (ctx.yy_groups_size + 1);
   uint32_t cluster = assignments[sample];
-  assignments_prev[sample] = cluster;
-  float upper_bound = bounds[0];
-  uint32_t doffset = clusters_size * features_size;
-  float cluster_drift = drifts[doffset + cluster];
+  F upper_bound = bounds[0];
+  uint64_t doffset =
+      static_cast<uint64_t>(ctx.clusters_size) * ctx.features_size;
+  F cluster_drift = drifts[doffset + cluster];
   upper_bound += cluster_drift;
   bounds++;
-  float min_lower_bound = FLT_MAX;
-  for (uint32_t g = 0; g < yy_groups_size; g++) {
-    float lower_bound = bounds[g] - drifts[g];
+  F min_lower_bound = FLT_MAX;
+  for (uint32_t g = 0; g < ctx.yy_groups_size; g++) {
+    F lower_bound = bounds[g] - drifts[g];
     bounds[g] = lower_bound;
     if (lower_bound < min_lower_bound) {
       min_lower_bound = lower_bound;
@@ -363,190 +930,760 @@ __global__ void kmeans_yy_global_filter(
     return;
   }
   upper_bound = 0;
-  samples += static_cast<uint64_t>(sample) * features_size;
-  uint32_t coffset = cluster * features_size;
+  samples += static_cast<uint64_t>(sample) * ctx.features_size;
+  uint64_t coffset = static_cast<uint64_t>(cluster) * ctx.features_size;
   #pragma unroll 4
-  for (uint32_t f = 0; f < features_size; f++) {
-    float d = samples[f] - centroids[coffset + f];
+  for (uint32_t f = 0; f < ctx.features_size; f++) {
+    F d = samples[f] - centroids[coffset + f];
     upper_bound += d * d;
   }
   upper_bound = sqrt(upper_bound);
+  COUNT_DISTANCES(1);
   bounds[0] = upper_bound;
   // group filter try #2
   if (min_lower_bound >= upper_bound) {
     return;
   }
   // D'oh!
-  passed[atomicAdd(&passed_number, 1)] = sample;
+  passed[atomicAdd(&ctx.counters->passed_number, 1)] = sample;
 }
 
+/// The persistent blocks fetch the chunks of passed from
+/// ctx.counters->passed_cursor until it reaches passed_number, so the blocks
+/// which got the cheap samples take more of them. The chunks shrink as the
+/// list drains to even out the tail.
+/// D is the number of features known at compile time or 0, see Features.
+template <typename F, typename L, int D>
 __global__ void kmeans_yy_local_filter(
-    const float *__restrict__ samples, const uint32_t *__restrict__ passed,
-    const float *__restrict__ centroids, const uint32_t *__restrict__ groups,
-    const float *__restrict__ drifts, uint32_t *assignments, float *bounds) {
-  uint32_t sample = blockIdx.x * blockDim.x + threadIdx.x;
-  if (sample >= passed_number) {
-    return;
-  }
-  sample = passed[sample];
-  samples += static_cast<uint64_t>(sample) * features_size;
-  bounds += static_cast<uint64_t>(sample) * (yy_groups_size + 1);
-  float upper_bound = bounds[0];
-  bounds++;
-  uint32_t cluster = assignments[sample];
-  uint32_t doffset = clusters_size * features_size;
-  float min_dist = upper_bound, second_min_dist = FLT_MAX;
-  uint32_t nearest = cluster;
-  extern __shared__ float shared_centroids[];
-  const uint32_t cstep = shmem_size / features_size;
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const KMCUDASampleIndex *__restrict__ passed, const F *__restrict__ centroids,
+    const L *__restrict__ groups, const F *__restrict__ drifts,
+    L *assignments, F *bounds, uint64_t *reassignments) {
+  typedef Features<F, D> features;
+  // [begin, end) of the current chunk
+  __shared__ KMCUDACounter chunk[2];
+  static_assert(sizeof(chunk) <= LFL_QUEUE_WORDS * sizeof(uint32_t),
+                "LFL_QUEUE_WORDS is too small");
+  const KMCUDACounter passed_number = ctx.counters->passed_number;
+  const KMCUDAFeatureIndex features_size = features::size(ctx);
+  const uint64_t doffset =
+      static_cast<uint64_t>(ctx.clusters_size) * features_size;
+  F *shared_centroids = shared_memory<F>();
+  const uint32_t cstep = shmem_capacity<F>(ctx) / features_size;
   const uint32_t size_each = cstep / blockDim.x + 1;
 
-  for (uint32_t gc = 0; gc < clusters_size; gc += cstep) {
-    uint32_t coffset = gc * features_size;
+  while (true) {
+    if (threadIdx.x == 0) {
+      KMCUDACounter cursor =
+          *const_cast<volatile KMCUDACounter*>(&ctx.counters->passed_cursor);
+      KMCUDACounter size = cursor < passed_number?
+          (passed_number - cursor) / (LFL_GUIDED_FACTOR * gridDim.x) : 0;
+      size = (size / blockDim.x + 1) * blockDim.x;
+      chunk[0] = atomicAdd(&ctx.counters->passed_cursor, size);
+      chunk[1] = chunk[0] + size < passed_number?
+          chunk[0] + size : passed_number;
+    }
     __syncthreads();
-    if (threadIdx.x * size_each < cstep) {
-      for (uint32_t i = 0; i < size_each; i++) {
-        uint32_t ci = threadIdx.x * size_each + i;
-        uint32_t local_offset = ci * features_size;
-        uint32_t global_offset = coffset + local_offset;
-        if (global_offset < clusters_size * features_size) {
-          #pragma unroll 4
-          for (int f = 0; f < features_size; f++) {
-            shared_centroids[local_offset + f] = centroids[global_offset + f];
+    const KMCUDACounter begin = chunk[0], end = chunk[1];
+    if (begin >= passed_number) {
+      return;
+    }
+    for (KMCUDACounter round = begin; round < end; round += blockDim.x) {
+      // the threads without a sample still copy the centroids
+      const bool active = round + threadIdx.x < end;
+      KMCUDASampleIndex sample = 0;
+      const F *my_samples = samples;
+      F *my_bounds = bounds;
+      F upper_bound = 0, min_dist = 0, second_min_dist = FLT_MAX;
+      uint32_t cluster = 0, nearest = 0;
+      uint32_t evaluations = 0;
+      if (active) {
+        sample = passed[round + threadIdx.x];
+        my_samples += static_cast<uint64_t>(sample) * features_size;
+        my_bounds += static_cast<uint64_t>(sample) * (ctx.yy_groups_size + 1);
+        upper_bound = my_bounds[0];
+        my_bounds++;
+        cluster = assignments[sample];
+        min_dist = upper_bound;
+        nearest = cluster;
+      }
+
+      for (uint32_t gc = 0; gc < ctx.clusters_size; gc += cstep) {
+        uint64_t coffset = static_cast<uint64_t>(gc) * features_size;
+        __syncthreads();
+        if (threadIdx.x * size_each < cstep) {
+          for (uint32_t i = 0; i < size_each; i++) {
+            uint32_t ci = threadIdx.x * size_each + i;
+            uint32_t local_offset = ci * features_size;
+            uint64_t global_offset = coffset + local_offset;
+            if (global_offset < static_cast<uint64_t>(ctx.clusters_size) * features_size) {
+              features::copy(
+                  ctx, centroids + global_offset, shared_centroids + local_offset);
+            }
           }
         }
-      }
-    }
-    __syncthreads();
+        __syncthreads();
+        if (!active) {
+          continue;
+        }
 
-    for (uint32_t c = gc; c < gc + cstep && c < clusters_size; c++) {
-      if (c == cluster) {
-        continue;
-      }
-      uint32_t group = groups[c];
-      if (group >= yy_groups_size) {
-        // this may happen if the centroid is insane (NaN)
-        continue;
-      }
-      float lower_bound = bounds[group];
-      if (lower_bound >= upper_bound) {
-        if (lower_bound < second_min_dist) {
-          second_min_dist = lower_bound;
+        for (uint32_t c = gc; c < gc + cstep && c < ctx.clusters_size; c++) {
+          if (c == cluster) {
+            continue;
+          }
+          uint32_t group = groups[c];
+          if (group >= ctx.yy_groups_size) {
+            // this may happen if the centroid is insane (NaN)
+            continue;
+          }
+          F lower_bound = my_bounds[group];
+          if (lower_bound >= upper_bound) {
+            if (lower_bound < second_min_dist) {
+              second_min_dist = lower_bound;
+            }
+            continue;
+          }
+          lower_bound += drifts[group] - drifts[doffset + c];
+          if (second_min_dist < lower_bound) {
+            continue;
+          }
+          F dist = sqrt(features::distance(
+              ctx, my_samples, shared_centroids + (c - gc) * features_size));
+          evaluations++;
+          if (dist < min_dist) {
+            second_min_dist = min_dist;
+            min_dist = dist;
+            nearest = c;
+          } else if (dist < second_min_dist) {
+            second_min_dist = dist;
+          }
         }
-        continue;
       }
-      lower_bound += drifts[group] - drifts[doffset + c];
-      if (second_min_dist < lower_bound) {
+      if (!active) {
         continue;
       }
-      float dist = 0;
-      uint32_t coffset = (c - gc) * features_size;
-      #pragma unroll 4
-      for (int f = 0; f < features_size; f++) {
-        float d = samples[f] - shared_centroids[coffset + f];
-        dist += d * d;
+      uint32_t nearest_group = groups[nearest];
+      uint32_t previous_group = groups[cluster];
+      my_bounds[nearest_group] = second_min_dist;
+      if (nearest_group != previous_group) {
+        F pb = my_bounds[previous_group];
+        if (pb > upper_bound) {
+          my_bounds[previous_group] = upper_bound;
+        }
       }
-      dist = sqrt(dist);
-      if (dist < min_dist) {
-        second_min_dist = min_dist;
-        min_dist = dist;
-        nearest = c;
-      } else if (dist < second_min_dist) {
-        second_min_dist = dist;
+      my_bounds[-1] = min_dist;
+      COUNT_DISTANCES(evaluations);
+      if (cluster != nearest) {
+        assignments[sample] = nearest;
+        log_reassignment(ctx, sample, cluster, reassignments);
       }
     }
+    // thread 0 overwrites chunk
+    __syncthreads();
   }
-  uint32_t nearest_group = groups[nearest];
-  uint32_t previous_group = groups[cluster];
-  bounds[nearest_group] = second_min_dist;
-  if (nearest_group != previous_group) {
-    float pb = bounds[previous_group];
-    if (pb > upper_bound) {
-      bounds[previous_group] = upper_bound;
+}
+
+/// Needs STATS_SHMEM_SIZE(blockDim.x) bytes of shared memory. stats is the
+/// buffer described in kmeans_cuda_yy(), each block writes its own inertia.
+template <typename F, typename L>
+__global__ void kmeans_calc_stats(
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const F *__restrict__ centroids, const L *__restrict__ assignments,
+    uint32_t *stats) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
+    return;
+  }
+  uint32_t cluster = assignments[sample];
+  F dist = 0;
+  // insane samples are assigned to clusters_size
+  if (cluster < ctx.clusters_size) {
+    dist = stats_distance(
+        ctx, samples + static_cast<uint64_t>(sample) * ctx.features_size,
+        centroids + static_cast<uint64_t>(cluster) * ctx.features_size);
+    COUNT_DISTANCES(1);
+  } else {
+    cluster = UINT32_MAX;
+  }
+  accumulate_stats(ctx, cluster, dist, shared_memory<uint32_t>(),
+                   stats + gridDim.x * sizeof(double) / sizeof(uint32_t));
+  accumulate_inertia(ctx, sample, dist, reinterpret_cast<double*>(stats));
+}
+
+/// Transposes the column major block of rows samples (the leading dimension
+/// is rows) to the row major samples through a padded shared memory tile, so
+/// both the reads and the writes are coalesced.
+template <typename F>
+__global__ void kmeans_pack_columns(
+    const F *__restrict__ columns, uint32_t rows,
+    KMCUDAFeatureIndex features_size, F *__restrict__ samples) {
+  __shared__ F tile[PACK_TILE][PACK_TILE + 1];
+  uint32_t row = blockIdx.x * PACK_TILE + threadIdx.x;
+  uint32_t feature = blockIdx.y * PACK_TILE + threadIdx.y;
+  for (uint32_t j = 0; j < PACK_TILE; j += PACK_ROWS) {
+    if (row < rows && feature + j < features_size) {
+      tile[threadIdx.y + j][threadIdx.x] =
+          columns[static_cast<uint64_t>(feature + j) * rows + row];
     }
   }
-  bounds[-1] = min_dist;
-  if (cluster != nearest) {
-    assignments[sample] = nearest;
-    atomicAdd(&changed, 1);
+  __syncthreads();
+  row = blockIdx.x * PACK_TILE + threadIdx.y;
+  feature = blockIdx.y * PACK_TILE + threadIdx.x;
+  for (uint32_t j = 0; j < PACK_TILE; j += PACK_ROWS) {
+    if (row + j < rows && feature < features_size) {
+      samples[static_cast<uint64_t>(row + j) * features_size + feature] =
+          tile[threadIdx.x][threadIdx.y + j];
+    }
+  }
+}
+
+/// Starts the next permutation of the samples: perm is the identity and so
+/// is order if the samples have not been reordered yet.
+__global__ void kmeans_reorder_init(
+    const KMCUDAContext ctx, bool active, KMCUDASampleIndex *order,
+    KMCUDASampleIndex *perm) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
+    return;
+  }
+  perm[sample] = sample;
+  if (!active) {
+    order[sample] = sample;
   }
 }
 
-static int check_changed(int iter, float tolerance, uint32_t samples_size,
-                         int32_t verbosity) {
-  uint32_t my_changed = 0;
-  CUCH(cudaMemcpyFromSymbol(&my_changed, changed, sizeof(my_changed)),
+/// perm sorts the current order by cluster, thus the original index of
+/// the new sample #i is order[perm[i]].
+__global__ void kmeans_reorder_compose(
+    const KMCUDAContext ctx, const KMCUDASampleIndex *__restrict__ order,
+    KMCUDASampleIndex *perm) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
+    return;
+  }
+  perm[sample] = order[perm[sample]];
+}
+
+/// dest[i] = bounds[perm[i]] for the Yinyang bounds of the samples, an element
+/// per thread like kmeans_gather_samples().
+template <typename F>
+__global__ void kmeans_permute_bounds(
+    const KMCUDAContext ctx, const F *__restrict__ bounds,
+    const KMCUDASampleIndex *__restrict__ perm, F *__restrict__ dest) {
+  const uint32_t width = ctx.yy_groups_size + 1;
+  uint64_t index = static_cast<uint64_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (index >= static_cast<uint64_t>(ctx.samples_size) * width) {
+    return;
+  }
+  uint64_t sample = index / width;
+  dest[index] = bounds[static_cast<uint64_t>(perm[sample]) * width +
+                       index % width];
+}
+
+/// dest[i] = samples[order[i]], an element per thread to coalesce the writes.
+template <typename F>
+__global__ void kmeans_gather_samples(
+    const KMCUDAContext ctx, const F *__restrict__ samples,
+    const KMCUDASampleIndex *__restrict__ order, F *__restrict__ dest) {
+  uint64_t index = static_cast<uint64_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (index >= static_cast<uint64_t>(ctx.samples_size) * ctx.features_size) {
+    return;
+  }
+  uint64_t sample = index / ctx.features_size;
+  dest[index] = samples[static_cast<uint64_t>(order[sample]) * ctx.features_size +
+                        index % ctx.features_size];
+}
+
+/// means[p] is the mean of the samples order[offsets[p]] ...
+/// order[offsets[p + 1] - 1]. A block per partition, a thread per feature, so
+/// the reads of each row are coalesced.
+template <typename F>
+__global__ void kmeans_partition_means(
+    const F *__restrict__ samples, KMCUDAFeatureIndex features_size,
+    const KMCUDASampleIndex *__restrict__ order,
+    const KMCUDASampleIndex *__restrict__ offsets, F *__restrict__ means) {
+  const uint32_t p = blockIdx.x;
+  const KMCUDASampleIndex begin = offsets[p], end = offsets[p + 1];
+  for (KMCUDAFeatureIndex f = threadIdx.x; f < features_size; f += blockDim.x) {
+    F sum = 0;
+    for (KMCUDASampleIndex i = begin; i < end; i++) {
+      sum += samples[static_cast<uint64_t>(order[i]) * features_size + f];
+    }
+    means[static_cast<uint64_t>(p) * features_size + f] =
+        end > begin? sum / (end - begin) : 0;
+  }
+}
+
+template <typename L>
+__global__ void kmeans_scatter_assignments(
+    const KMCUDAContext ctx, const KMCUDASampleIndex *__restrict__ order,
+    const L *__restrict__ assignments, L *__restrict__ dest) {
+  KMCUDASampleIndex sample = thread_sample();
+  if (sample >= ctx.samples_size) {
+    return;
+  }
+  dest[order[sample]] = assignments[sample];
+}
+
+/// Reads the number of reassignments after the assignment pass #iter,
+/// reports the progress and decides whether to stop (returns -1).
+static int check_changed(const KMCUDAContext &ctx, int iter, int32_t verbosity,
+                         KMCUDAConvergence *conv) {
+  KMCUDACounter changed = 0;
+  CUCH(cudaMemcpyAsync(&changed, &ctx.counters->changed, sizeof(changed),
+                       cudaMemcpyDeviceToHost, ctx.stream),
        kmcudaMemoryCopyError);
-  INFO("iteration %d: %" PRIu32 " reassignments\n", iter, my_changed);
-  if (my_changed <= tolerance * samples_size) {
+  CUCH(cudaStreamSynchronize(ctx.stream), kmcudaRuntimeError);
+  KMCUDASampleIndex my_changed = changed;
+  conv->reassignments = my_changed;
+  conv->iterations = iter;
+  PROFILE_ITERATION(conv->profiler, iter);
+  INFO("iteration %d: %" PRIuSAMPLE " reassignments\n", iter, my_changed);
+  bool cancelled = false;
+  if (conv->progress != nullptr) {
+    KMCUDAProgress progress = {};
+    progress.restart = conv->restart;
+    progress.iteration = iter;
+    progress.reassignments = my_changed;
+    progress.passed_ratio = conv->passed_ratio;
+    progress.elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - conv->start).count();
+    cancelled = conv->progress(&progress, conv->progress_arg) != 0;
+  }
+  if (my_changed <= conv->tolerance * ctx.samples_size) {
+    conv->stop_reason = kmcudaStopTolerance;
+    return -1;
+  }
+  assert(my_changed <= ctx.samples_size);
+  if (conv->shift <= conv->shift_tolerance) {
+    INFO("the centroids shifted by at most %f\n", conv->shift);
+    conv->stop_reason = kmcudaStopCentroidShift;
+    return -1;
+  }
+  if (conv->max_iterations > 0 &&
+      static_cast<uint32_t>(iter) >= conv->max_iterations) {
+    INFO("reached the maximum number of iterations\n");
+    conv->stop_reason = kmcudaStopMaxIterations;
+    return -1;
+  }
+  if (std::chrono::steady_clock::now() >= conv->deadline) {
+    INFO("ran out of the time budget\n");
+    conv->stop_reason = kmcudaStopTimeBudget;
+    return -1;
+  }
+  if (cancelled) {
+    INFO("cancelled\n");
+    conv->stop_reason = kmcudaStopCancelled;
     return -1;
   }
-  assert(my_changed <= samples_size);
-  uint32_t zero = 0;
-  CUCH(cudaMemcpyToSymbolAsync(changed, &zero, sizeof(zero)),
+  CUCH(cudaMemsetAsync(&ctx.counters->changed, 0, sizeof(KMCUDACounter),
+                       ctx.stream), kmcudaRuntimeError);
+  return kmcudaSuccess;
+}
+
+/// Clears the maximal centroid drift before kmeans_yy_calc_drifts() reduces
+/// the new one on the device.
+static KMCUDAResult reset_max_shift(const KMCUDAContext &ctx) {
+  CUCH(cudaMemsetAsync(&ctx.counters->max_shift, 0, sizeof(float), ctx.stream),
+       kmcudaRuntimeError);
+  return kmcudaSuccess;
+}
+
+/// Reads the maximal centroid drift reduced by kmeans_yy_calc_drifts(),
+/// a single float instead of the whole drift array. The group drifts are
+/// the maxima of the cluster ones, so it is the same for Yinyang.
+/// There is no synchronization here: check_changed() synchronizes the
+/// stream before it reads the shift.
+static KMCUDAResult fetch_max_shift(const KMCUDAContext &ctx, float *shift) {
+  CUCH(cudaMemcpyAsync(shift, &ctx.counters->max_shift, sizeof(float),
+                       cudaMemcpyDeviceToHost, ctx.stream),
        kmcudaMemoryCopyError);
   return kmcudaSuccess;
 }
 
-static KMCUDAResult prepare_mem(uint32_t *ccounts, uint32_t *assignments,
-                                uint32_t samples_size, uint32_t clusters_size,
+/// Calculates the statistics of the final assignments, see kmeans_cuda_yy().
+/// This is a single extra pass after Yinyang and after the Lloyd passes with
+/// the centroid k-NN graph; the plain Lloyd assignment accumulates them itself.
+template <typename F, typename L>
+static KMCUDAResult calc_stats(
+    const KMCUDAContext &ctx, const F *samples, const F *centroids,
+    const L *assignments, uint32_t *stats) {
+  if (stats == nullptr) {
+    return kmcudaSuccess;
+  }
+  CUCH(cudaMemsetAsync(stats, 0, stats_size(ctx.clusters_size, ctx.samples_size),
+                       ctx.stream), kmcudaRuntimeError);
+  dim3 block(BS_STATS, 1, 1);
+  dim3 grid(stats_blocks(ctx.samples_size), 1, 1);
+  kmeans_calc_stats<<<grid, block, STATS_SHMEM_SIZE(block.x), ctx.stream>>>(
+      ctx, samples, centroids, assignments, stats);
+  CUCH(cudaGetLastError(), kmcudaRuntimeError);
+  return kmcudaSuccess;
+}
+
+template <typename L>
+static KMCUDAResult prepare_mem(const KMCUDAContext &ctx,
+                                KMCUDASampleIndex *ccounts, L *assignments,
                                 bool resume, uint32_t *my_shmem_size) {
-  CUCH(cudaMemcpyFromSymbol(my_shmem_size, shmem_size, sizeof(shmem_size)),
-       kmcudaMemoryCopyError);
-  *my_shmem_size *= sizeof(uint32_t);
-  uint32_t zero = 0;
-  CUCH(cudaMemcpyToSymbolAsync(changed, &zero, sizeof(zero)),
-       kmcudaMemoryCopyError);
+  *my_shmem_size = ctx.shmem_size * sizeof(uint32_t);
+  CUCH(cudaMemsetAsync(&ctx.counters->changed, 0, sizeof(KMCUDACounter),
+                       ctx.stream), kmcudaRuntimeError);
   if (!resume) {
-    CUCH(cudaMemsetAsync(ccounts, 0, clusters_size * sizeof(uint32_t)),
-         kmcudaRuntimeError);
-    CUCH(cudaMemsetAsync(assignments, 0xff, samples_size * sizeof(uint32_t)),
-         kmcudaRuntimeError);
+    CUCH(cudaMemsetAsync(ccounts, 0, ctx.clusters_size * sizeof(KMCUDASampleIndex),
+                         ctx.stream), kmcudaRuntimeError);
+    CUCH(cudaMemsetAsync(assignments, 0xff, ctx.samples_size * sizeof(L),
+                         ctx.stream), kmcudaRuntimeError);
   }
   return kmcudaSuccess;
 }
 
+/// Rough estimate of the device memory traffic of a kernel which reads
+/// "rows" samples and copies all the centroids to shared memory in each block.
+template <typename F>
+static uint64_t scan_bytes(const KMCUDAContext &ctx, uint64_t rows,
+                           uint32_t blocks) {
+  return (rows + static_cast<uint64_t>(blocks) * ctx.clusters_size) *
+      ctx.features_size * sizeof(F);
+}
 
-extern "C" {
+/// The thrust allocator which hands out the buffer of KMCUDASortStorage.
+/// Without the storage, it falls back to cudaMalloc() and cudaFree().
+struct KMCUDASortAllocator {
+  typedef char value_type;
 
-KMCUDAResult kmeans_cuda_setup(uint32_t samples_size_, uint16_t features_size_,
-                               uint32_t clusters_size_, uint32_t yy_groups_size_,
-                               uint32_t device, int32_t verbosity) {
-  CUCH(cudaMemcpyToSymbol(samples_size, &samples_size_, sizeof(samples_size)),
-       kmcudaMemoryCopyError);
-  CUCH(cudaMemcpyToSymbol(features_size, &features_size_, sizeof(features_size)),
-       kmcudaMemoryCopyError);
-  CUCH(cudaMemcpyToSymbol(clusters_size, &clusters_size_, sizeof(clusters_size)),
+  KMCUDASortStorage *storage;
+
+  char *allocate(std::ptrdiff_t size) {
+    void *ptr = nullptr;
+    if (storage == nullptr || storage->busy) {
+      if (cudaMalloc(&ptr, size) != cudaSuccess) {
+        throw std::bad_alloc();
+      }
+      return static_cast<char*>(ptr);
+    }
+    if (static_cast<size_t>(size) > storage->size) {
+      // implicitly waits for the previous sorts which used the buffer
+      cudaFree(storage->buffer);
+      storage->buffer = nullptr;
+      storage->size = 0;
+      if (cudaMalloc(&storage->buffer, size) != cudaSuccess) {
+        throw std::bad_alloc();
+      }
+      storage->size = size;
+    }
+    storage->busy = true;
+    return static_cast<char*>(storage->buffer);
+  }
+
+  void deallocate(char *ptr, size_t) {
+    if (storage != nullptr && ptr == storage->buffer) {
+      storage->busy = false;
+    } else {
+      cudaFree(ptr);
+    }
+  }
+};
+
+/// Runs the thrust algorithm and maps its exceptions to KMCUDAResult. None
+/// may escape: the callers run inside the OpenMP parallel regions of the
+/// restarts and the batches, where an exception calls std::terminate().
+template <typename C>
+static KMCUDAResult thrust_call(C call) {
+  try {
+    call();
+  } catch (const std::bad_alloc &) {
+    return kmcudaMemoryAllocationFailure;
+  } catch (const thrust::system_error &) {
+    return kmcudaRuntimeError;
+  } catch (const std::exception &) {
+    return kmcudaRuntimeError;
+  }
+  return kmcudaSuccess;
+}
+
+/// Updates the centroids after the reassignments. If the log overflowed,
+/// they are recalculated from scratch, otherwise only the logged samples are
+/// subtracted and added. The log is sorted by sample first to keep the
+/// summation order and thus the results deterministic.
+template <typename F, typename L>
+static KMCUDAResult adjust_centroids(
+    const KMCUDAContext &ctx, KMCUDASampleIndex reassignments_number,
+    uint32_t my_shmem_size, KMCUDAProfiler *profiler,
+    KMCUDASortStorage *sort_storage, const F *samples,
+    uint64_t *reassignments, const L *assignments, F *centroids,
+    KMCUDASampleIndex *ccounts) {
+  if (reassignments_number == 0) {
+    return kmcudaSuccess;
+  }
+  PROFILE_SCOPE(profiler, kmcudaPhaseAdjust);
+  dim3 cblock(BS_LL_CNT, 1, 1);
+  dim3 cgrid(ctx.clusters_size / cblock.x + 1, 1, 1);
+  if (reassignments_number > REASSIGNMENTS_CAPACITY(ctx.samples_size)) {
+    kmeans_recalculate<<<cgrid, cblock, my_shmem_size, ctx.stream>>>(
+        ctx, samples, assignments, centroids, ccounts);
+    PROFILE_COUNT(profiler, bytes_touched,
+                  static_cast<uint64_t>(cgrid.x) * ctx.samples_size * sizeof(L) +
+                  scan_bytes<F>(ctx, ctx.samples_size, 0));
+    return kmcudaSuccess;
+  }
+  KMCUDASortAllocator allocator = {sort_storage};
+  RETERR(thrust_call([&] {
+    thrust::sort(thrust::cuda::par(allocator).on(ctx.stream), reassignments,
+                 reassignments + reassignments_number);
+  }));
+  kmeans_adjust<<<cgrid, cblock, my_shmem_size, ctx.stream>>>(
+      ctx, samples, reassignments, reassignments_number, assignments,
+      centroids, ccounts);
+  PROFILE_COUNT(profiler, bytes_touched,
+                static_cast<uint64_t>(cgrid.x) * reassignments_number *
+                (sizeof(uint64_t) + sizeof(L)) +
+                scan_bytes<F>(ctx, 2 * reassignments_number, 0));
+  return kmcudaSuccess;
+}
+
+/// Sorts the samples by cluster with the stable sort, so the previous order
+/// persists inside each cluster, and permutes the assignments. The reordered
+/// samples are always gathered from the original ones. The reassignments log
+/// is the scratch for the sort keys, so it must be applied before. If bounds
+/// is not nullptr, the Yinyang bounds are permuted the same way into
+/// conv->reorder->bounds and the two buffers are swapped through *bounds and
+/// *bounds_scratch, so they stay valid. Sets *samples to the reordered samples.
+template <typename F, typename L>
+static KMCUDAResult reorder_samples(
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const F *original, uint64_t *reassignments, L *assignments, F **bounds,
+    F **bounds_scratch, const F **samples) {
+  KMCUDAReorder *reorder = conv->reorder;
+  KMCUDAProfiler *profiler = conv->profiler;
+  PROFILE_SCOPE(profiler, kmcudaPhaseReorder);
+  DEBUG("reordering the samples by cluster\n");
+  dim3 block(BLOCK_SIZE, 1, 1);
+  dim3 grid(ctx.samples_size / block.x + 1, 1, 1);
+  kmeans_reorder_init<<<grid, block, 0, ctx.stream>>>(
+      ctx, reorder->active, reorder->order, reorder->perm);
+  L *keys = reinterpret_cast<L*>(reassignments);
+  CUCH(cudaMemcpyAsync(keys, assignments, ctx.samples_size * sizeof(L),
+                       cudaMemcpyDeviceToDevice, ctx.stream),
        kmcudaMemoryCopyError);
-  CUCH(cudaMemcpyToSymbol(yy_groups_size, &yy_groups_size_, sizeof(yy_groups_size)),
+  KMCUDASortAllocator allocator = {conv->sort_storage};
+  RETERR(thrust_call([&] {
+    thrust::stable_sort_by_key(thrust::cuda::par(allocator).on(ctx.stream),
+                               keys, keys + ctx.samples_size, reorder->perm);
+  }));
+  CUCH(cudaMemcpyAsync(assignments, keys, ctx.samples_size * sizeof(L),
+                       cudaMemcpyDeviceToDevice, ctx.stream),
        kmcudaMemoryCopyError);
-  cudaDeviceProp props;
-  CUCH(cudaGetDeviceProperties(&props, device), kmcudaRuntimeError);
-  int my_shmem_size = static_cast<int>(props.sharedMemPerBlock);
+  uint64_t bounds_elements = 0;
+  if (bounds != nullptr) {
+    // perm is still the step from the previous order to the new one
+    bounds_elements =
+        static_cast<uint64_t>(ctx.samples_size) * (ctx.yy_groups_size + 1);
+    dim3 bgrid(bounds_elements / block.x + 1, 1, 1);
+    kmeans_permute_bounds<<<bgrid, block, 0, ctx.stream>>>(
+        ctx, *bounds, reorder->perm, *bounds_scratch);
+    std::swap(*bounds, *bounds_scratch);
+  }
+  kmeans_reorder_compose<<<grid, block, 0, ctx.stream>>>(
+      ctx, reorder->order, reorder->perm);
+  std::swap(reorder->order, reorder->perm);
+  uint64_t elements = static_cast<uint64_t>(ctx.samples_size) * ctx.features_size;
+  dim3 egrid(elements / block.x + 1, 1, 1);
+  F *dest = reinterpret_cast<F*>(reorder->samples);
+  kmeans_gather_samples<<<egrid, block, 0, ctx.stream>>>(
+      ctx, original, reorder->order, dest);
+  PROFILE_COUNT(profiler, bytes_touched,
+                2 * (elements + bounds_elements) * sizeof(F) +
+                ctx.samples_size * (4 * sizeof(L) +
+                                    4 * sizeof(KMCUDASampleIndex)));
+  reorder->active = true;
+  *samples = dest;
+  return kmcudaSuccess;
+}
+
+/// The kernels specialized on the number of features, see Features.
+/// get<D>() returns the instance for D features, get<0>() the generic one.
+template <typename F, typename L>
+struct AssignLloydKernel {
+  typedef decltype(&kmeans_assign_lloyd<F, L, 0>) type;
+  template <int D> static type get() { return kmeans_assign_lloyd<F, L, D>; }
+};
+
+template <typename F>
+struct CentroidNeighborsKernel {
+  typedef decltype(&kmeans_centroid_neighbors<F, 0>) type;
+  template <int D> static type get() { return kmeans_centroid_neighbors<F, D>; }
+};
+
+template <typename F, typename L>
+struct AssignNeighborsKernel {
+  typedef decltype(&kmeans_assign_neighbors<F, L, 0>) type;
+  template <int D> static type get() {
+    return kmeans_assign_neighbors<F, L, D>;
+  }
+};
+
+template <typename F, typename L>
+struct YinyangInitKernel {
+  typedef decltype(&kmeans_yy_init<F, L, 0>) type;
+  template <int D> static type get() { return kmeans_yy_init<F, L, D>; }
+};
+
+template <typename F, typename L>
+struct YinyangLocalFilterKernel {
+  typedef decltype(&kmeans_yy_local_filter<F, L, 0>) type;
+  template <int D> static type get() {
+    return kmeans_yy_local_filter<F, L, D>;
+  }
+};
+
+/// Returns the instance of Kernel which is unrolled for features_size
+/// features if there is one, otherwise the generic instance.
+template <typename Kernel>
+static typename Kernel::type pick_features_kernel(
+    KMCUDAFeatureIndex features_size) {
+  switch (features_size) {
+    case 2: return Kernel::template get<2>();
+    case 3: return Kernel::template get<3>();
+    case 4: return Kernel::template get<4>();
+    case 8: return Kernel::template get<8>();
+    case 16: return Kernel::template get<16>();
+    case 32: return Kernel::template get<32>();
+    case 64: return Kernel::template get<64>();
+    case 96: return Kernel::template get<96>();
+    case 128: return Kernel::template get<128>();
+    case 256: return Kernel::template get<256>();
+    case 384: return Kernel::template get<384>();
+    case 512: return Kernel::template get<512>();
+    case 768: return Kernel::template get<768>();
+    default: return Kernel::template get<0>();
+  }
+}
+
+template <typename F>
+KMCUDAResult kmeans_cuda_pack_columns(
+    cudaStream_t stream, const F *columns, uint32_t rows,
+    KMCUDAFeatureIndex features_size, F *samples) {
+  dim3 block(PACK_TILE, PACK_ROWS, 1);
+  dim3 grid((rows + PACK_TILE - 1) / PACK_TILE,
+            (features_size + PACK_TILE - 1) / PACK_TILE, 1);
+  kmeans_pack_columns<<<grid, block, 0, stream>>>(
+      columns, rows, features_size, samples);
+  CUCH(cudaGetLastError(), kmcudaRuntimeError);
+  return kmcudaSuccess;
+}
+
+template KMCUDAResult kmeans_cuda_pack_columns<float>(
+    cudaStream_t stream, const float *columns, uint32_t rows,
+    KMCUDAFeatureIndex features_size, float *samples);
+
+template KMCUDAResult kmeans_cuda_pack_columns<double>(
+    cudaStream_t stream, const double *columns, uint32_t rows,
+    KMCUDAFeatureIndex features_size, double *samples);
+
+template <typename F>
+KMCUDAResult kmeans_cuda_partition_means(
+    cudaStream_t stream, const F *samples, KMCUDAFeatureIndex features_size,
+    uint32_t partitions_size, const KMCUDASampleIndex *order,
+    const KMCUDASampleIndex *offsets, F *means) {
+  if (partitions_size == 0) {
+    return kmcudaSuccess;
+  }
+  dim3 block(BS_LL_CNT, 1, 1);
+  dim3 grid(partitions_size, 1, 1);
+  kmeans_partition_means<<<grid, block, 0, stream>>>(
+      samples, features_size, order, offsets, means);
+  CUCH(cudaGetLastError(), kmcudaRuntimeError);
+  return kmcudaSuccess;
+}
+
+template KMCUDAResult kmeans_cuda_partition_means<float>(
+    cudaStream_t stream, const float *samples, KMCUDAFeatureIndex features_size,
+    uint32_t partitions_size, const KMCUDASampleIndex *order,
+    const KMCUDASampleIndex *offsets, float *means);
+
+template <typename L>
+KMCUDAResult kmeans_cuda_restore_order(
+    const KMCUDAContext &ctx, const KMCUDAReorder &reorder, const L *assignments,
+    L *dest) {
+  dim3 block(BLOCK_SIZE, 1, 1);
+  dim3 grid(ctx.samples_size / block.x + 1, 1, 1);
+  kmeans_scatter_assignments<<<grid, block, 0, ctx.stream>>>(
+      ctx, reorder.order, assignments, dest);
+  return kmcudaSuccess;
+}
+
+template KMCUDAResult kmeans_cuda_restore_order<uint16_t>(
+    const KMCUDAContext &ctx, const KMCUDAReorder &reorder,
+    const uint16_t *assignments, uint16_t *dest);
+template KMCUDAResult kmeans_cuda_restore_order<uint32_t>(
+    const KMCUDAContext &ctx, const KMCUDAReorder &reorder,
+    const uint32_t *assignments, uint32_t *dest);
+
+extern "C" {
+
+KMCUDAResult kmeans_cuda_setup(KMCUDAContext *ctx, uint32_t device,
+                               int32_t verbosity) {
+  // much cheaper than cudaGetDeviceProperties() which matters for batches
+  int my_shmem_size;
+  CUCH(cudaDeviceGetAttribute(&my_shmem_size, cudaDevAttrMaxSharedMemoryPerBlock,
+                              device), kmcudaRuntimeError);
   DEBUG("GPU #%" PRIu32 " has %d bytes of shared memory per block\n",
         device, my_shmem_size);
-  my_shmem_size /= sizeof(uint32_t);
-  CUCH(cudaMemcpyToSymbol(shmem_size, &my_shmem_size, sizeof(my_shmem_size)),
+  ctx->shmem_size = my_shmem_size / sizeof(uint32_t) - LFL_QUEUE_WORDS;
+  // clusters_size itself marks the insane samples and must not be a cluster
+  ctx->cluster_bits = 1;
+  while (ctx->cluster_bits < 32 &&
+         (1ull << ctx->cluster_bits) <= ctx->clusters_size) {
+    ctx->cluster_bits++;
+  }
+  if (static_cast<uint64_t>(ctx->samples_size) >
+      (UINT64_MAX >> ctx->cluster_bits)) {
+    INFO("too many samples for %" PRIu32 " clusters\n", ctx->clusters_size);
+    return kmcudaInvalidArguments;
+  }
+  CUCH(cudaMemsetAsync(ctx->counters, 0, sizeof(KMCUDACounters), ctx->stream),
+       kmcudaRuntimeError);
+  return kmcudaSuccess;
+}
+
+KMCUDAResult kmeans_cuda_distance_evaluations(
+    const KMCUDAContext *ctx, uint64_t *evaluations) {
+  *evaluations = 0;
+#ifdef PROFILE
+  unsigned long long value = 0;
+  CUCH(cudaMemcpyAsync(&value, &ctx->counters->distance_evaluations,
+                       sizeof(value), cudaMemcpyDeviceToHost, ctx->stream),
        kmcudaMemoryCopyError);
+  CUCH(cudaMemsetAsync(&ctx->counters->distance_evaluations, 0, sizeof(value),
+                       ctx->stream), kmcudaRuntimeError);
+  CUCH(cudaStreamSynchronize(ctx->stream), kmcudaRuntimeError);
+  *evaluations = value;
+#endif
   return kmcudaSuccess;
 }
 
+}  // extern "C"
+
+template <typename F>
 KMCUDAResult kmeans_cuda_plus_plus(
-    uint32_t samples_size, uint32_t cc, float *samples, float *centroids,
+    const KMCUDAContext *ctx, uint32_t cc, const F *samples, const F *centroids,
     float *dists, float *dist_sum, float **dev_sums) {
   dim3 block(BS_KMPP, 1, 1);
-  dim3 grid(samples_size / block.x + 1, 1, 1);
+  dim3 grid(ctx->samples_size / block.x + 1, 1, 1);
   if (*dev_sums == NULL) {
     CUCH(cudaMalloc(reinterpret_cast<void**>(dev_sums), grid.x * sizeof(float)),
          kmcudaMemoryAllocationFailure);
   } else {
-    CUCH(cudaMemset(*dev_sums, 0, grid.x * sizeof(float)), kmcudaRuntimeError);
+    CUCH(cudaMemsetAsync(*dev_sums, 0, grid.x * sizeof(float), ctx->stream),
+         kmcudaRuntimeError);
   }
-  kmeans_plus_plus<<<grid, block, block.x * sizeof(float)>>>(
-      cc, samples, centroids, dists, *dev_sums);
+  kmeans_plus_plus<<<grid, block, block.x * sizeof(float), ctx->stream>>>(
+      *ctx, cc, samples, centroids, dists, *dev_sums);
   std::unique_ptr<float[]> host_dist_sums(new float[grid.x]);
-  CUCH(cudaMemcpy(host_dist_sums.get(), *dev_sums, grid.x * sizeof(float),
-                  cudaMemcpyDeviceToHost), kmcudaMemoryCopyError);
+  CUCH(cudaMemcpyAsync(host_dist_sums.get(), *dev_sums, grid.x * sizeof(float),
+                       cudaMemcpyDeviceToHost, ctx->stream),
+       kmcudaMemoryCopyError);
+  CUCH(cudaStreamSynchronize(ctx->stream), kmcudaRuntimeError);
   float ds = 0;
   #pragma omp simd reduction(+:ds)
   for (uint32_t i = 0; i < grid.x; i++) {
@@ -556,46 +1693,151 @@ KMCUDAResult kmeans_cuda_plus_plus(
   return kmcudaSuccess;
 }
 
-KMCUDAResult kmeans_cuda_lloyd(
-    float tolerance, uint32_t samples_size, uint32_t clusters_size,
-    uint16_t features_size, int32_t verbosity, bool resume,
-    const float *samples, float *centroids, uint32_t *ccounts,
-    uint32_t *assignments_prev, uint32_t *assignments, int *iterations = nullptr) {
+template KMCUDAResult kmeans_cuda_plus_plus<float>(
+    const KMCUDAContext *ctx, uint32_t cc, const float *samples,
+    const float *centroids, float *dists, float *dist_sum, float **dev_sums);
+
+template KMCUDAResult kmeans_cuda_plus_plus<double>(
+    const KMCUDAContext *ctx, uint32_t cc, const double *samples,
+    const double *centroids, float *dists, float *dist_sum, float **dev_sums);
+
+/// drifts is either nullptr or the buffer of size
+/// clusters_size x (features_size + 1) which is used to track the centroid
+/// shifts if conv->shift_tolerance > 0.
+/// graph is either nullptr or the buffer described in kmeans_cuda_yy()
+/// which is used if conv->neighbors > 0.
+template <typename F, typename L>
+static KMCUDAResult kmeans_cuda_lloyd(
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    bool resume, const F *samples, F *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, L *assignments, F *drifts, uint32_t *graph,
+    uint32_t *stats) {
+  PROFILE_SCOPE(conv->profiler, kmcudaPhaseLloyd);
+  // the samples in the original order, see reorder_samples()
+  const F *original = samples;
+  if (conv->reorder != nullptr && conv->reorder->active) {
+    samples = reinterpret_cast<const F*>(conv->reorder->samples);
+  }
   dim3 sblock(BS_LL_ASS, 1, 1);
-  dim3 sgrid(samples_size / sblock.x + 1, 1, 1);
+  dim3 sgrid(ctx.samples_size / sblock.x + 1, 1, 1);
   dim3 cblock(BS_LL_CNT, 1, 1);
-  dim3 cgrid(clusters_size / cblock.x + 1, 1, 1);
+  dim3 cgrid(ctx.clusters_size / cblock.x + 1, 1, 1);
   uint32_t my_shmem_size;
-  RETERR(prepare_mem(ccounts, assignments, samples_size, clusters_size,
-                     resume, &my_shmem_size));
+  RETERR(prepare_mem(ctx, ccounts, assignments, resume, &my_shmem_size));
+  bool track_shift = drifts != nullptr && conv->shift_tolerance > 0;
+  const uint32_t neighbors_size = graph != nullptr? conv->neighbors : 0;
+  KMCUDASampleIndex *passed = nullptr;
+  uint32_t *neighbors = nullptr;
+  F *radiuses = nullptr, *csqrs = nullptr;
+  if (neighbors_size > 0) {
+    // F first to keep the alignment
+    radiuses = reinterpret_cast<F*>(graph);
+    csqrs = radiuses + ctx.clusters_size;
+    passed = reinterpret_cast<KMCUDASampleIndex*>(csqrs + ctx.clusters_size);
+    neighbors = reinterpret_cast<uint32_t*>(passed + ctx.samples_size);
+  }
+  conv->shift = FLT_MAX;
+  conv->passed_ratio = 1;
+  // when resuming, there is no log => recalculate
+  conv->reassignments = std::numeric_limits<KMCUDASampleIndex>::max();
+  auto assign_lloyd = pick_features_kernel<AssignLloydKernel<F, L>>(
+      ctx.features_size);
+  // the same specialization as assign_lloyd, so the distances match
+  auto centroid_neighbors = pick_features_kernel<CentroidNeighborsKernel<F>>(
+      ctx.features_size);
+  auto assign_neighbors = pick_features_kernel<AssignNeighborsKernel<F, L>>(
+      ctx.features_size);
   for (int i = 1; ; i++) {
     if (!resume || i > 1) {
-      kmeans_assign_lloyd<<<sgrid, sblock, my_shmem_size>>>(
-          samples, centroids, assignments_prev, assignments);
-      int status = check_changed(i, tolerance, samples_size, verbosity);
+      // whether this pass has accumulated the statistics of its assignments
+      bool with_stats = false;
+      // nothing is assigned before the first iteration
+      if (neighbors_size > 0 && (resume || i > 1)) {
+        PROFILE_SCOPE(conv->profiler, kmcudaPhaseNeighbors);
+        centroid_neighbors<<<cgrid, cblock, my_shmem_size, ctx.stream>>>(
+            ctx, centroids, neighbors_size, neighbors, radiuses, csqrs);
+        CUCH(cudaMemsetAsync(&ctx.counters->passed_number, 0,
+                             sizeof(KMCUDACounter), ctx.stream),
+             kmcudaRuntimeError);
+        assign_neighbors<<<sgrid, sblock, 0, ctx.stream>>>(
+            ctx, samples, centroids, neighbors_size, neighbors, radiuses,
+            csqrs, conv->approximate_neighbors, passed, reassignments,
+            assignments);
+        // the samples without the certificate
+        // the listed samples are not in the natural order of the blocks
+        assign_lloyd<<<sgrid, sblock, my_shmem_size, ctx.stream>>>(
+            ctx, samples, centroids, passed, reassignments, assignments,
+            nullptr);
+        PROFILE_COUNT(conv->profiler, bytes_touched,
+                      ctx.samples_size * (neighbors_size + 2) *
+                      ctx.features_size * sizeof(F) +
+                      ctx.samples_size * sizeof(L));
+      } else {
+        // any pass may turn out to be the last
+        with_stats = stats != nullptr;
+        if (with_stats) {
+          CUCH(cudaMemsetAsync(
+              stats, 0, stats_size(ctx.clusters_size, ctx.samples_size),
+              ctx.stream), kmcudaRuntimeError);
+        }
+        assign_lloyd<<<sgrid, sblock, my_shmem_size, ctx.stream>>>(
+            ctx, samples, centroids, nullptr, reassignments, assignments,
+            stats);
+        PROFILE_COUNT(conv->profiler, bytes_touched,
+                      scan_bytes<F>(ctx, ctx.samples_size, sgrid.x) +
+                      ctx.samples_size * sizeof(L));
+      }
+      int status = check_changed(ctx, i, verbosity, conv);
       if (status < kmcudaSuccess) {
-        if (iterations) {
-          *iterations = i;
+        if (with_stats) {
+          return kmcudaSuccess;
         }
-        return kmcudaSuccess;
+        return calc_stats(ctx, samples, centroids, assignments, stats);
       }
       if (status != kmcudaSuccess) {
         return static_cast<KMCUDAResult>(status);
       }
     }
-    kmeans_adjust<<<cblock, cgrid, my_shmem_size>>>(
-        samples, assignments_prev, assignments, centroids, ccounts);
+    if (track_shift) {
+      CUCH(cudaMemcpyAsync(
+          drifts, centroids,
+          static_cast<size_t>(ctx.clusters_size) * ctx.features_size * sizeof(F),
+          cudaMemcpyDeviceToDevice, ctx.stream), kmcudaMemoryCopyError);
+    }
+    RETERR(adjust_centroids(
+        ctx, conv->reassignments, my_shmem_size, conv->profiler,
+        conv->sort_storage, samples, reassignments, assignments, centroids,
+        ccounts));
+    if (track_shift) {
+      RETERR(reset_max_shift(ctx));
+      kmeans_yy_calc_drifts<<<cgrid, cblock, 0, ctx.stream>>>(
+          ctx, centroids, drifts, &ctx.counters->max_shift);
+      RETERR(fetch_max_shift(ctx, &conv->shift));
+    }
+    // the log has been applied
+    if (conv->reorder != nullptr && conv->iterations > 0 &&
+        conv->iterations % conv->reorder->interval == 0) {
+      // Lloyd has no bounds
+      RETERR(reorder_samples(
+          ctx, conv, verbosity, original, reassignments, assignments,
+          static_cast<F**>(nullptr), static_cast<F**>(nullptr), &samples));
+    }
   }
 }
 
+template <typename F, typename L>
 KMCUDAResult kmeans_cuda_yy(
-    float tolerance, uint32_t yinyang_groups, uint32_t samples_size_,
-    uint32_t clusters_size_, uint16_t features_size, int32_t verbosity,
-    const float *samples, float *centroids, uint32_t *ccounts,
-    uint32_t *assignments_prev, uint32_t *assignments,
-    uint32_t *assignments_yy, float *centroids_yy, float *bounds_yy,
-    float *drifts_yy, uint32_t *passed_yy) {
-  if (yinyang_groups == 0 || YINYANG_DRAFT_REASSIGNMENTS <= tolerance) {
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const F *samples, F *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, L *assignments,
+    L *assignments_yy, F *centroids_yy, F *bounds_yy,
+    F *drifts_yy, KMCUDASampleIndex *passed_yy,
+    uint32_t *graph, uint32_t *stats) {
+  const uint32_t yinyang_groups = ctx.yy_groups_size;
+  const KMCUDASampleIndex samples_size = ctx.samples_size;
+  const uint32_t clusters_size = ctx.clusters_size;
+  const KMCUDAFeatureIndex features_size = ctx.features_size;
+  if (yinyang_groups == 0 || YINYANG_DRAFT_REASSIGNMENTS <= conv->tolerance) {
     if (verbosity > 0) {
       if (yinyang_groups == 0) {
         printf("too few clusters for this yinyang_t => Lloyd\n");
@@ -605,95 +1847,216 @@ KMCUDAResult kmeans_cuda_yy(
       }
     }
     return kmeans_cuda_lloyd(
-        tolerance, samples_size_, clusters_size_, features_size, verbosity,
-        false, samples, centroids, ccounts, assignments_prev, assignments);
+        ctx, conv, verbosity, false, samples, centroids, ccounts,
+        reassignments, assignments, drifts_yy, graph, stats);
   }
 
-  INFO("running Lloyd until reassignments drop below %" PRIu32 "\n",
-       (uint32_t)(YINYANG_DRAFT_REASSIGNMENTS * samples_size_));
-  int iter;
+  INFO("running Lloyd until reassignments drop below %" PRIuSAMPLE "\n",
+       static_cast<KMCUDASampleIndex>(
+           YINYANG_DRAFT_REASSIGNMENTS * samples_size));
+  KMCUDAConvergence draft_conv = *conv;
+  draft_conv.tolerance = YINYANG_DRAFT_REASSIGNMENTS;
+  // the statistics are calculated once the iterations stop
   RETERR(kmeans_cuda_lloyd(
-      YINYANG_DRAFT_REASSIGNMENTS, samples_size_, clusters_size_, features_size,
-      verbosity, false, samples, centroids, ccounts, assignments_prev,
-      assignments, &iter));
-  if (check_changed(iter, tolerance, samples_size_, 0) < kmcudaSuccess) {
-    return kmcudaSuccess;
+      ctx, &draft_conv, verbosity, false, samples, centroids, ccounts,
+      reassignments, assignments, drifts_yy, graph, nullptr));
+  // the draft has already checked the rest of the stop conditions
+  draft_conv.tolerance = conv->tolerance;
+  *conv = draft_conv;
+  int iter = conv->iterations;
+  const F *original = samples;
+  if (conv->reorder != nullptr && conv->reorder->active) {
+    samples = reinterpret_cast<const F*>(conv->reorder->samples);
+  }
+  if (conv->stop_reason != kmcudaStopTolerance ||
+      conv->reassignments <= conv->tolerance * samples_size) {
+    return calc_stats(ctx, samples, centroids, assignments, stats);
   }
 
   // map each centroid to yinyang group -> assignments_yy
-  CUCH(cudaMemcpyToSymbol(samples_size, &clusters_size_, sizeof(samples_size_)),
-       kmcudaMemoryCopyError);
-  CUCH(cudaMemcpyToSymbol(clusters_size, &yinyang_groups, sizeof(clusters_size_)),
-       kmcudaMemoryCopyError);
-  auto tmpbuf = passed_yy + samples_size_ - clusters_size_ - yinyang_groups;
+  {
+  PROFILE_SCOPE(conv->profiler, kmcudaPhaseYinyangGroups);
+  // the centroids are the samples and the groups are the clusters
+  KMCUDAContext groups_ctx = ctx;
+  groups_ctx.samples_size = clusters_size;
+  groups_ctx.clusters_size = yinyang_groups;
+  groups_ctx.yy_groups_size = 0;
+  // the tail of passed_yy keeps the log (the kmeans++ weights before it) and
+  // then the group sizes, both must be 8-byte aligned
+  const size_t log_words = (clusters_size + 1) & ~1u;
+  const size_t tmp_words = log_words +
+      yinyang_groups * sizeof(KMCUDASampleIndex) / sizeof(uint32_t);
+  const size_t passed_words =
+      samples_size * sizeof(KMCUDASampleIndex) / sizeof(uint32_t);
+  auto tmpbuf = reinterpret_cast<uint32_t*>(passed_yy) +
+      ((passed_words - tmp_words) & ~static_cast<size_t>(1));
   RETERR(kmeans_init_centroids(
-      kmcudaInitMethodPlusPlus, clusters_size_, features_size, yinyang_groups,
-      0, verbosity, centroids, reinterpret_cast<float*>(tmpbuf), centroids_yy),
+      &groups_ctx, kmcudaInitMethodPlusPlus, 0, verbosity, centroids,
+      reinterpret_cast<float*>(tmpbuf), centroids_yy, nullptr),
     INFO("kmeans_init_centroids() failed for yinyang groups: %s\n",
          cudaGetErrorString(cudaGetLastError())));
+  KMCUDAConvergence groups_conv = {};
+  groups_conv.tolerance = YINYANG_GROUP_TOLERANCE;
+  groups_conv.deadline = std::chrono::steady_clock::time_point::max();
+  groups_conv.sort_storage = conv->sort_storage;
   RETERR(kmeans_cuda_lloyd(
-      YINYANG_GROUP_TOLERANCE, clusters_size_, yinyang_groups, features_size,
-      verbosity, false, centroids, centroids_yy, tmpbuf + clusters_size_,
-      tmpbuf, assignments_yy));
+      groups_ctx, &groups_conv, verbosity, false, centroids, centroids_yy,
+      reinterpret_cast<KMCUDASampleIndex*>(tmpbuf + log_words),
+      reinterpret_cast<uint64_t*>(tmpbuf),
+      assignments_yy, static_cast<F*>(nullptr), nullptr, nullptr));
+  }
 
-  CUCH(cudaMemcpyToSymbol(samples_size, &samples_size_, sizeof(samples_size_)),
-       kmcudaMemoryCopyError);
-  CUCH(cudaMemcpyToSymbol(clusters_size, &clusters_size_, sizeof(clusters_size_)),
-       kmcudaMemoryCopyError);
   uint32_t my_shmem_size;
-  RETERR(prepare_mem(ccounts, assignments, samples_size_, clusters_size_,
-                     true, &my_shmem_size));
+  RETERR(prepare_mem(ctx, ccounts, assignments, true, &my_shmem_size));
+  auto yy_init = pick_features_kernel<YinyangInitKernel<F, L>>(features_size);
+  auto yy_local_filter = pick_features_kernel<YinyangLocalFilterKernel<F, L>>(
+      features_size);
   dim3 siblock(BS_YY_INI, 1, 1);
-  dim3 sigrid(samples_size_ / siblock.x + 1, 1, 1);
+  dim3 sigrid(samples_size / siblock.x + 1, 1, 1);
   dim3 sgblock(BS_YY_GFL, 1, 1);
-  dim3 sggrid(samples_size_ / sgblock.x + 1, 1, 1);
+  dim3 sggrid(samples_size / sgblock.x + 1, 1, 1);
   dim3 slblock(BS_YY_LFL, 1, 1);
-  dim3 slgrid(samples_size_ / slblock.x + 1, 1, 1);
+  // the local filter blocks are persistent, as many as the device runs at once
+  int device, multiprocessors, local_filter_blocks;
+  CUCH(cudaGetDevice(&device), kmcudaRuntimeError);
+  CUCH(cudaDeviceGetAttribute(&multiprocessors, cudaDevAttrMultiProcessorCount,
+                              device), kmcudaRuntimeError);
+  CUCH(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+      &local_filter_blocks, yy_local_filter, slblock.x, my_shmem_size),
+       kmcudaRuntimeError);
+  dim3 slgrid(std::max(multiprocessors * local_filter_blocks, 1), 1, 1);
   dim3 cblock(BS_LL_CNT, 1, 1);
-  dim3 cgrid(clusters_size_ / cblock.x + 1, 1, 1);
+  dim3 cgrid(clusters_size / cblock.x + 1, 1, 1);
   dim3 gblock(BLOCK_SIZE, 1, 1);
   dim3 ggrid(yinyang_groups / gblock.x + 1, 1, 1);
   bool refresh = true;
-  uint32_t passed_number_ = 0;
+  KMCUDACounter passed_number_ = 0;
+  // the draft may have just reordered, the next reorder waits for Yinyang
+  const int first_iter = iter;
+  // the bounds swap with this buffer on every reorder
+  F *bounds_scratch = conv->reorder != nullptr?
+      reinterpret_cast<F*>(conv->reorder->bounds) : nullptr;
   for (; ; iter++) {
     if (!refresh) {
-      int status = check_changed(iter, tolerance, samples_size_, verbosity);
+      CUCH(cudaMemcpyAsync(&passed_number_, &ctx.counters->passed_number,
+                           sizeof(passed_number_), cudaMemcpyDeviceToHost,
+                           ctx.stream), kmcudaMemoryCopyError);
+      CUCH(cudaStreamSynchronize(ctx.stream), kmcudaRuntimeError);
+      DEBUG("passed number: %" PRIuSAMPLE "\n",
+            static_cast<KMCUDASampleIndex>(passed_number_));
+      PROFILE_COUNT(conv->profiler, passed, passed_number_);
+      PROFILE_COUNT(conv->profiler, bytes_touched,
+                    scan_bytes<F>(ctx, passed_number_,
+                               passed_number_ / slblock.x + 1) +
+                    passed_number_ * (yinyang_groups + 1) * sizeof(F));
+      conv->passed_ratio = (passed_number_ + 0.f) / samples_size;
+      int status = check_changed(ctx, iter, verbosity, conv);
       if (status < kmcudaSuccess) {
-        return kmcudaSuccess;
+        // the filters do not calculate the exact distances for every sample
+        return calc_stats(ctx, samples, centroids, assignments, stats);
       }
       if (status != kmcudaSuccess) {
         return static_cast<KMCUDAResult>(status);
       }
-      CUCH(cudaMemcpyFromSymbol(&passed_number_, passed_number, sizeof(passed_number_)),
-           kmcudaMemoryCopyError);
-      DEBUG("passed number: %" PRIu32 "\n", passed_number_);
-      if (1.f - (passed_number_ + 0.f) / samples_size_ < YINYANG_REFRESH_EPSILON) {
+      if (1.f - conv->passed_ratio < YINYANG_REFRESH_EPSILON) {
         refresh = true;
+        conv->refreshes++;
       }
       passed_number_ = 0;
     }
     if (refresh) {
       INFO("refreshing Yinyang bounds...\n");
-      kmeans_yy_init<<<sigrid, siblock, my_shmem_size>>>(
-          samples, centroids, assignments, assignments_yy, bounds_yy);
+      PROFILE_SCOPE(conv->profiler, kmcudaPhaseYinyangRefresh);
+      yy_init<<<sigrid, siblock, my_shmem_size, ctx.stream>>>(
+          ctx, samples, centroids, assignments, assignments_yy, bounds_yy);
+      PROFILE_COUNT(conv->profiler, bytes_touched,
+                    scan_bytes<F>(ctx, samples_size, sigrid.x) +
+                    samples_size * (yinyang_groups + 1) * sizeof(F));
       refresh = false;
     }
     CUCH(cudaMemcpyAsync(
-        drifts_yy, centroids, clusters_size_ * features_size * sizeof(float),
-        cudaMemcpyDeviceToDevice), kmcudaMemoryCopyError);
-    kmeans_adjust<<<cblock, cgrid, my_shmem_size>>>(
-          samples, assignments_prev, assignments, centroids, ccounts);
-    kmeans_yy_calc_drifts<<<cblock, cgrid>>>(centroids, drifts_yy);
-    kmeans_yy_find_group_max_drifts<<<gblock, ggrid, my_shmem_size>>>(
-        assignments_yy, drifts_yy);
-    CUCH(cudaMemcpyToSymbolAsync(passed_number, &passed_number_, sizeof(passed_number_)),
-         kmcudaMemoryCopyError);
-    kmeans_yy_global_filter<<<sggrid, sgblock>>>(
-        samples, centroids, assignments_yy, drifts_yy, assignments,
-        assignments_prev, bounds_yy, passed_yy);
-    kmeans_yy_local_filter<<<slgrid, slblock, my_shmem_size>>>(
-        samples, passed_yy, centroids, assignments_yy, drifts_yy, assignments,
-        bounds_yy);
+        drifts_yy, centroids,
+        static_cast<size_t>(clusters_size) * features_size * sizeof(F),
+        cudaMemcpyDeviceToDevice, ctx.stream), kmcudaMemoryCopyError);
+    RETERR(adjust_centroids(
+        ctx, conv->reassignments, my_shmem_size, conv->profiler,
+        conv->sort_storage, samples, reassignments, assignments, centroids,
+        ccounts));
+    // the log has been applied and the filters update the permuted bounds
+    if (conv->reorder != nullptr && iter > first_iter &&
+        conv->iterations % conv->reorder->interval == 0) {
+      RETERR(reorder_samples(
+          ctx, conv, verbosity, original, reassignments, assignments,
+          &bounds_yy, &bounds_scratch, &samples));
+    }
+    {
+      PROFILE_SCOPE(conv->profiler, kmcudaPhaseDrifts);
+      const bool track_shift = conv->shift_tolerance > 0;
+      if (track_shift) {
+        RETERR(reset_max_shift(ctx));
+      }
+      kmeans_yy_calc_drifts<<<cgrid, cblock, 0, ctx.stream>>>(
+          ctx, centroids, drifts_yy,
+          track_shift? &ctx.counters->max_shift : nullptr);
+      kmeans_yy_find_group_max_drifts<<<ggrid, gblock, my_shmem_size,
+                                        ctx.stream>>>(
+          ctx, assignments_yy, drifts_yy);
+      if (track_shift) {
+        RETERR(fetch_max_shift(ctx, &conv->shift));
+      }
+    }
+    CUCH(cudaMemsetAsync(&ctx.counters->passed_number, 0,
+                         sizeof(KMCUDACounter), ctx.stream),
+         kmcudaRuntimeError);
+    CUCH(cudaMemsetAsync(&ctx.counters->passed_cursor, 0,
+                         sizeof(KMCUDACounter), ctx.stream),
+         kmcudaRuntimeError);
+    {
+      PROFILE_SCOPE(conv->profiler, kmcudaPhaseGlobalFilter);
+      kmeans_yy_global_filter<<<sggrid, sgblock, 0, ctx.stream>>>(
+          ctx, samples, centroids, assignments_yy, drifts_yy, assignments,
+          bounds_yy, passed_yy);
+      PROFILE_COUNT(conv->profiler, bytes_touched,
+                    samples_size * (2 * (yinyang_groups + 1) * sizeof(F) +
+                                    sizeof(L)));
+    }
+    {
+      PROFILE_SCOPE(conv->profiler, kmcudaPhaseLocalFilter);
+      yy_local_filter<<<slgrid, slblock, my_shmem_size, ctx.stream>>>(
+          ctx, samples, passed_yy, centroids, assignments_yy, drifts_yy,
+          assignments, bounds_yy, reassignments);
+    }
   }
 }
-}
+
+template KMCUDAResult kmeans_cuda_yy<float, uint16_t>(
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const float *samples, float *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, uint16_t *assignments,
+    uint16_t *assignments_yy, float *centroids_yy, float *bounds_yy,
+    float *drifts_yy, KMCUDASampleIndex *passed_yy,
+    uint32_t *graph, uint32_t *stats);
+
+template KMCUDAResult kmeans_cuda_yy<float, uint32_t>(
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const float *samples, float *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, uint32_t *assignments,
+    uint32_t *assignments_yy, float *centroids_yy, float *bounds_yy,
+    float *drifts_yy, KMCUDASampleIndex *passed_yy,
+    uint32_t *graph, uint32_t *stats);
+
+template KMCUDAResult kmeans_cuda_yy<double, uint16_t>(
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const double *samples, double *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, uint16_t *assignments,
+    uint16_t *assignments_yy, double *centroids_yy, double *bounds_yy,
+    double *drifts_yy, KMCUDASampleIndex *passed_yy,
+    uint32_t *graph, uint32_t *stats);
+
+template KMCUDAResult kmeans_cuda_yy<double, uint32_t>(
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const double *samples, double *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, uint32_t *assignments,
+    uint32_t *assignments_yy, double *centroids_yy, double *bounds_yy,
+    double *drifts_yy, KMCUDASampleIndex *passed_yy,
+    uint32_t *graph, uint32_t *stats);
@@ -4,22 +4,34 @@
 #include <cinttypes>
 #include <cfloat>
 #include <cmath>
+#include <limits>
 #include <cassert>
+#include <algorithm>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
 
+#include <omp.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include <cuda_runtime_api.h>
 
+#include "philox.h"
 #include "wrappers.h"
 #include "private.h"
 
 
-#define CUMEMCPY(dst, src, size, flag) \
-do { if (cudaMemcpy(dst, src, size, flag) != cudaSuccess) { \
+#define CUMEMCPY(dst, src, size, flag, stream) \
+do { if (cudaMemcpyAsync(dst, src, size, flag, stream) != cudaSuccess || \
+         cudaStreamSynchronize(stream) != cudaSuccess) { \
   return kmcudaMemoryCopyError; \
 } } while(false)
 
-#define CUMEMCPY_ASYNC(dst, src, size, flag) \
-do { if (cudaMemcpyAsync(dst, src, size, flag) != cudaSuccess) { \
+#define CUMEMCPY_ASYNC(dst, src, size, flag, stream) \
+do { if (cudaMemcpyAsync(dst, src, size, flag, stream) != cudaSuccess) { \
   return kmcudaMemoryCopyError; \
 } } while(false)
 
@@ -31,10 +43,160 @@ do { if (cudaMemcpyAsync(dst, src, size, flag) != cudaSuccess) { \
   } \
 } while(false)
 
+/// the size of the host or device tile of upload_samples() in bytes.
+#define UPLOAD_TILE_SIZE (64 << 20)
+/// the minimal number of rows in the tile of upload_samples().
+#define PACK_TILE_ROWS 32
+/// the maximal number of the restarts which run at the same time, see
+/// kmeans_cuda_run(). More streams hardly overlap better.
+#define MAX_CONCURRENT_RESTARTS 4
+/// the maximal number of the datasets or the subspaces which are clustered at
+/// the same time by kmeans_cuda_batch() and kmeans_train_pq().
+#define MAX_CONCURRENT_FITS 8
+
+#ifdef PROFILE
+KMCUDAProfiler::KMCUDAProfiler(KMCUDAProfile *profile, cudaStream_t stream)
+    : profile_(profile), stream_(stream),
+      host_origin_(std::chrono::steady_clock::now()), restart_(0),
+      iteration_(0) {
+  cudaEventCreate(&origin_);
+  cudaEventRecord(origin_, stream_);
+}
+
+KMCUDAProfiler::~KMCUDAProfiler() {
+  for (auto &r : records_) {
+    cudaEventDestroy(r.start);
+    if (r.stop != nullptr) {
+      cudaEventDestroy(r.stop);
+    }
+  }
+  for (auto e : pool_) {
+    cudaEventDestroy(e);
+  }
+  cudaEventDestroy(origin_);
+}
+
+double KMCUDAProfiler::host_now() const {
+  return std::chrono::duration<double, std::micro>(
+      std::chrono::steady_clock::now() - host_origin_).count();
+}
+
+cudaEvent_t KMCUDAProfiler::acquire() {
+  cudaEvent_t event;
+  if (pool_.empty()) {
+    cudaEventCreate(&event);
+  } else {
+    event = pool_.back();
+    pool_.pop_back();
+  }
+  return event;
+}
+
+void KMCUDAProfiler::begin(KMCUDAPhase phase) {
+  Record record = {};
+  record.event.phase = phase;
+  record.event.restart = restart_;
+  record.event.iteration = iteration_;
+  record.event.host_begin = host_now();
+  record.start = acquire();
+  record.parent = open_.empty()? -1 : open_.back();
+  cudaEventRecord(record.start, stream_);
+  open_.push_back(records_.size());
+  records_.push_back(record);
+}
+
+void KMCUDAProfiler::end(KMCUDAPhase phase) {
+  assert(!open_.empty() && records_[open_.back()].event.phase == phase);
+  Record &record = records_[open_.back()];
+  open_.pop_back();
+  record.stop = acquire();
+  cudaEventRecord(record.stop, stream_);
+  record.event.host_end = host_now();
+}
+
+KMCUDAResult KMCUDAProfiler::finish() {
+  assert(open_.empty());
+  if (records_.empty()) {
+    return kmcudaSuccess;
+  }
+  // the last stop is recorded after all the others on the same stream
+  if (cudaEventSynchronize(records_.back().stop) != cudaSuccess) {
+    return kmcudaRuntimeError;
+  }
+  std::vector<double> exclusive(records_.size());
+  for (size_t i = 0; i < records_.size(); i++) {
+    Event &event = records_[i].event;
+    float begin_ms = 0, end_ms = 0;
+    if (cudaEventElapsedTime(&begin_ms, origin_, records_[i].start) != cudaSuccess ||
+        cudaEventElapsedTime(&end_ms, origin_, records_[i].stop) != cudaSuccess) {
+      return kmcudaRuntimeError;
+    }
+    event.device_begin = begin_ms * 1000.;
+    event.device_end = end_ms * 1000.;
+    double seconds = (end_ms - begin_ms) / 1000.;
+    exclusive[i] += seconds;
+    if (records_[i].parent >= 0) {
+      exclusive[records_[i].parent] -= seconds;
+    }
+  }
+  for (size_t i = 0; i < records_.size(); i++) {
+    profile_->phase_times[records_[i].event.phase] += exclusive[i];
+    events_.push_back(records_[i].event);
+    pool_.push_back(records_[i].start);
+    pool_.push_back(records_[i].stop);
+  }
+  records_.clear();
+  return kmcudaSuccess;
+}
+
+/// Writes the profiled phases in Chrome trace event format. The host thread
+/// and the device timelines are shown as separate lanes.
+static KMCUDAResult write_trace(
+    const char *path, uint32_t device, const KMCUDAProfiler &profiler,
+    int32_t verbosity) {
+  static const char *names[kmcudaPhaseCount] = {
+    "init", "lloyd", "yinyang groups", "yinyang refresh", "drifts",
+    "global filter", "local filter", "adjust", "kmeans++ step", "neighbors",
+    "reorder"
+  };
+  FILE *fout = fopen(path, "w");
+  if (fout == nullptr) {
+    INFO("failed to open %s for writing\n", path);
+    return kmcudaInvalidArguments;
+  }
+  fprintf(fout, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(fout, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"args\": {\"name\": \"kmcuda\"}},\n");
+  fprintf(fout, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"tid\": 1, \"args\": {\"name\": \"host\"}},\n");
+  fprintf(fout, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"tid\": 2, \"args\": {\"name\": \"device %" PRIu32 "\"}}",
+          device);
+  for (auto &e : profiler.events()) {
+    for (int lane = 1; lane <= 2; lane++) {
+      double begin = lane == 1? e.host_begin : e.device_begin;
+      double end = lane == 1? e.host_end : e.device_end;
+      fprintf(fout, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                    "\"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"restart\": %" PRIu32 ", \"%s\": %" PRIu32 "}}",
+              names[e.phase], lane == 1? "host" : "device", lane, begin,
+              end - begin, e.restart,
+              e.phase == kmcudaPhasePlusPlus? "step" : "iteration", e.iteration);
+    }
+  }
+  fprintf(fout, "\n]}\n");
+  if (fclose(fout) != 0) {
+    INFO("failed to write %s\n", path);
+    return kmcudaRuntimeError;
+  }
+  return kmcudaSuccess;
+}
+#endif  // PROFILE
+
 static int check_args(
-    float tolerance, float yinyang_t, uint32_t samples_size, uint16_t features_size,
-    uint32_t clusters_size, const float *samples, float *centroids,
-    uint32_t *assignments) {
+    float tolerance, float yinyang_t, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const void *samples, void *centroids, uint32_t *assignments) {
   if (clusters_size < 2 || clusters_size == UINT32_MAX) {
     return kmcudaInvalidArguments;
   }
@@ -67,35 +229,47 @@ static KMCUDAResult print_memory_stats() {
   return kmcudaSuccess;
 }
 
-extern "C" {
-
+template <typename F>
 KMCUDAResult kmeans_init_centroids(
-    KMCUDAInitMethod method, uint32_t samples_size, uint16_t features_size,
-    uint32_t clusters_size, uint32_t seed, int32_t verbosity, float *samples,
-    void *dists, float *centroids) {
-  uint32_t ssize = features_size * sizeof(float);
-  srand(seed);
+    const KMCUDAContext *ctx, KMCUDAInitMethod method, uint32_t seed,
+    int32_t verbosity, const F *samples, void *dists, F *centroids,
+    KMCUDAProfiler *profiler) {
+  const KMCUDASampleIndex samples_size = ctx->samples_size;
+  const KMCUDAFeatureIndex features_size = ctx->features_size;
+  const uint32_t clusters_size = ctx->clusters_size;
+  size_t ssize = features_size * sizeof(F);
+  // centroid #i is drawn from the independent stream #i, so the picks
+  // do not depend on each other or on the other threads
   switch (method) {
-    case kmcudaInitMethodRandom:
+    case kmcudaInitMethodRandom: {
       INFO("randomly picking initial centroids...\n");
+      std::unique_ptr<KMCUDASampleIndex[]> picks(
+          new KMCUDASampleIndex[clusters_size]);
+      #pragma omp parallel for
+      for (uint32_t c = 0; c < clusters_size; c++) {
+        picks[c] = KMCUDARandom(seed, c).bounded64(samples_size);
+      }
       for (uint32_t c = 0; c < clusters_size; c++) {
         if ((c + 1) % 1000 == 0 || c == clusters_size - 1) {
           INFO("\rcentroid #%" PRIu32, c + 1);
           fflush(stdout);
-          CUMEMCPY(centroids + c * features_size,
-                   samples + (rand() % samples_size) * features_size,
-                   ssize, cudaMemcpyDeviceToDevice);
+          CUMEMCPY(centroids + static_cast<uint64_t>(c) * features_size,
+                   samples + static_cast<uint64_t>(picks[c]) * features_size,
+                   ssize, cudaMemcpyDeviceToDevice, ctx->stream);
         } else {
-          CUMEMCPY_ASYNC(centroids + c * features_size,
-                         samples + (rand() % samples_size) * features_size,
-                         ssize, cudaMemcpyDeviceToDevice);
+          CUMEMCPY_ASYNC(centroids + static_cast<uint64_t>(c) * features_size,
+                         samples + static_cast<uint64_t>(picks[c]) * features_size,
+                         ssize, cudaMemcpyDeviceToDevice, ctx->stream);
         }
       }
       break;
+    }
     case kmcudaInitMethodPlusPlus:
       INFO("performing kmeans++...\n");
-      CUMEMCPY(centroids, samples + (rand() % samples_size) * features_size,
-               ssize, cudaMemcpyDeviceToDevice);
+      CUMEMCPY(centroids,
+               samples + static_cast<uint64_t>(
+                   KMCUDARandom(seed, 0).bounded64(samples_size)) * features_size,
+               ssize, cudaMemcpyDeviceToDevice, ctx->stream);
       std::unique_ptr<float[]> host_dists(new float[samples_size]);
       float *dev_sums = NULL;
       unique_devptrptr dev_sums_sentinel(reinterpret_cast<void**>(&dev_sums));
@@ -106,17 +280,19 @@ KMCUDAResult kmeans_init_centroids(
           fflush(stdout);
         }
         float dist_sum = 0;
+        PROFILE_ITERATION(profiler, i);
+        PROFILE_SCOPE(profiler, kmcudaPhasePlusPlus);
         RETERR(kmeans_cuda_plus_plus(
-            samples_size, i, samples, centroids, reinterpret_cast<float*>(dists),
+            ctx, i, samples, centroids, reinterpret_cast<float*>(dists),
             &dist_sum, &dev_sums),
                DEBUG("\nkmeans_cuda_plus_plus failed\n"));
         assert(dist_sum == dist_sum);
         CUMEMCPY(host_dists.get(), dists, samples_size * sizeof(float),
-                 cudaMemcpyDeviceToHost);
-        double choice = ((rand() + .0) / RAND_MAX);
-        uint32_t choice_approx = choice * samples_size;
+                 cudaMemcpyDeviceToHost, ctx->stream);
+        double choice = KMCUDARandom(seed, i).uniform();
+        KMCUDASampleIndex choice_approx = choice * samples_size;
         double choice_sum = choice * dist_sum;
-        uint32_t j;
+        KMCUDASampleIndex j;
         {
           double dist_sum2 = 0;
           for (j = 0; j < samples_size && dist_sum2 < choice_sum; j++) {
@@ -131,7 +307,7 @@ KMCUDAResult kmeans_init_centroids(
         } else {
           double dist_sum2 = 0;
           #pragma omp simd reduction(+:dist_sum2)
-          for (uint32_t t = 0; t < choice_approx; t++) {
+          for (KMCUDASampleIndex t = 0; t < choice_approx; t++) {
             dist_sum2 += host_dists[t];
           }
           if (dist_sum2 < choice_sum) {
@@ -146,9 +322,9 @@ KMCUDAResult kmeans_init_centroids(
           }
         }
         assert(j > 0);
-        CUMEMCPY_ASYNC(centroids + i * features_size,
-                       samples + (j - 1) * features_size,
-                       ssize, cudaMemcpyDeviceToDevice);
+        CUMEMCPY_ASYNC(centroids + static_cast<uint64_t>(i) * features_size,
+                       samples + static_cast<uint64_t>(j - 1) * features_size,
+                       ssize, cudaMemcpyDeviceToDevice, ctx->stream);
       }
       break;
   }
@@ -157,108 +333,1699 @@ KMCUDAResult kmeans_init_centroids(
   return kmcudaSuccess;
 }
 
-int kmeans_cuda(bool kmpp, float tolerance, float yinyang_t, uint32_t samples_size,
-                uint16_t features_size, uint32_t clusters_size, uint32_t seed,
-                uint32_t device, int32_t verbosity, const float *samples,
-                float *centroids, uint32_t *assignments) {
-  DEBUG("arguments: %d %.3f %.2f %" PRIu32 " %" PRIu16 " %" PRIu32 " %" PRIu32
-        " %" PRIu32 " %" PRIi32 " %p %p %p\n",
-        kmpp, tolerance, yinyang_t, samples_size, features_size, clusters_size,
-        seed, device, verbosity, samples, centroids, assignments);
+template KMCUDAResult kmeans_init_centroids<float>(
+    const KMCUDAContext *ctx, KMCUDAInitMethod method, uint32_t seed,
+    int32_t verbosity, const float *samples, void *dists, float *centroids,
+    KMCUDAProfiler *profiler);
+
+template KMCUDAResult kmeans_init_centroids<double>(
+    const KMCUDAContext *ctx, KMCUDAInitMethod method, uint32_t seed,
+    int32_t verbosity, const double *samples, void *dists, double *centroids,
+    KMCUDAProfiler *profiler);
+
+/// Copies the labels back to the host and widens them to uint32_t in place:
+/// the narrow labels are put in the tail of the output array.
+template <typename L>
+static KMCUDAResult copy_assignments(
+    KMCUDASampleIndex samples_size, const L *device_assignments, uint32_t *assignments,
+    cudaStream_t stream) {
+  if (sizeof(L) == sizeof(uint32_t)) {
+    CUMEMCPY(assignments, device_assignments, samples_size * sizeof(uint32_t),
+             cudaMemcpyDeviceToHost, stream);
+    return kmcudaSuccess;
+  }
+  L *narrow = reinterpret_cast<L*>(assignments + samples_size) - samples_size;
+  CUMEMCPY(narrow, device_assignments, samples_size * sizeof(L),
+           cudaMemcpyDeviceToHost, stream);
+  // the write of assignments[i] never reaches narrow[j > i]
+  for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+    assignments[i] = narrow[i];
+  }
+  return kmcudaSuccess;
+}
+
+/// Converts the device statistics buffer (see kmeans_cuda_yy()) to
+/// KMCUDAStatistics.
+static void fill_statistics(
+    uint32_t clusters_size, KMCUDASampleIndex samples_size,
+    const uint8_t *host_stats, KMCUDAStatistics *stats) {
+  const KMCUDASampleIndex blocks = stats_blocks(samples_size);
+  const double *inertias = reinterpret_cast<const double*>(host_stats);
+  const KMCUDACounter *ccounts =
+      reinterpret_cast<const KMCUDACounter*>(inertias + blocks);
+  const float *sse = reinterpret_cast<const float*>(ccounts + clusters_size);
+  const float *radiuses = sse + clusters_size;
+  // always in the same order, so the restarts compare the exact sums
+  double inertia = 0;
+  for (KMCUDASampleIndex b = 0; b < blocks; b++) {
+    inertia += inertias[b];
+  }
+  stats->inertia = inertia;
+  if (stats->ccounts != nullptr) {
+    static_assert(sizeof(KMCUDACounter) == sizeof(KMCUDASampleIndex),
+                  "the cluster counts must be copied as is");
+    memcpy(stats->ccounts, ccounts, clusters_size * sizeof(KMCUDASampleIndex));
+  }
+  if (stats->sse != nullptr) {
+    memcpy(stats->sse, sse, clusters_size * sizeof(float));
+  }
+  if (stats->radiuses != nullptr) {
+    for (uint32_t c = 0; c < clusters_size; c++) {
+      stats->radiuses[c] = sqrt(radiuses[c]);
+    }
+  }
+}
+
+/// Device buffers and the stream of a run. They are sized for the largest
+/// problem, so the same workspace serves a sequence of runs.
+class KMCUDAWorkspace {
+ public:
+  KMCUDAWorkspace() = default;
+  KMCUDAWorkspace(const KMCUDAWorkspace&) = delete;
+  KMCUDAWorkspace &operator=(const KMCUDAWorkspace&) = delete;
+
+  ~KMCUDAWorkspace() {
+    for (void *ptr : {counters, samples, centroids, assignments, reassignments,
+                      ccounts, drifts_yy, assignments_yy, bounds_yy, passed_yy,
+                      graph, stats, reordered_samples, order, perm,
+                      reordered_bounds}) {
+      cudaFree(ptr);
+    }
+    if (centroids_yy != passed_yy) {
+      cudaFree(centroids_yy);
+    }
+    cudaFree(sort_storage.buffer);
+    if (stream != nullptr) {
+      cudaStreamDestroy(stream);
+    }
+  }
+
+  /// label_size is sizeof(L) and element_size is sizeof(F). The samples
+  /// buffer is allocated only if upload_samples is true, otherwise the caller
+  /// provides the device samples.
+  /// If reusable is true, the workspace may serve smaller problems, so the
+  /// group centroids never share the memory with the passed samples.
+  /// neighbors is KMCUDAOptions::neighbors. If reorder is true, there is
+  /// room for the samples sorted by cluster, see KMCUDAReorder.
+  KMCUDAResult allocate(
+      KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+      uint32_t clusters_size, size_t label_size, size_t element_size,
+      uint32_t yinyang_groups, bool track_shift,
+      uint32_t neighbors, bool with_stats, bool reorder, bool upload_samples,
+      bool reusable, int32_t verbosity) {
+    // everything is issued to the private stream and all the sizes and
+    // counters live in KMCUDAContext, so concurrent runs do not interfere
+    if (cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking) != cudaSuccess) {
+      INFO("failed to create a CUDA stream\n");
+      return kmcudaRuntimeError;
+    }
+    CUMALLOC(counters, sizeof(KMCUDACounters), "counters");
+    if (upload_samples) {
+      size_t samples_bytes = samples_size;
+      samples_bytes *= features_size * element_size;
+      CUMALLOC(samples, samples_bytes, "samples");
+    }
+    size_t centroids_size =
+        static_cast<size_t>(clusters_size) * features_size * element_size;
+    CUMALLOC(centroids, centroids_size, "centroids");
+    CUMALLOC(assignments, samples_size * label_size, "assignments");
+    CUMALLOC(reassignments, samples_size * sizeof(uint32_t), "reassignments");
+    CUMALLOC(ccounts, clusters_size * sizeof(KMCUDASampleIndex), "ccounts");
+    // Lloyd uses the drifts buffer only to track the centroid shifts
+    if (yinyang_groups >= 1 || track_shift) {
+      CUMALLOC(drifts_yy, centroids_size + clusters_size * element_size,
+               "yinyang drifts");
+    }
+    if (yinyang_groups >= 1) {
+      CUMALLOC(assignments_yy, clusters_size * label_size,
+               "yinyang assignments");
+      size_t yyb_size = samples_size;
+      yyb_size *= (yinyang_groups + 1) * element_size;
+      CUMALLOC(bounds_yy, yyb_size, "yinyang bounds");
+      size_t passed_size = samples_size * sizeof(KMCUDASampleIndex);
+      CUMALLOC(passed_yy, passed_size, "yinyang passed");
+      size_t yyc_size =
+          static_cast<size_t>(yinyang_groups) * features_size * element_size;
+      // +2 is reserved for aligning the temporary reassignments log
+      if (!reusable && yyc_size + (clusters_size + 2) * sizeof(uint32_t) +
+          yinyang_groups * sizeof(KMCUDASampleIndex) <= passed_size) {
+        centroids_yy = passed_yy;
+      } else {
+        CUMALLOC(centroids_yy, yyc_size, "yinyang group centroids");
+      }
+    }
+    if (neighbors > 0) {
+      size_t graph_size = samples_size * sizeof(KMCUDASampleIndex);
+      graph_size += static_cast<size_t>(clusters_size) * neighbors * sizeof(uint32_t);
+      graph_size += 2 * clusters_size * element_size;
+      CUMALLOC(graph, graph_size, "centroid graph");
+    }
+    if (with_stats) {
+      CUMALLOC(stats, stats_size(clusters_size, samples_size), "statistics");
+    }
+    if (reorder) {
+      size_t samples_bytes = samples_size;
+      samples_bytes *= features_size * element_size;
+      CUMALLOC(reordered_samples, samples_bytes, "reordered samples");
+      CUMALLOC(order, samples_size * sizeof(KMCUDASampleIndex), "sample order");
+      CUMALLOC(perm, samples_size * sizeof(KMCUDASampleIndex),
+               "sample permutation");
+      if (yinyang_groups >= 1) {
+        size_t yyb_size = samples_size;
+        yyb_size *= (yinyang_groups + 1) * element_size;
+        CUMALLOC(reordered_bounds, yyb_size, "reordered yinyang bounds");
+      }
+    }
+    return kmcudaSuccess;
+  }
+
+  cudaStream_t stream = nullptr;
+  void *counters = nullptr, *samples = nullptr, *centroids = nullptr,
+      *assignments = nullptr, *reassignments = nullptr, *ccounts = nullptr,
+      *drifts_yy = nullptr, *assignments_yy = nullptr, *bounds_yy = nullptr,
+      *passed_yy = nullptr, *centroids_yy = nullptr, *graph = nullptr,
+      *stats = nullptr, *reordered_samples = nullptr, *order = nullptr,
+      *perm = nullptr, *reordered_bounds = nullptr;
+  /// the thrust sort scratch grows during the runs, the buffers above do not.
+  mutable KMCUDASortStorage sort_storage = {};
+};
+
+/// Allocates the workspaces of up to slots_size concurrent fits with
+/// allocate(KMCUDAWorkspace*). The allocation stops at the first failure, so
+/// the fits share fewer slots when the device memory is short. Returns the
+/// error only if no workspace was allocated.
+template <typename A>
+static KMCUDAResult allocate_slots(
+    uint32_t slots_size, const A &allocate,
+    std::vector<std::unique_ptr<KMCUDAWorkspace>> *slots) {
+  KMCUDAResult result = kmcudaSuccess;
+  for (uint32_t s = 0; s < slots_size; s++) {
+    std::unique_ptr<KMCUDAWorkspace> slot(new KMCUDAWorkspace);
+    result = allocate(slot.get());
+    if (result != kmcudaSuccess) {
+      // reset the allocation error, it does not fail the fits
+      cudaGetLastError();
+      break;
+    }
+    slots->emplace_back(std::move(slot));
+  }
+  return slots->empty()? result : kmcudaSuccess;
+}
+
+/// The workspace which outlives a single fit, see kmeans_cuda_session_create().
+struct KMCUDASession {
+  KMCUDAOptions options;
+  KMCUDAFeatureIndex features_size;
+  uint32_t clusters_size;
+  /// the number of samples which fit into ws.
+  KMCUDASampleIndex capacity;
+  std::unique_ptr<KMCUDAWorkspace> ws;
+};
+
+/// Serializes the progress callback of the concurrent restarts.
+struct KMCUDASerialProgress {
+  KMCUDAProgressCallback progress;
+  void *arg;
+
+  static int call(const KMCUDAProgress *progress, void *arg) {
+    auto self = reinterpret_cast<const KMCUDASerialProgress*>(arg);
+    int stop;
+    #pragma omp critical(kmcuda_progress)
+    stop = self->progress(progress, self->arg);
+    return stop;
+  }
+};
+
+/// Runs restart #restart on the context and the device buffers of one of the
+/// concurrent restarts. The statistics of the result are downloaded to
+/// host_stats if it is not nullptr.
+template <typename F, typename L>
+static int kmeans_cuda_restart(
+    const KMCUDAOptions &options, const KMCUDAWorkspace &ws,
+    const KMCUDAContext &ctx, const F *device_samples, uint32_t restart,
+    uint32_t n_init, std::chrono::steady_clock::time_point start,
+    KMCUDAProgressCallback progress, void *progress_arg,
+    KMCUDAProfiler *profiler, KMCUDAReorder *reorder, KMCUDAConvergence *conv,
+    uint8_t *host_stats) {
+  const int32_t verbosity = options.verbosity;
+  if (n_init > 1) {
+    INFO("restart %" PRIu32 " / %" PRIu32 "\n", restart + 1, n_init);
+  }
+#ifdef PROFILE
+  profiler->set_restart(restart);
+  profiler->set_iteration(0);
+#endif
+  if (options.init_centroids != nullptr) {
+    CUMEMCPY(ws.centroids, options.init_centroids,
+             static_cast<size_t>(ctx.clusters_size) * ctx.features_size * sizeof(F),
+             cudaMemcpyHostToDevice, ctx.stream);
+  } else {
+    PROFILE_SCOPE(profiler, kmcudaPhaseInit);
+    RETERR(kmeans_init_centroids(
+        &ctx, static_cast<KMCUDAInitMethod>(options.kmpp),
+        options.seed + restart, verbosity, device_samples, ws.reassignments,
+        reinterpret_cast<F*>(ws.centroids), profiler),
+           DEBUG("kmeans_init_centroids failed: %s\n",
+                 cudaGetErrorString(cudaGetLastError())));
+  }
+  *conv = {};
+  conv->tolerance = options.tolerance;
+  conv->max_iterations = options.max_iterations;
+  conv->shift_tolerance = options.shift_tolerance;
+  conv->progress = progress;
+  conv->progress_arg = progress_arg;
+  conv->start = start;
+  conv->restart = restart;
+  conv->neighbors = options.neighbors;
+  conv->approximate_neighbors = options.approximate_neighbors;
+  conv->profiler = profiler;
+  conv->sort_storage = &ws.sort_storage;
+  if (reorder->interval > 0) {
+    // every restart starts from the original order
+    reorder->active = false;
+    conv->reorder = reorder;
+  }
+  conv->deadline = std::chrono::steady_clock::time_point::max();
+  if (options.time_budget > 0) {
+    conv->deadline = start + std::chrono::duration_cast<
+        std::chrono::steady_clock::duration>(
+            std::chrono::duration<float>(options.time_budget));
+  }
+  void *device_stats = host_stats != nullptr? ws.stats : NULL;
+  RETERR(kmeans_cuda_yy(
+      ctx, conv, verbosity,
+      device_samples,
+      reinterpret_cast<F*>(ws.centroids),
+      reinterpret_cast<KMCUDASampleIndex*>(ws.ccounts),
+      reinterpret_cast<uint64_t*>(ws.reassignments),
+      reinterpret_cast<L*>(ws.assignments),
+      reinterpret_cast<L*>(ws.assignments_yy),
+      reinterpret_cast<F*>(ws.centroids_yy),
+      reinterpret_cast<F*>(ws.bounds_yy),
+      reinterpret_cast<F*>(ws.drifts_yy),
+      reinterpret_cast<KMCUDASampleIndex*>(ws.passed_yy),
+      reinterpret_cast<uint32_t*>(ws.graph),
+      reinterpret_cast<uint32_t*>(device_stats)),
+         DEBUG("kmeans_cuda_internal failed: %s\n",
+               cudaGetErrorString(cudaGetLastError())));
+  if (host_stats != nullptr) {
+    CUMEMCPY(host_stats, device_stats,
+             stats_size(ctx.clusters_size, ctx.samples_size),
+             cudaMemcpyDeviceToHost, ctx.stream);
+  }
+  return kmcudaSuccess;
+}
+
+/// Copies the centroids and the assignments of the finished restart to the
+/// host output buffers.
+template <typename F, typename L>
+static int copy_restart(
+    const KMCUDAWorkspace &ws, const KMCUDAContext &ctx,
+    const KMCUDAReorder &reorder, F *centroids, uint32_t *assignments) {
+  CUMEMCPY(centroids, ws.centroids,
+           static_cast<size_t>(ctx.clusters_size) * ctx.features_size * sizeof(F),
+           cudaMemcpyDeviceToHost, ctx.stream);
+  const L *device_assignments = reinterpret_cast<const L*>(ws.assignments);
+  if (reorder.active) {
+    // the log is not needed anymore
+    L *restored = reinterpret_cast<L*>(ws.reassignments);
+    RETERR(kmeans_cuda_restore_order(ctx, reorder, device_assignments,
+                                     restored));
+    device_assignments = restored;
+  }
+  return copy_assignments(ctx.samples_size, device_assignments, assignments,
+                          ctx.stream);
+}
+
+/// Runs the restarts on the samples which are already on the device and
+/// copies the best result to the host output buffers.
+/// Up to MAX_CONCURRENT_RESTARTS restarts run at the same time, each on its
+/// own OpenMP thread, stream, context and device buffers, while the samples
+/// are shared, so the kernels of one restart fill the device while another
+/// waits for its host round trips. The first restart uses ws,
+/// the rest allocate their buffers as long as there is enough device memory.
+/// The restarts run one by one if the caller is already in a parallel region
+/// or the library is built with PROFILE, so that the phase times do not
+/// overlap.
+template <typename F, typename L>
+static int kmeans_cuda_run(
+    const KMCUDAOptions &options, const KMCUDAWorkspace &ws,
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, const F *device_samples, F *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics) {
+  const int32_t verbosity = options.verbosity;
+  uint32_t yinyang_groups = options.yinyang_t * clusters_size;
+  DEBUG("yinyang groups: %" PRIu32 "\n", yinyang_groups);
+  auto start = std::chrono::steady_clock::now();
+  // the restarts need the inertia
+  // the restarts from the same initial centroids would be identical
+  uint32_t n_init = options.init_centroids != nullptr?
+      1 : std::max(options.n_init, 1u);
+  bool with_stats = statistics != nullptr || n_init > 1;
+
+  uint32_t slots_size = 1;
+#ifndef PROFILE
+  if (!omp_in_parallel()) {
+    slots_size = std::min(
+        {n_init, static_cast<uint32_t>(omp_get_max_threads()),
+         static_cast<uint32_t>(MAX_CONCURRENT_RESTARTS)});
+  }
+#endif
+  // the first restart always has ws, so a failure only means fewer slots
+  std::vector<std::unique_ptr<KMCUDAWorkspace>> slot_spaces;
+  allocate_slots(slots_size - 1, [&](KMCUDAWorkspace *space) {
+    return space->allocate(
+        samples_size, features_size, clusters_size, sizeof(L), sizeof(F),
+        yinyang_groups, options.shift_tolerance > 0, options.neighbors,
+        with_stats, options.reorder_interval > 0, false, false, verbosity);
+  }, &slot_spaces);
+  slots_size = slot_spaces.size() + 1;
+  if (slots_size > 1) {
+    DEBUG("running up to %" PRIu32 " restarts concurrently\n", slots_size);
+  }
+  std::vector<const KMCUDAWorkspace*> spaces(1, &ws);
+  for (auto &space : slot_spaces) {
+    spaces.push_back(space.get());
+  }
+  std::vector<KMCUDAContext> contexts(slots_size);
+  std::vector<KMCUDAReorder> reorders(slots_size);
+  for (uint32_t s = 0; s < slots_size; s++) {
+    KMCUDAContext &ctx = contexts[s];
+    ctx.samples_size = samples_size;
+    ctx.features_size = features_size;
+    ctx.clusters_size = clusters_size;
+    ctx.yy_groups_size = yinyang_groups;
+    ctx.counters = reinterpret_cast<KMCUDACounters*>(spaces[s]->counters);
+    ctx.stream = spaces[s]->stream;
+    RETERR(kmeans_cuda_setup(&ctx, options.device, verbosity),
+           DEBUG("kmeans_cuda_setup failed: %s\n",
+                 cudaGetErrorString(cudaGetLastError())));
+    KMCUDAReorder &reorder = reorders[s];
+    reorder.interval = options.reorder_interval;
+    reorder.samples = spaces[s]->reordered_samples;
+    reorder.order = reinterpret_cast<KMCUDASampleIndex*>(spaces[s]->order);
+    reorder.perm = reinterpret_cast<KMCUDASampleIndex*>(spaces[s]->perm);
+    reorder.bounds = spaces[s]->reordered_bounds;
+  }
+  // the kernels stage at least one centroid and its norm in shared memory
+  if (contexts[0].shmem_size * sizeof(uint32_t) / sizeof(F) <
+      static_cast<uint64_t>(features_size) + 1) {
+    INFO("%" PRIuFEATURE " features do not fit into %d bytes of shared memory\n",
+         features_size,
+         contexts[0].shmem_size * static_cast<int>(sizeof(uint32_t)));
+    return kmcudaInvalidArguments;
+  }
+  KMCUDASerialProgress serial_progress = {options.progress, options.progress_arg};
+  KMCUDAProgressCallback progress = options.progress;
+  void *progress_arg = options.progress_arg;
+  if (slots_size > 1 && progress != nullptr) {
+    progress = KMCUDASerialProgress::call;
+    progress_arg = &serial_progress;
+  }
+  KMCUDAProfile profile = {};
+  KMCUDAProfiler *profiler = nullptr;
+#ifdef PROFILE
+  KMCUDAProfiler profiler_instance(&profile, ws.stream);
+  profiler = &profiler_instance;
+#endif
+  // the restarts are taken in order, the ties are resolved by the index, so
+  // the result does not depend on the schedule
+  int status = kmcudaSuccess;
+  bool interrupted = false;
+  uint32_t next_restart = 0, best_restart = UINT32_MAX, refreshes = 0;
+  double best_inertia = DBL_MAX;
+  #pragma omp parallel num_threads(slots_size)
+  {
+    const uint32_t slot = omp_get_thread_num();
+    std::unique_ptr<uint8_t[]> host_stats;
+    if (with_stats) {
+      host_stats.reset(new uint8_t[stats_size(clusters_size, samples_size)]);
+    }
+    // the current device is per host thread
+    int slot_status = kmcudaSuccess;
+    if (cudaSetDevice(options.device) != cudaSuccess) {
+      slot_status = kmcudaNoSuchDevice;
+    }
+    while (true) {
+      uint32_t restart;
+      #pragma omp critical(kmcuda_restarts)
+      {
+        if (slot_status != kmcudaSuccess) {
+          status = slot_status;
+        }
+        restart = (status == kmcudaSuccess && !interrupted)?
+            next_restart++ : n_init;
+      }
+      if (restart >= n_init) {
+        break;
+      }
+      KMCUDAConvergence conv;
+      slot_status = kmeans_cuda_restart<F, L>(
+          options, *spaces[slot], contexts[slot], device_samples, restart,
+          n_init, start, progress, progress_arg, profiler, &reorders[slot],
+          &conv, host_stats.get());
+      if (slot_status != kmcudaSuccess) {
+        continue;
+      }
+      KMCUDAStatistics stats = {};
+      if (with_stats) {
+        fill_statistics(clusters_size, samples_size, host_stats.get(), &stats);
+        INFO("inertia: %f\n", stats.inertia);
+      }
+      #pragma omp critical(kmcuda_restarts)
+      {
+        // the rest of the restarts do not fit into the time budget or cancelled
+        if (conv.stop_reason == kmcudaStopTimeBudget ||
+            conv.stop_reason == kmcudaStopCancelled) {
+          interrupted = true;
+        }
+        refreshes += conv.refreshes;
+        if (!with_stats || stats.inertia < best_inertia ||
+            (stats.inertia == best_inertia && restart < best_restart)) {
+          best_inertia = stats.inertia;
+          best_restart = restart;
+          if (statistics != nullptr) {
+            fill_statistics(clusters_size, samples_size, host_stats.get(),
+                            statistics);
+            statistics->iterations = conv.iterations;
+            statistics->stop_reason = conv.stop_reason;
+          }
+          // the host output buffers keep the best result so far
+          slot_status = copy_restart<F, L>(
+              *spaces[slot], contexts[slot], reorders[slot], centroids,
+              assignments);
+        }
+      }
+    }
+  }
+  RETERR(static_cast<KMCUDAResult>(status));
+#ifdef PROFILE
+  RETERR(profiler->finish(), DEBUG("failed to resolve the profiled phases\n"));
+  RETERR(kmeans_cuda_distance_evaluations(&contexts[0],
+                                          &profile.distance_evaluations));
+  if (options.trace != nullptr) {
+    RETERR(write_trace(options.trace, options.device, *profiler, verbosity));
+  }
+#else
+  if (options.trace != nullptr) {
+    INFO("the trace is not written: the library was built without PROFILE\n");
+  }
+#endif
+  if (statistics != nullptr) {
+    // summed over all the restarts
+    profile.refreshes = refreshes;
+    statistics->profile = profile;
+  }
+  DEBUG("return kmcudaSuccess\n");
+  return kmcudaSuccess;
+}
+
+/// Copies the samples to the dense row major device buffer dest. The sample
+/// #i, feature #f is samples[i * row_stride + f * column_stride]. The padded
+/// rows go in a single 2D copy. The column major samples are copied tile by
+/// tile and transposed on the device, the other layouts are gathered on the
+/// host tile by tile, so the extra memory never exceeds a tile. If source is
+/// not nullptr, it fills the host tiles instead and samples is ignored.
+template <typename F>
+static KMCUDAResult upload_samples(
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    const F *samples, uint64_t row_stride, uint64_t column_stride,
+    const KMCUDASamplesSource *source, F *dest, cudaStream_t stream,
+    int32_t verbosity) {
+  size_t row_size = features_size * sizeof(F);
+  if (source == nullptr && column_stride == 1) {
+    if (cudaMemcpy2DAsync(dest, row_size, samples, row_stride * sizeof(F),
+                          row_size, samples_size, cudaMemcpyHostToDevice,
+                          stream) != cudaSuccess ||
+        cudaStreamSynchronize(stream) != cudaSuccess) {
+      return kmcudaMemoryCopyError;
+    }
+    return kmcudaSuccess;
+  }
+  KMCUDASampleIndex tile_rows = std::min<KMCUDASampleIndex>(
+      std::max<size_t>(UPLOAD_TILE_SIZE / row_size, PACK_TILE_ROWS),
+      samples_size);
+  if (source == nullptr && row_stride == 1) {
+    DEBUG("packing the column major samples by %" PRIuSAMPLE " rows\n",
+          tile_rows);
+    void *columns = nullptr;
+    CUMALLOC(columns, tile_rows * row_size, "packing tile");
+    unique_devptr columns_sentinel(columns);
+    for (KMCUDASampleIndex begin = 0; begin < samples_size; begin += tile_rows) {
+      uint32_t rows = std::min(tile_rows, samples_size - begin);
+      if (cudaMemcpy2DAsync(columns, rows * sizeof(F), samples + begin,
+                            column_stride * sizeof(F), rows * sizeof(F),
+                            features_size, cudaMemcpyHostToDevice,
+                            stream) != cudaSuccess) {
+        return kmcudaMemoryCopyError;
+      }
+      RETERR(kmeans_cuda_pack_columns(
+          stream, reinterpret_cast<const F*>(columns), rows, features_size,
+          dest + static_cast<uint64_t>(begin) * features_size));
+    }
+    if (cudaStreamSynchronize(stream) != cudaSuccess) {
+      return kmcudaRuntimeError;
+    }
+    return kmcudaSuccess;
+  }
+  DEBUG("%s the samples by %" PRIuSAMPLE " rows\n",
+        source != nullptr? "filling" : "gathering the strided", tile_rows);
+  std::unique_ptr<F[]> tile(new F[tile_rows * features_size]);
+  for (KMCUDASampleIndex begin = 0; begin < samples_size; begin += tile_rows) {
+    KMCUDASampleIndex rows = std::min(tile_rows, samples_size - begin);
+    if (source != nullptr) {
+      source->fill(source->arg, begin, rows, tile.get());
+      CUMEMCPY(dest + static_cast<uint64_t>(begin) * features_size, tile.get(),
+               rows * row_size, cudaMemcpyHostToDevice, stream);
+      continue;
+    }
+    #pragma omp parallel for schedule(static)
+    for (KMCUDASampleIndex i = 0; i < rows; i++) {
+      const F *row = samples + (begin + i) * row_stride;
+      F *tile_row = tile.get() + i * features_size;
+      for (KMCUDAFeatureIndex f = 0; f < features_size; f++) {
+        tile_row[f] = row[f * column_stride];
+      }
+    }
+    CUMEMCPY(dest + static_cast<uint64_t>(begin) * features_size, tile.get(), rows * row_size,
+             cudaMemcpyHostToDevice, stream);
+  }
+  return kmcudaSuccess;
+}
+
+/// Uploads the samples to the workspace and runs kmeans_cuda_run().
+/// row_stride, column_stride and source are described in upload_samples().
+template <typename F, typename L>
+static int kmeans_cuda_fit(
+    const KMCUDAOptions &options, const KMCUDAWorkspace &ws,
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, const F *samples, uint64_t row_stride,
+    uint64_t column_stride, const KMCUDASamplesSource *source, F *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics) {
+  const int32_t verbosity = options.verbosity;
+  RETERR(upload_samples(
+      samples_size, features_size, samples, row_stride, column_stride, source,
+      reinterpret_cast<F*>(ws.samples), ws.stream, verbosity));
+  return kmeans_cuda_run<F, L>(
+      options, ws, samples_size, features_size, clusters_size,
+      reinterpret_cast<const F*>(ws.samples), centroids, assignments,
+      statistics);
+}
+
+template <typename F, typename L>
+static int kmeans_cuda_internal(
+    const KMCUDAOptions &options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size, const F *samples,
+    uint64_t row_stride, uint64_t column_stride, const KMCUDASamplesSource *source,
+    F *centroids, uint32_t *assignments, KMCUDAStatistics *statistics) {
+  const int32_t verbosity = options.verbosity;
+  KMCUDAWorkspace ws;
+  RETERR(ws.allocate(
+      samples_size, features_size, clusters_size, sizeof(L), sizeof(F),
+      options.yinyang_t * clusters_size, options.shift_tolerance > 0,
+      options.neighbors, statistics != nullptr || options.n_init > 1,
+      options.reorder_interval > 0, true, false, verbosity));
+  if (verbosity > 1) {
+    RETERR(print_memory_stats());
+  }
+  return kmeans_cuda_fit<F, L>(
+      options, ws, samples_size, features_size, clusters_size, samples,
+      row_stride, column_stride, source, centroids, assignments, statistics);
+}
+
+/// Grows the workspace of the session if needed and fits the samples in it.
+template <typename L>
+static int kmeans_cuda_session_fit_internal(
+    KMCUDASession *session, KMCUDASampleIndex samples_size,
+    const float *samples, const KMCUDASamplesSource *source, float *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics) {
+  const KMCUDAOptions &options = session->options;
+  const int32_t verbosity = options.verbosity;
+  if (session->ws == nullptr || samples_size > session->capacity) {
+    DEBUG("growing the session workspace to %" PRIuSAMPLE " samples\n",
+          samples_size);
+    // free the old buffers first
+    session->ws.reset();
+    std::unique_ptr<KMCUDAWorkspace> ws(new KMCUDAWorkspace);
+    // the statistics may be requested by any fit
+    RETERR(ws->allocate(
+        samples_size, session->features_size, session->clusters_size,
+        sizeof(L), sizeof(float), options.yinyang_t * session->clusters_size,
+        options.shift_tolerance > 0, options.neighbors, true,
+        options.reorder_interval > 0, true, true, verbosity));
+    session->ws = std::move(ws);
+    session->capacity = samples_size;
+  }
+  return kmeans_cuda_fit<float, L>(
+      options, *session->ws, samples_size, session->features_size,
+      session->clusters_size, samples, session->features_size, 1, source,
+      centroids, assignments, statistics);
+}
+
+/// KMCUDASamplesSource::arg which gathers the rows samples[order[i]] into the
+/// upload tiles.
+struct KMCUDAGatherSource {
+  const float *samples;
+  const KMCUDASampleIndex *order;
+  KMCUDAFeatureIndex features_size;
+
+  static void fill(void *arg, KMCUDASampleIndex begin, KMCUDASampleIndex size,
+                   void *dest) {
+    auto self = reinterpret_cast<const KMCUDAGatherSource*>(arg);
+    const size_t row_size = self->features_size * sizeof(float);
+    for (KMCUDASampleIndex i = 0; i < size; i++) {
+      memcpy(reinterpret_cast<char*>(dest) + i * row_size,
+             self->samples +
+                 static_cast<size_t>(self->order[begin + i]) * self->features_size,
+             row_size);
+    }
+  }
+};
+
+/// Each OpenMP thread owns a workspace sized for the largest dataset and its
+/// own stream, the datasets are dynamically scheduled over the threads.
+/// If order is not nullptr, dataset #i consists of the samples
+/// samples[order[samples_offsets[i]]] ... which are gathered straight into the
+/// upload tiles, otherwise of the contiguous rows.
+template <typename L>
+static int kmeans_cuda_batch_internal(
+    const KMCUDAOptions &options, uint32_t batch_size,
+    KMCUDAFeatureIndex features_size, KMCUDASampleIndex max_samples,
+    uint32_t max_clusters, const KMCUDASampleIndex *samples_offsets,
+    const uint32_t *clusters_offsets, const float *samples,
+    const KMCUDASampleIndex *order, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics, int *results) {
+  const int32_t verbosity = options.verbosity;
+  std::vector<std::unique_ptr<KMCUDAWorkspace>> slots;
+  auto alloc_result = allocate_slots(
+      std::min({batch_size, static_cast<uint32_t>(omp_get_max_threads()),
+                static_cast<uint32_t>(MAX_CONCURRENT_FITS)}),
+      [&](KMCUDAWorkspace *ws) {
+        return ws->allocate(
+            max_samples, features_size, max_clusters, sizeof(L), sizeof(float),
+            options.yinyang_t * max_clusters, options.shift_tolerance > 0,
+            options.neighbors, statistics != nullptr || options.n_init > 1,
+            options.reorder_interval > 0, true, true, verbosity);
+      }, &slots);
+  if (alloc_result != kmcudaSuccess) {
+    if (results != nullptr) {
+      std::fill(results, results + batch_size, alloc_result);
+    }
+    return alloc_result;
+  }
+  DEBUG("clustering %" PRIu32 " datasets in %zu slots\n", batch_size,
+        slots.size());
+  int status = kmcudaSuccess;
+  uint32_t next = 0;
+  #pragma omp parallel num_threads(slots.size())
+  {
+    const KMCUDAWorkspace &ws = *slots[omp_get_thread_num()];
+    // the current device is per host thread, the slot which fails to set it
+    // takes no datasets
+    bool ready = cudaSetDevice(options.device) == cudaSuccess;
+    while (ready) {
+      uint32_t i;
+      #pragma omp atomic capture
+      i = next++;
+      if (i >= batch_size) {
+        break;
+      }
+      KMCUDASampleIndex samples_size = samples_offsets[i + 1] - samples_offsets[i];
+      uint32_t clusters_size = clusters_offsets[i + 1] - clusters_offsets[i];
+      const float *my_samples = order != nullptr? nullptr :
+          samples + static_cast<uint64_t>(samples_offsets[i]) * features_size;
+      KMCUDAGatherSource gather = {samples, order + samples_offsets[i],
+                                   features_size};
+      KMCUDASamplesSource source = {KMCUDAGatherSource::fill, &gather};
+      float *my_centroids =
+          centroids + static_cast<uint64_t>(clusters_offsets[i]) * features_size;
+      uint32_t *my_assignments = assignments + samples_offsets[i];
+      int result = check_args(
+          options.tolerance, options.yinyang_t, samples_size, features_size,
+          clusters_size, samples, my_centroids, my_assignments);
+      if (result == kmcudaSuccess) {
+        result = kmeans_cuda_fit<float, L>(
+            options, ws, samples_size, features_size, clusters_size,
+            my_samples, features_size, 1, order != nullptr? &source : nullptr,
+            my_centroids, my_assignments,
+            statistics != nullptr? statistics + i : nullptr);
+      }
+      if (results != nullptr) {
+        results[i] = result;
+      }
+      if (result != kmcudaSuccess) {
+        #pragma omp critical
+        status = result;
+      }
+    }
+  }
+  return status;
+}
+
+/// Splits clusters_size fine clusters among the partitions proportionally to
+/// their sizes. Every non-empty partition gets at least one and at most as
+/// many clusters as it has samples. clusters_size may not be less than the
+/// number of non-empty partitions.
+static void distribute_clusters(
+    const std::vector<KMCUDASampleIndex> &sizes, KMCUDASampleIndex samples_size,
+    uint32_t clusters_size, std::vector<uint32_t> *clusters) {
+  size_t parts = sizes.size();
+  std::vector<double> quotas(parts);
+  clusters->assign(parts, 0);
+  uint32_t sum = 0;
+  for (size_t p = 0; p < parts; p++) {
+    if (sizes[p] == 0) {
+      continue;
+    }
+    quotas[p] = static_cast<double>(clusters_size) * sizes[p] / samples_size;
+    uint32_t k = std::max(static_cast<uint32_t>(quotas[p]), 1u);
+    (*clusters)[p] = static_cast<uint32_t>(
+        std::min<KMCUDASampleIndex>(k, sizes[p]));
+    sum += (*clusters)[p];
+  }
+  // largest remainder first, samples_size >= clusters_size guarantees the end
+  while (sum != clusters_size) {
+    size_t best = parts;
+    double best_diff = 0;
+    for (size_t p = 0; p < parts; p++) {
+      uint32_t k = (*clusters)[p];
+      double diff = quotas[p] - k;
+      if (sum < clusters_size? k < sizes[p] && (best == parts || diff > best_diff)
+                             : k > 1 && (best == parts || diff < best_diff)) {
+        best = p;
+        best_diff = diff;
+      }
+    }
+    assert(best < parts);
+    if (sum < clusters_size) {
+      (*clusters)[best]++;
+      sum++;
+    } else {
+      (*clusters)[best]--;
+      sum--;
+    }
+  }
+}
+
+/// Each OpenMP thread owns a workspace for a single subspace. The subspace
+/// columns are uploaded straight from the rows of samples by a strided 2D copy,
+/// so the host never makes a sliced copy of the samples.
+static int kmeans_train_pq_internal(
+    const KMCUDAOptions &options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t subspaces_size,
+    uint32_t clusters_size, const float *samples, float *codebooks,
+    uint8_t *codes, KMCUDAStatistics *statistics, int *results) {
+  const int32_t verbosity = options.verbosity;
+  const KMCUDAFeatureIndex subspace_size = features_size / subspaces_size;
+  std::vector<std::unique_ptr<KMCUDAWorkspace>> slots;
+  auto alloc_result = allocate_slots(
+      std::min({subspaces_size, static_cast<uint32_t>(omp_get_max_threads()),
+                static_cast<uint32_t>(MAX_CONCURRENT_FITS)}),
+      [&](KMCUDAWorkspace *ws) {
+        return ws->allocate(
+            samples_size, subspace_size, clusters_size, sizeof(uint16_t),
+            sizeof(float), options.yinyang_t * clusters_size,
+            options.shift_tolerance > 0, options.neighbors,
+            statistics != nullptr || options.n_init > 1,
+            options.reorder_interval > 0, true, false, verbosity);
+      }, &slots);
+  if (alloc_result != kmcudaSuccess) {
+    if (results != nullptr) {
+      std::fill(results, results + subspaces_size, alloc_result);
+    }
+    return alloc_result;
+  }
+  DEBUG("training %" PRIu32 " subspaces in %zu slots\n", subspaces_size,
+        slots.size());
+  int status = kmcudaSuccess;
+  uint32_t next = 0;
+  #pragma omp parallel num_threads(slots.size())
+  {
+    const KMCUDAWorkspace &ws = *slots[omp_get_thread_num()];
+    std::unique_ptr<uint32_t[]> labels(new uint32_t[samples_size]);
+    // the current device is per host thread, the slot which fails to set it
+    // takes no subspaces
+    bool ready = cudaSetDevice(options.device) == cudaSuccess;
+    while (ready) {
+      uint32_t m;
+      #pragma omp atomic capture
+      m = next++;
+      if (m >= subspaces_size) {
+        break;
+      }
+      int result = kmcudaSuccess;
+      if (cudaMemcpy2DAsync(
+          ws.samples, subspace_size * sizeof(float),
+          samples + static_cast<size_t>(m) * subspace_size,
+          features_size * sizeof(float), subspace_size * sizeof(float),
+          samples_size, cudaMemcpyHostToDevice, ws.stream) != cudaSuccess) {
+        result = kmcudaMemoryCopyError;
+      }
+      if (result == kmcudaSuccess) {
+        result = kmeans_cuda_run<float, uint16_t>(
+            options, ws, samples_size, subspace_size, clusters_size,
+            reinterpret_cast<const float*>(ws.samples),
+            codebooks + static_cast<size_t>(m) * clusters_size * subspace_size,
+            labels.get(), statistics != nullptr? statistics + m : nullptr);
+      }
+      for (KMCUDASampleIndex i = 0; result == kmcudaSuccess && i < samples_size;
+           i++) {
+        // NaN subvectors have no valid code
+        if (labels[i] >= clusters_size) {
+          INFO("subspace %" PRIu32 ": sample %" PRIuSAMPLE " has NaN features\n",
+               m, i);
+          result = kmcudaInvalidArguments;
+          break;
+        }
+        codes[static_cast<size_t>(i) * subspaces_size + m] =
+            static_cast<uint8_t>(labels[i]);
+      }
+      if (results != nullptr) {
+        results[m] = result;
+      }
+      if (result != kmcudaSuccess) {
+        #pragma omp critical
+        status = result;
+      }
+    }
+  }
+  return status;
+}
+
+/// Validates the arguments of kmeans_cuda_ex(), kmeans_cuda_ex_f64(),
+/// kmeans_cuda_strided() and kmeans_cuda_source() and picks the label type.
+/// Either samples or source is nullptr.
+template <typename F>
+static int kmeans_cuda_ex_internal(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size, const F *samples,
+    uint64_t row_stride, uint64_t column_stride,
+    const KMCUDASamplesSource *source, F *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics) {
+  if (options == nullptr || row_stride == 0 || column_stride == 0) {
+    return kmcudaInvalidArguments;
+  }
+  if (source != nullptr && source->fill == nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  // the initial centroids are float
+  if (!std::is_same<F, float>::value && options->init_centroids != nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  int32_t verbosity = options->verbosity;
+  DEBUG("arguments: %d %.3f %.2f %" PRIuSAMPLE " %" PRIuFEATURE " %" PRIu32 " %" PRIu32
+        " %" PRIu32 " %" PRIi32 " %" PRIu32 " %" PRIu32 " %f %.1f %p %p %p\n",
+        options->kmpp, options->tolerance, options->yinyang_t, samples_size,
+        features_size, clusters_size, options->seed, options->device, verbosity,
+        options->n_init, options->max_iterations, options->shift_tolerance,
+        options->time_budget, samples, centroids, assignments);
   auto check_result = check_args(
-      tolerance, yinyang_t, samples_size, features_size, clusters_size,
-      samples, centroids, assignments);
+      options->tolerance, options->yinyang_t, samples_size, features_size,
+      clusters_size,
+      source != nullptr? static_cast<const void*>(source) : samples, centroids,
+      assignments);
   if (check_result != kmcudaSuccess) {
     return check_result;
   }
-  if (cudaSetDevice(device) != cudaSuccess) {
+  if (options->shift_tolerance < 0 || options->time_budget < 0 ||
+      options->neighbors > KMCUDA_MAX_NEIGHBORS) {
+    return kmcudaInvalidArguments;
+  }
+  if (cudaSetDevice(options->device) != cudaSuccess) {
     return kmcudaNoSuchDevice;
   }
 
-  void *device_samples;
-  size_t device_samples_size = samples_size;
-  device_samples_size *= features_size * sizeof(float);
-  CUMALLOC(device_samples, device_samples_size, "samples");
-  CUMEMCPY(device_samples, samples, device_samples_size, cudaMemcpyHostToDevice);
-  unique_devptr device_samples_sentinel(device_samples);
+  if (clusters_size < UINT16_MAX) {
+    return kmeans_cuda_internal<F, uint16_t>(
+        *options, samples_size, features_size, clusters_size, samples,
+        row_stride, column_stride, source, centroids, assignments, statistics);
+  }
+  return kmeans_cuda_internal<F, uint32_t>(
+      *options, samples_size, features_size, clusters_size, samples,
+      row_stride, column_stride, source, centroids, assignments, statistics);
+}
+
+/// Validates the arguments of kmeans_cuda_batch() and picks the label type.
+/// order is described in kmeans_cuda_batch_internal().
+static int kmeans_cuda_batch_ex(
+    const KMCUDAOptions *options, uint32_t batch_size,
+    KMCUDAFeatureIndex features_size, const KMCUDASampleIndex *samples_offsets,
+    const uint32_t *clusters_offsets, const float *samples,
+    const KMCUDASampleIndex *order, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics, int *results) {
+  if (options == nullptr || samples_offsets == nullptr ||
+      clusters_offsets == nullptr || features_size == 0) {
+    return kmcudaInvalidArguments;
+  }
+  int32_t verbosity = options->verbosity;
+  DEBUG("batch arguments: %" PRIu32 " %" PRIuFEATURE " %p %p %p\n", batch_size,
+        features_size, samples, centroids, assignments);
+  if (options->shift_tolerance < 0 || options->time_budget < 0 ||
+      options->neighbors > KMCUDA_MAX_NEIGHBORS || options->trace != nullptr ||
+      options->init_centroids != nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  KMCUDASampleIndex max_samples = 0;
+  uint32_t max_clusters = 0;
+  for (uint32_t i = 0; i < batch_size; i++) {
+    if (samples_offsets[i + 1] < samples_offsets[i] ||
+        clusters_offsets[i + 1] < clusters_offsets[i]) {
+      return kmcudaInvalidArguments;
+    }
+    max_samples = std::max(
+        max_samples, samples_offsets[i + 1] - samples_offsets[i]);
+    max_clusters = std::max(
+        max_clusters, clusters_offsets[i + 1] - clusters_offsets[i]);
+  }
+  if (batch_size == 0) {
+    return kmcudaSuccess;
+  }
+  if (cudaSetDevice(options->device) != cudaSuccess) {
+    return kmcudaNoSuchDevice;
+  }
+  if (max_clusters < UINT16_MAX) {
+    return kmeans_cuda_batch_internal<uint16_t>(
+        *options, batch_size, features_size, max_samples, max_clusters,
+        samples_offsets, clusters_offsets, samples, order, centroids,
+        assignments, statistics, results);
+  }
+  return kmeans_cuda_batch_internal<uint32_t>(
+      *options, batch_size, features_size, max_samples, max_clusters,
+      samples_offsets, clusters_offsets, samples, order, centroids,
+      assignments, statistics, results);
+}
 
-  void *device_centroids;
-  size_t centroids_size = clusters_size * features_size * sizeof(float);
-  CUMALLOC(device_centroids, centroids_size, "centroids");
-  unique_devptr device_centroids_sentinel(device_centroids);
+/// The coarse level of kmeans_cuda_hierarchical(). The workspace with the
+/// uploaded samples is returned in ws to average the trivial partitions.
+template <typename L>
+static int kmeans_cuda_hierarchical_coarse(
+    const KMCUDAOptions &options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t coarse_size,
+    const float *samples, float *coarse_centroids, uint32_t *assignments,
+    std::unique_ptr<KMCUDAWorkspace> *ws) {
+  const int32_t verbosity = options.verbosity;
+  ws->reset(new KMCUDAWorkspace);
+  RETERR((*ws)->allocate(
+      samples_size, features_size, coarse_size, sizeof(L), sizeof(float),
+      options.yinyang_t * coarse_size, options.shift_tolerance > 0,
+      options.neighbors, options.n_init > 1, options.reorder_interval > 0,
+      true, false, verbosity));
+  return kmeans_cuda_fit<float, L>(
+      options, **ws, samples_size, features_size, coarse_size, samples,
+      features_size, 1, nullptr, coarse_centroids, assignments, nullptr);
+}
 
-  void *device_assignments;
-  size_t assignments_size = samples_size * sizeof(uint32_t);
-  CUMALLOC(device_assignments, assignments_size, "assignments");
-  unique_devptr device_assignments_sentinel(device_assignments);
+/// The NUMA node of the CPU which runs the calling thread, 0 if unknown.
+static uint32_t current_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return node;
+  }
+#endif
+  return 0;
+}
 
-  void *device_assignments_prev;
-  CUMALLOC(device_assignments_prev, assignments_size, "assignments_prev");
-  unique_devptr device_assignments_prev_sentinel(device_assignments_prev);
+/// The per-node sums of kmeans_host_accumulate(), see
+/// kmeans_host_accumulator_create().
+struct KMCUDAHostAccumulator {
+  KMCUDAFeatureIndex features_size;
+  uint32_t clusters_size;
+  /// clusters_size x features_size sums, then clusters_size counts, indexed
+  /// by the NUMA node; nullptr for the nodes which had no threads.
+  std::vector<std::unique_ptr<double[]>> replicas;
 
-  void *device_ccounts;
-  CUMALLOC(device_ccounts, clusters_size * sizeof(uint32_t), "ccounts");
-  unique_devptr device_ccounts_sentinel(device_ccounts);
+  size_t replica_size() const {
+    return static_cast<size_t>(clusters_size) * (features_size + 1);
+  }
 
-  uint32_t yinyang_groups = yinyang_t * clusters_size;
-  DEBUG("yinyang groups: %" PRIu32 "\n", yinyang_groups);
-  void *device_assignments_yy = NULL, *device_bounds_yy = NULL,
-      *device_drifts_yy = NULL, *device_passed_yy = NULL,
-      *device_centroids_yy = NULL;
-  if (yinyang_groups >= 1) {
-    CUMALLOC(device_assignments_yy, clusters_size * sizeof(uint32_t),
-             "yinyang assignments");
-    size_t yyb_size = samples_size;
-    yyb_size *= (yinyang_groups + 1) * sizeof(float);
-    CUMALLOC(device_bounds_yy, yyb_size, "yinyang bounds");
-    CUMALLOC(device_drifts_yy, centroids_size + clusters_size * sizeof(float),
-             "yinyang drifts");
-    CUMALLOC(device_passed_yy, assignments_size, "yinyang passed");
-    size_t yyc_size = yinyang_groups * features_size * sizeof(float);
-    if (yyc_size + (clusters_size + yinyang_groups) * sizeof(uint32_t)
-        <= assignments_size) {
-      device_centroids_yy = device_passed_yy;
+  /// The replica which the threads of node update. A thread which has moved
+  /// to a node without a replica takes the first one.
+  double *replica(uint32_t node) const {
+    if (node < replicas.size() && replicas[node]) {
+      return replicas[node].get();
+    }
+    for (auto &replica : replicas) {
+      if (replica) {
+        return replica.get();
+      }
+    }
+    return nullptr;
+  }
+};
+
+/// The nearest centroids of the samples on the host, see kmeans_host_predict().
+/// The threads are spread over the sockets and each scans the contiguous range
+/// of the samples given by schedule(static) over the rows, so the samples stay
+/// local if they were first touched with the same loop (the Python wrapper
+/// converts them this way). Every node reads its own replica of the centroids.
+/// The partial inertias of the threads are summed within each node first.
+/// If accumulator is not nullptr, the threads of each node then add the
+/// samples of the whole node to its replica of the sums, each thread its own
+/// range of the clusters, see kmeans_host_accumulate(). Nothing may throw
+/// inside the parallel region, the allocations there are checked instead.
+template <typename F>
+static int host_predict(
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, const F *samples, const F *centroids,
+    uint32_t *assignments, F *distances, double *inertia,
+    KMCUDAHostAccumulator *accumulator = nullptr) {
+  if (samples == nullptr || centroids == nullptr || features_size == 0 ||
+      clusters_size == 0 || clusters_size == UINT32_MAX ||
+      (accumulator != nullptr && assignments == nullptr)) {
+    return kmcudaInvalidArguments;
+  }
+  const size_t centroids_size = static_cast<size_t>(clusters_size) * features_size;
+  // the team is never larger
+  const int max_threads = omp_get_max_threads();
+  std::vector<uint32_t> thread_nodes(max_threads);
+  std::vector<double> thread_sums(max_threads);
+  // the contiguous range of the samples of each thread
+  std::vector<KMCUDASampleIndex> thread_begins(max_threads), thread_ends(max_threads);
+  std::vector<std::unique_ptr<F[]>> replicas;
+  bool failed = false;
+  #pragma omp parallel proc_bind(spread)
+  {
+    const int thread = omp_get_thread_num();
+    const int threads = omp_get_num_threads();
+    const uint32_t node = current_numa_node();
+    thread_nodes[thread] = node;
+    #pragma omp barrier
+    #pragma omp single
+    {
+      try {
+        replicas.resize(*std::max_element(
+            thread_nodes.begin(), thread_nodes.begin() + threads) + 1);
+      } catch (const std::bad_alloc &) {
+        failed = true;
+      }
+    }
+    const F *my_centroids = centroids;
+    if (!failed && replicas.size() > 1) {
+      // the first thread of the node touches the replica first
+      if (std::find(thread_nodes.begin(), thread_nodes.end(), node) ==
+          thread_nodes.begin() + thread) {
+        replicas[node].reset(new (std::nothrow) F[centroids_size]);
+        if (replicas[node]) {
+          std::copy(centroids, centroids + centroids_size, replicas[node].get());
+        } else {
+          #pragma omp atomic write
+          failed = true;
+        }
+      }
+      #pragma omp barrier
+      my_centroids = replicas[node].get();
+    }
+    #pragma omp barrier
+    double sum = 0;
+    KMCUDASampleIndex my_begin = 0, my_end = 0;
+    if (!failed) {
+      // the static schedule gives each thread at most one contiguous chunk
+      #pragma omp for schedule(static)
+      for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+        if (my_begin == my_end) {
+          my_begin = i;
+        }
+        my_end = i + 1;
+        const F *sample = samples + static_cast<size_t>(i) * features_size;
+        F *my_distances = distances != nullptr?
+            distances + static_cast<size_t>(i) * clusters_size : nullptr;
+        F min_dist = std::numeric_limits<F>::max();
+        uint32_t nearest = clusters_size;
+        for (uint32_t c = 0; c < clusters_size; c++) {
+          const F *centroid = my_centroids + static_cast<size_t>(c) * features_size;
+          F dist = 0;
+          // the vector width follows F: twice fewer lanes for double
+          #pragma omp simd reduction(+:dist)
+          for (KMCUDAFeatureIndex f = 0; f < features_size; f++) {
+            F d = sample[f] - centroid[f];
+            dist += d * d;
+          }
+          if (my_distances != nullptr) {
+            my_distances[c] = sqrt(dist);
+          }
+          if (dist < min_dist) {
+            min_dist = dist;
+            nearest = c;
+          }
+        }
+        if (assignments != nullptr) {
+          assignments[i] = nearest;
+        }
+        // insane (NaN) samples stay out
+        if (nearest < clusters_size) {
+          sum += min_dist;
+        }
+      }
+    }
+    thread_sums[thread] = sum;
+    thread_begins[thread] = my_begin;
+    thread_ends[thread] = my_end;
+    if (!failed && accumulator != nullptr) {
+      #pragma omp barrier
+      double *my_sums = accumulator->replica(node);
+      double *my_counts = my_sums + centroids_size;
+      // the threads which share the replica split the clusters in the order
+      // of their numbers, and each scans the samples of all of them
+      int peers = 0, rank = 0;
+      for (int t = 0; t < threads; t++) {
+        if (accumulator->replica(thread_nodes[t]) == my_sums) {
+          if (t < thread) {
+            rank++;
+          }
+          peers++;
+        }
+      }
+      const uint64_t step = clusters_size / peers + 1;
+      const uint64_t first = rank * step;
+      const uint64_t last = std::min<uint64_t>(first + step, clusters_size);
+      for (int t = 0; t < threads; t++) {
+        if (accumulator->replica(thread_nodes[t]) != my_sums) {
+          continue;
+        }
+        for (KMCUDASampleIndex i = thread_begins[t]; i < thread_ends[t]; i++) {
+          uint32_t c = assignments[i];
+          if (c < first || c >= last) {
+            continue;
+          }
+          const F *sample = samples + static_cast<size_t>(i) * features_size;
+          double *cluster_sum = my_sums + static_cast<size_t>(c) * features_size;
+          #pragma omp simd
+          for (KMCUDAFeatureIndex f = 0; f < features_size; f++) {
+            cluster_sum[f] += sample[f];
+          }
+          my_counts[c]++;
+        }
+      }
+    }
+  }
+  if (failed) {
+    return kmcudaMemoryAllocationFailure;
+  }
+  if (inertia != nullptr) {
+    std::vector<double> node_sums(replicas.size());
+    for (size_t t = 0; t < thread_sums.size(); t++) {
+      node_sums[thread_nodes[t]] += thread_sums[t];
+    }
+    double sum = 0;
+    for (double node_sum : node_sums) {
+      sum += node_sum;
+    }
+    *inertia = sum;
+  }
+  return kmcudaSuccess;
+}
+
+extern "C" {
+
+int kmeans_cuda_ex(const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+                   KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+                   const float *samples, float *centroids, uint32_t *assignments,
+                   KMCUDAStatistics *statistics) {
+  return kmeans_cuda_ex_internal(
+      options, samples_size, features_size, clusters_size, samples,
+      features_size, 1, nullptr, centroids, assignments, statistics);
+}
+
+int kmeans_cuda_ex_f64(const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+                       KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+                       const double *samples, double *centroids,
+                       uint32_t *assignments, KMCUDAStatistics *statistics) {
+  return kmeans_cuda_ex_internal(
+      options, samples_size, features_size, clusters_size, samples,
+      features_size, 1, nullptr, centroids, assignments, statistics);
+}
+
+int kmeans_cuda_strided(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const KMCUDASamplesView *samples, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics) {
+  if (samples == nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  return kmeans_cuda_ex_internal(
+      options, samples_size, features_size, clusters_size, samples->data,
+      samples->row_stride, samples->column_stride, nullptr, centroids,
+      assignments, statistics);
+}
+
+int kmeans_cuda_source(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const KMCUDASamplesSource *samples, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics) {
+  if (samples == nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  return kmeans_cuda_ex_internal<float>(
+      options, samples_size, features_size, clusters_size, nullptr,
+      features_size, 1, samples, centroids, assignments, statistics);
+}
+
+int kmeans_cuda_session_create(
+    const KMCUDAOptions *options, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, KMCUDASession **session) {
+  if (options == nullptr || session == nullptr || features_size == 0 ||
+      clusters_size < 2 || clusters_size == UINT32_MAX ||
+      options->trace != nullptr || options->shift_tolerance < 0 ||
+      options->time_budget < 0 || options->neighbors > KMCUDA_MAX_NEIGHBORS ||
+      options->tolerance < 0 || options->tolerance > 1 ||
+      options->yinyang_t < 0 || options->yinyang_t > 0.5) {
+    return kmcudaInvalidArguments;
+  }
+  *session = new KMCUDASession();
+  (*session)->options = *options;
+  (*session)->features_size = features_size;
+  (*session)->clusters_size = clusters_size;
+  return kmcudaSuccess;
+}
+
+int kmeans_cuda_session_fit(
+    KMCUDASession *session, KMCUDASampleIndex samples_size,
+    const float *samples, const KMCUDASamplesSource *source, float *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics) {
+  if (session == nullptr || (samples == nullptr) == (source == nullptr) ||
+      (source != nullptr && source->fill == nullptr)) {
+    return kmcudaInvalidArguments;
+  }
+  const KMCUDAOptions &options = session->options;
+  auto check_result = check_args(
+      options.tolerance, options.yinyang_t, samples_size,
+      session->features_size, session->clusters_size,
+      source != nullptr? static_cast<const void*>(source) : samples, centroids,
+      assignments);
+  if (check_result != kmcudaSuccess) {
+    return check_result;
+  }
+  // the current device is per host thread
+  if (cudaSetDevice(options.device) != cudaSuccess) {
+    return kmcudaNoSuchDevice;
+  }
+  if (session->clusters_size < UINT16_MAX) {
+    return kmeans_cuda_session_fit_internal<uint16_t>(
+        session, samples_size, samples, source, centroids, assignments,
+        statistics);
+  }
+  return kmeans_cuda_session_fit_internal<uint32_t>(
+      session, samples_size, samples, source, centroids, assignments,
+      statistics);
+}
+
+void kmeans_cuda_session_destroy(KMCUDASession *session) {
+  delete session;
+}
+
+int kmeans_cuda_source_f64(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const KMCUDASamplesSource *samples, double *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics) {
+  if (samples == nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  return kmeans_cuda_ex_internal<double>(
+      options, samples_size, features_size, clusters_size, nullptr,
+      features_size, 1, samples, centroids, assignments, statistics);
+}
+
+int kmeans_cuda_batch(
+    const KMCUDAOptions *options, uint32_t batch_size,
+    KMCUDAFeatureIndex features_size, const KMCUDASampleIndex *samples_offsets,
+    const uint32_t *clusters_offsets, const float *samples, float *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics, int *results) {
+  return kmeans_cuda_batch_ex(
+      options, batch_size, features_size, samples_offsets, clusters_offsets,
+      samples, nullptr, centroids, assignments, statistics, results);
+}
+
+int kmeans_cuda_hierarchical(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    uint32_t coarse_size, const float *samples, float *centroids,
+    uint32_t *assignments, float *coarse_centroids, uint32_t *parents) {
+  if (options == nullptr || coarse_size < 2 || coarse_size > clusters_size ||
+      options->init_centroids != nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  int32_t verbosity = options->verbosity;
+  auto check_result = check_args(
+      options->tolerance, options->yinyang_t, samples_size, features_size,
+      clusters_size, samples, centroids, assignments);
+  if (check_result != kmcudaSuccess) {
+    return check_result;
+  }
+  if (options->shift_tolerance < 0 || options->time_budget < 0 ||
+      options->neighbors > KMCUDA_MAX_NEIGHBORS) {
+    return kmcudaInvalidArguments;
+  }
+  if (cudaSetDevice(options->device) != cudaSuccess) {
+    return kmcudaNoSuchDevice;
+  }
+  // level 1: the coarse clusters, the labels are temporarily in assignments
+  INFO("hierarchical level 1: %" PRIu32 " coarse clusters\n", coarse_size);
+  std::unique_ptr<float[]> my_coarse_centroids;
+  if (coarse_centroids == nullptr) {
+    my_coarse_centroids.reset(
+        new float[static_cast<size_t>(coarse_size) * features_size]);
+    coarse_centroids = my_coarse_centroids.get();
+  }
+  // keeps the uploaded samples until the trivial partitions are averaged
+  std::unique_ptr<KMCUDAWorkspace> ws;
+  if (coarse_size < UINT16_MAX) {
+    RETERR(static_cast<KMCUDAResult>(kmeans_cuda_hierarchical_coarse<uint16_t>(
+        *options, samples_size, features_size, coarse_size, samples,
+        coarse_centroids, assignments, &ws)));
+  } else {
+    RETERR(static_cast<KMCUDAResult>(kmeans_cuda_hierarchical_coarse<uint32_t>(
+        *options, samples_size, features_size, coarse_size, samples,
+        coarse_centroids, assignments, &ws)));
+  }
+
+  // level 2: the partitions are packed one after another
+  std::vector<KMCUDASampleIndex> sizes(coarse_size + 1, 0);
+  for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+    // insane samples are assigned to coarse_size and stay out
+    sizes[std::min(assignments[i], coarse_size)]++;
+  }
+  KMCUDASampleIndex sane_size = samples_size - sizes[coarse_size];
+  sizes.pop_back();
+  if (sane_size < clusters_size) {
+    INFO("too few valid samples: %" PRIuSAMPLE "\n", sane_size);
+    return kmcudaInvalidArguments;
+  }
+  std::vector<uint32_t> fine;
+  distribute_clusters(sizes, sane_size, clusters_size, &fine);
+  std::vector<KMCUDASampleIndex> samples_offsets(coarse_size + 1, 0);
+  std::vector<uint32_t> clusters_offsets(coarse_size + 1, 0);
+  for (uint32_t p = 0; p < coarse_size; p++) {
+    samples_offsets[p + 1] = samples_offsets[p] + sizes[p];
+    clusters_offsets[p + 1] = clusters_offsets[p] + fine[p];
+  }
+  // stable counting sort of the samples by the coarse label
+  std::vector<KMCUDASampleIndex> order(sane_size);
+  {
+    std::vector<KMCUDASampleIndex> cursors(
+        samples_offsets.begin(), samples_offsets.end() - 1);
+    for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+      if (assignments[i] < coarse_size) {
+        order[cursors[assignments[i]]++] = i;
+      }
+    }
+  }
+  // the partitions with a single fine cluster do not need clustering,
+  // the rest are gathered by order straight into the device batch buffers
+  std::vector<KMCUDASampleIndex> batch_samples_offsets(1, 0);
+  std::vector<uint32_t> batch_clusters_offsets(1, 0);
+  std::vector<uint32_t> batch_parts;
+  std::vector<KMCUDASampleIndex> trivial_offsets(1, 0);
+  std::vector<uint32_t> trivial_parts;
+  for (uint32_t p = 0; p < coarse_size; p++) {
+    if (fine[p] == 1) {
+      trivial_parts.push_back(p);
+      trivial_offsets.push_back(trivial_offsets.back() + sizes[p]);
+    }
+    if (fine[p] < 2) {
+      continue;
+    }
+    batch_parts.push_back(p);
+    batch_samples_offsets.push_back(batch_samples_offsets.back() + sizes[p]);
+    batch_clusters_offsets.push_back(batch_clusters_offsets.back() + fine[p]);
+  }
+  if (!trivial_parts.empty()) {
+    DEBUG("averaging %zu trivial partitions\n", trivial_parts.size());
+    std::vector<KMCUDASampleIndex> trivial_order(trivial_offsets.back());
+    for (size_t t = 0; t < trivial_parts.size(); t++) {
+      uint32_t p = trivial_parts[t];
+      std::copy(order.begin() + samples_offsets[p],
+                order.begin() + samples_offsets[p + 1],
+                trivial_order.begin() + trivial_offsets[t]);
+    }
+    void *dev_order = nullptr, *dev_offsets = nullptr, *dev_means = nullptr;
+    CUMALLOC(dev_order, trivial_order.size() * sizeof(KMCUDASampleIndex),
+             "trivial order");
+    unique_devptr dev_order_sentinel(dev_order);
+    CUMALLOC(dev_offsets, trivial_offsets.size() * sizeof(KMCUDASampleIndex),
+             "trivial offsets");
+    unique_devptr dev_offsets_sentinel(dev_offsets);
+    size_t means_size = trivial_parts.size() * features_size;
+    CUMALLOC(dev_means, means_size * sizeof(float), "trivial means");
+    unique_devptr dev_means_sentinel(dev_means);
+    CUMEMCPY_ASYNC(dev_order, trivial_order.data(),
+                   trivial_order.size() * sizeof(KMCUDASampleIndex),
+                   cudaMemcpyHostToDevice, ws->stream);
+    CUMEMCPY_ASYNC(dev_offsets, trivial_offsets.data(),
+                   trivial_offsets.size() * sizeof(KMCUDASampleIndex),
+                   cudaMemcpyHostToDevice, ws->stream);
+    RETERR(kmeans_cuda_partition_means(
+        ws->stream, reinterpret_cast<const float*>(ws->samples), features_size,
+        trivial_parts.size(),
+        reinterpret_cast<const KMCUDASampleIndex*>(dev_order),
+        reinterpret_cast<const KMCUDASampleIndex*>(dev_offsets),
+        reinterpret_cast<float*>(dev_means)));
+    std::unique_ptr<float[]> means(new float[means_size]);
+    CUMEMCPY(means.get(), dev_means, means_size * sizeof(float),
+             cudaMemcpyDeviceToHost, ws->stream);
+    for (size_t t = 0; t < trivial_parts.size(); t++) {
+      uint32_t p = trivial_parts[t];
+      memcpy(centroids + static_cast<size_t>(clusters_offsets[p]) * features_size,
+             means.get() + t * features_size, features_size * sizeof(float));
+    }
+  }
+  ws.reset();
+  std::vector<KMCUDASampleIndex> batch_order(batch_samples_offsets.back());
+  for (size_t b = 0; b < batch_parts.size(); b++) {
+    uint32_t p = batch_parts[b];
+    std::copy(order.begin() + samples_offsets[p],
+              order.begin() + samples_offsets[p + 1],
+              batch_order.begin() + batch_samples_offsets[b]);
+  }
+  std::unique_ptr<float[]> batch_centroids(new float[
+      static_cast<size_t>(batch_clusters_offsets.back()) * features_size]);
+  std::unique_ptr<uint32_t[]> batch_assignments(
+      new uint32_t[batch_samples_offsets.back()]);
+  INFO("hierarchical level 2: %zu partitions\n", batch_parts.size());
+  KMCUDAOptions fine_options = *options;
+  fine_options.trace = nullptr;
+  RETERR(static_cast<KMCUDAResult>(kmeans_cuda_batch_ex(
+      &fine_options, batch_parts.size(), features_size,
+      batch_samples_offsets.data(), batch_clusters_offsets.data(), samples,
+      batch_order.data(), batch_centroids.get(), batch_assignments.get(),
+      nullptr, nullptr)));
+
+  // flatten the tree
+  for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+    if (assignments[i] >= coarse_size) {
+      assignments[i] = clusters_size;
+    }
+  }
+  size_t b = 0;
+  for (uint32_t p = 0; p < coarse_size; p++) {
+    float *my_centroids =
+        centroids + static_cast<size_t>(clusters_offsets[p]) * features_size;
+    if (parents != nullptr) {
+      std::fill(parents + clusters_offsets[p], parents + clusters_offsets[p + 1], p);
+    }
+    if (fine[p] == 0) {
+      continue;
+    }
+    if (fine[p] == 1) {
+      // the mean was calculated on the device
+      for (KMCUDASampleIndex i = samples_offsets[p]; i < samples_offsets[p + 1];
+           i++) {
+        assignments[order[i]] = clusters_offsets[p];
+      }
+      continue;
+    }
+    assert(batch_parts[b] == p);
+    memcpy(my_centroids,
+           batch_centroids.get() +
+               static_cast<size_t>(batch_clusters_offsets[b]) * features_size,
+           static_cast<size_t>(fine[p]) * features_size * sizeof(float));
+    const uint32_t *local = batch_assignments.get() + batch_samples_offsets[b];
+    for (KMCUDASampleIndex i = 0; i < sizes[p]; i++) {
+      assignments[order[samples_offsets[p] + i]] = clusters_offsets[p] + local[i];
+    }
+    b++;
+  }
+  return kmcudaSuccess;
+}
+
+int kmeans_train_pq(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t subspaces_size,
+    uint32_t clusters_size, const float *samples, float *codebooks,
+    uint8_t *codes, KMCUDAStatistics *statistics, int *results) {
+  if (options == nullptr || samples == nullptr || codebooks == nullptr ||
+      codes == nullptr || subspaces_size == 0 || features_size == 0 ||
+      features_size % subspaces_size != 0) {
+    return kmcudaInvalidArguments;
+  }
+  int32_t verbosity = options->verbosity;
+  DEBUG("pq arguments: %" PRIuSAMPLE " %" PRIuFEATURE " %" PRIu32 " %" PRIu32
+        " %p %p %p\n", samples_size, features_size, subspaces_size,
+        clusters_size, samples, codebooks, codes);
+  if (clusters_size < 2 || clusters_size > UINT8_MAX + 1 ||
+      samples_size < clusters_size) {
+    return kmcudaInvalidArguments;
+  }
+  if (options->tolerance < 0 || options->tolerance > 1 ||
+      options->yinyang_t < 0 || options->yinyang_t > 0.5 ||
+      options->shift_tolerance < 0 || options->time_budget < 0 ||
+      options->neighbors > KMCUDA_MAX_NEIGHBORS || options->trace != nullptr ||
+      options->init_centroids != nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  if (cudaSetDevice(options->device) != cudaSuccess) {
+    return kmcudaNoSuchDevice;
+  }
+  return kmeans_train_pq_internal(
+      *options, samples_size, features_size, subspaces_size, clusters_size,
+      samples, codebooks, codes, statistics, results);
+}
+
+int kmeans_host_predict(
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, const float *samples, const float *centroids,
+    uint32_t *assignments, float *distances, double *inertia) {
+  return host_predict(samples_size, features_size, clusters_size, samples,
+                      centroids, assignments, distances, inertia);
+}
+
+int kmeans_host_predict_f64(
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, const double *samples, const double *centroids,
+    uint32_t *assignments, double *distances, double *inertia) {
+  return host_predict(samples_size, features_size, clusters_size, samples,
+                      centroids, assignments, distances, inertia);
+}
+
+int kmeans_host_accumulator_create(
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    KMCUDAHostAccumulator **accumulator) {
+  if (accumulator == nullptr || features_size == 0 || clusters_size == 0 ||
+      clusters_size == UINT32_MAX) {
+    return kmcudaInvalidArguments;
+  }
+  std::unique_ptr<KMCUDAHostAccumulator> acc(
+      new (std::nothrow) KMCUDAHostAccumulator());
+  if (!acc) {
+    return kmcudaMemoryAllocationFailure;
+  }
+  acc->features_size = features_size;
+  acc->clusters_size = clusters_size;
+  const size_t size = acc->replica_size();
+  std::vector<uint32_t> thread_nodes(omp_get_max_threads());
+  int threads = 1;
+  #pragma omp parallel proc_bind(spread)
+  {
+    thread_nodes[omp_get_thread_num()] = current_numa_node();
+    #pragma omp single
+    threads = omp_get_num_threads();
+  }
+  try {
+    acc->replicas.resize(*std::max_element(
+        thread_nodes.begin(), thread_nodes.begin() + threads) + 1);
+  } catch (const std::bad_alloc &) {
+    return kmcudaMemoryAllocationFailure;
+  }
+  for (int t = 0; t < threads; t++) {
+    auto &replica = acc->replicas[thread_nodes[t]];
+    if (!replica) {
+      // not touched yet, see below
+      replica.reset(new (std::nothrow) double[size]);
+      if (!replica) {
+        return kmcudaMemoryAllocationFailure;
+      }
+    }
+  }
+  // the threads of each node zero their share of its replica first, so the
+  // pages stay on the node
+  #pragma omp parallel proc_bind(spread) num_threads(threads)
+  {
+    const int thread = omp_get_thread_num();
+    if (omp_get_num_threads() == threads) {
+      double *replica = acc->replica(thread_nodes[thread]);
+      int peers = 0, rank = 0;
+      for (int t = 0; t < threads; t++) {
+        if (acc->replica(thread_nodes[t]) == replica) {
+          if (t < thread) {
+            rank++;
+          }
+          peers++;
+        }
+      }
+      const size_t step = size / peers + 1;
+      const size_t first = std::min(rank * step, size);
+      std::fill(replica + first, replica + std::min(first + step, size), 0.);
     } else {
-      CUMALLOC(device_centroids_yy, yyc_size, "yinyang group centroids");
+      // the shares of a smaller team would not cover the replicas
+      #pragma omp single
+      for (auto &replica : acc->replicas) {
+        if (replica) {
+          std::fill(replica.get(), replica.get() + size, 0.);
+        }
+      }
     }
   }
-  unique_devptr device_centroids_yinyang_sentinel(
-      (device_centroids_yy != device_passed_yy)? device_centroids_yy : NULL);
-  unique_devptr device_assignments_yinyang_sentinel(device_assignments_yy);
-  unique_devptr device_bounds_yinyang_sentinel(device_bounds_yy);
-  unique_devptr device_drifts_yinyang_sentinel(device_drifts_yy);
-  unique_devptr device_passed_yinyang_sentinel(device_passed_yy);
+  *accumulator = acc.release();
+  return kmcudaSuccess;
+}
 
-  if (verbosity > 1) {
-    RETERR(print_memory_stats());
+int kmeans_host_accumulate(
+    KMCUDAHostAccumulator *accumulator, KMCUDASampleIndex samples_size,
+    const float *samples, const float *centroids, uint32_t *assignments) {
+  if (accumulator == nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  return host_predict(
+      samples_size, accumulator->features_size, accumulator->clusters_size,
+      samples, centroids, assignments, static_cast<float*>(nullptr), nullptr,
+      accumulator);
+}
+
+int kmeans_host_accumulator_reduce(
+    KMCUDAHostAccumulator *accumulator, double *sums, double *counts) {
+  if (accumulator == nullptr || sums == nullptr || counts == nullptr) {
+    return kmcudaInvalidArguments;
+  }
+  const size_t size = accumulator->replica_size();
+  const size_t sums_size = size - accumulator->clusters_size;
+  #pragma omp parallel for schedule(static)
+  for (size_t j = 0; j < size; j++) {
+    double total = 0;
+    for (auto &replica : accumulator->replicas) {
+      if (replica) {
+        total += replica[j];
+        replica[j] = 0;
+      }
+    }
+    if (j < sums_size) {
+      sums[j] = total;
+    } else {
+      counts[j - sums_size] = total;
+    }
   }
-  RETERR(kmeans_cuda_setup(samples_size, features_size, clusters_size,
-                           yinyang_groups, device, verbosity),
-         DEBUG("kmeans_cuda_setup failed: %s\n",
-               cudaGetErrorString(cudaGetLastError())));
-  RETERR(kmeans_init_centroids(
-      static_cast<KMCUDAInitMethod>(kmpp), samples_size, features_size,
-      clusters_size, seed, verbosity, reinterpret_cast<float*>(device_samples),
-      device_assignments, reinterpret_cast<float*>(device_centroids)),
-         DEBUG("kmeans_init_centroids failed: %s\n",
-               cudaGetErrorString(cudaGetLastError())));
-  RETERR(kmeans_cuda_yy(
-      tolerance, yinyang_groups, samples_size, clusters_size, features_size, verbosity,
-      reinterpret_cast<float*>(device_samples),
-      reinterpret_cast<float*>(device_centroids),
-      reinterpret_cast<uint32_t*>(device_ccounts),
-      reinterpret_cast<uint32_t*>(device_assignments_prev),
-      reinterpret_cast<uint32_t*>(device_assignments),
-      reinterpret_cast<uint32_t*>(device_assignments_yy),
-      reinterpret_cast<float*>(device_centroids_yy),
-      reinterpret_cast<float*>(device_bounds_yy),
-      reinterpret_cast<float*>(device_drifts_yy),
-      reinterpret_cast<uint32_t*>(device_passed_yy)),
-         DEBUG("kmeans_cuda_internal failed: %s\n",
-               cudaGetErrorString(cudaGetLastError())));
-  CUMEMCPY(centroids, device_centroids, centroids_size, cudaMemcpyDeviceToHost);
-  CUMEMCPY(assignments, device_assignments, assignments_size, cudaMemcpyDeviceToHost);
-  DEBUG("return kmcudaSuccess\n");
   return kmcudaSuccess;
 }
-}
\ No newline at end of file
+
+void kmeans_host_accumulator_destroy(KMCUDAHostAccumulator *accumulator) {
+  delete accumulator;
+}
+
+int kmeans_cuda(bool kmpp, float tolerance, float yinyang_t,
+                KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+                uint32_t clusters_size, uint32_t seed, uint32_t device,
+                int32_t verbosity, const float *samples, float *centroids,
+                uint32_t *assignments) {
+  KMCUDAOptions options = {};
+  options.kmpp = kmpp;
+  options.tolerance = tolerance;
+  options.yinyang_t = yinyang_t;
+  options.seed = seed;
+  options.device = device;
+  options.verbosity = verbosity;
+  return kmeans_cuda_ex(&options, samples_size, features_size, clusters_size,
+                        samples, centroids, assignments, nullptr);
+}
+}
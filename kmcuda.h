@@ -3,6 +3,18 @@
 
 #include <stdint.h>
 
+#ifdef KMCUDA_INDEX64
+/// The type of the numbers of samples and of the sample indices. Define
+/// KMCUDA_INDEX64 (-DINDEX64=ON) for more than 2^32 samples, the library and
+/// its users must agree on it.
+typedef uint64_t KMCUDASampleIndex;
+/// The type of the number of features.
+typedef uint32_t KMCUDAFeatureIndex;
+#else
+typedef uint32_t KMCUDASampleIndex;
+typedef uint16_t KMCUDAFeatureIndex;
+#endif
+
 enum KMCUDAResult {
   kmcudaSuccess = 0,
   kmcudaInvalidArguments,
@@ -12,7 +24,185 @@ enum KMCUDAResult {
   kmcudaMemoryCopyError
 };
 
+enum KMCUDAStopReason {
+  /// the ratio of reassignments dropped below the tolerance.
+  kmcudaStopTolerance = 0,
+  /// no centroid shifted farther than the shift tolerance.
+  kmcudaStopCentroidShift,
+  /// the maximum number of iterations was reached.
+  kmcudaStopMaxIterations,
+  /// the time budget was exhausted.
+  kmcudaStopTimeBudget,
+  /// the progress callback requested to stop.
+  kmcudaStopCancelled
+};
+
+enum KMCUDAPhase {
+  /// picking the initial centroids (random or kmeans++).
+  kmcudaPhaseInit = 0,
+  /// Lloyd iterations, including their adjust steps. If Yinyang is enabled,
+  /// this is the draft before it.
+  kmcudaPhaseLloyd,
+  /// clustering the centroids into Yinyang groups.
+  kmcudaPhaseYinyangGroups,
+  /// (re)initializing the Yinyang bounds.
+  kmcudaPhaseYinyangRefresh,
+  /// calculating the centroid and group drifts.
+  kmcudaPhaseDrifts,
+  /// Yinyang global filter.
+  kmcudaPhaseGlobalFilter,
+  /// Yinyang local filter.
+  kmcudaPhaseLocalFilter,
+  /// updating the centroids after the reassignments.
+  kmcudaPhaseAdjust,
+  /// a single kmeans++ step, part of kmcudaPhaseInit.
+  kmcudaPhasePlusPlus,
+  /// building the centroid graph and the graph assignment, part of
+  /// kmcudaPhaseLloyd.
+  kmcudaPhaseNeighbors,
+  /// sorting the samples by cluster, see KMCUDAOptions::reorder_interval.
+  kmcudaPhaseReorder,
+  kmcudaPhaseCount
+};
+
 extern "C" {
+
+/// @brief Per-phase timings and counters. They are collected only if the
+///        library was built with -DPROFILE=ON, otherwise stay zero, except
+///        refreshes which costs nothing and is always counted.
+struct KMCUDAProfile {
+  /// device seconds spent in each KMCUDAPhase, excluding the phases nested
+  /// in it: e.g. kmcudaPhaseLloyd does not include kmcudaPhaseAdjust and
+  /// kmcudaPhaseNeighbors, so the times add up to the whole run.
+  double phase_times[kmcudaPhaseCount];
+  /// the number of calculated sample-centroid distances.
+  uint64_t distance_evaluations;
+  /// the number of samples which passed the Yinyang global filter,
+  /// summed over the iterations.
+  uint64_t passed;
+  /// the number of Yinyang bounds refreshes triggered by too many samples
+  /// passing the global filter, summed over the restarts. Always counted.
+  uint32_t refreshes;
+  /// estimated device memory traffic in bytes.
+  uint64_t bytes_touched;
+};
+
+/// @brief The state of the running kmeans_cuda_ex() which is passed to
+///        KMCUDAProgressCallback.
+struct KMCUDAProgress {
+  /// the index of the current restart, see KMCUDAOptions::n_init.
+  uint32_t restart;
+  /// the number of the iteration which has just finished, starting from 1.
+  uint32_t iteration;
+  /// the number of samples which changed their clusters.
+  KMCUDASampleIndex reassignments;
+  /// the ratio of samples which passed the Yinyang global filter, 1 for Lloyd.
+  float passed_ratio;
+  /// seconds since the start of kmeans_cuda_ex().
+  double elapsed;
+};
+
+/// @brief Invoked after each iteration. Returning non-zero stops the run
+///        gracefully: the current centroids and assignments are returned
+///        (or the best ones if there were several restarts).
+typedef int (*KMCUDAProgressCallback)(const KMCUDAProgress *progress, void *arg);
+
+/// @brief Parameters of kmeans_cuda_ex(). Zero-initialize and set the needed
+///        fields: {} means random initialization and Lloyd.
+struct KMCUDAOptions {
+  /// indicates whether to do kmeans++ initialization.
+  bool kmpp;
+  /// if the number of reassignments drop below this ratio, stop.
+  float tolerance;
+  /// the relative number of cluster groups, usually 0.1.
+  float yinyang_t;
+  /// random generator seed.
+  uint32_t seed;
+  /// CUDA device index - usually 0.
+  uint32_t device;
+  /// 0 - no output; 1 - progress output; >=2 - debug output.
+  int32_t verbosity;
+  /// the number of restarts with seeds seed, seed + 1, ... The one with the
+  /// lowest inertia wins. 0 is the same as 1. Up to 4 restarts run
+  /// concurrently on their own streams and share the device samples.
+  /// They run one at a time if the library is built with PROFILE, so that
+  /// the phase times do not overlap, and inside kmeans_cuda_batch().
+  uint32_t n_init;
+  /// stop after this number of iterations, 0 means no limit.
+  uint32_t max_iterations;
+  /// stop if no centroid shifts farther than this during an iteration,
+  /// 0 means disabled.
+  float shift_tolerance;
+  /// stop after this number of seconds since the start, 0 means no limit.
+  /// The current iteration is always finished.
+  float time_budget;
+  /// optional callback which is invoked after each iteration.
+  KMCUDAProgressCallback progress;
+  /// passed as is to progress().
+  void *progress_arg;
+  /// optional path to the Chrome trace JSON file with every profiled phase,
+  /// see chrome://tracing or https://ui.perfetto.dev. Requires -DPROFILE=ON.
+  const char *trace;
+  /// Lloyd only: if not 0, the k-NN graph of this many (at most 32) nearest
+  /// neighbors is built over the centroids each iteration and each sample
+  /// first searches among its current centroid and the neighbors of it.
+  /// The full scan happens only if the triangle inequality does not prove
+  /// that the rest of the centroids are farther. Pays off for large
+  /// clusters_size.
+  uint32_t neighbors;
+  /// never fall back to the full scan for the samples which are already
+  /// assigned, see neighbors. Faster but the result is approximate.
+  bool approximate_neighbors;
+  /// optional array of the initial centroids of size clusters_size x
+  /// features_size in row major format. Overrides kmpp and n_init.
+  /// Not supported by kmeans_cuda_ex_f64().
+  const float *init_centroids;
+  /// if not 0, the device copy of the samples is sorted by cluster every this
+  /// many iterations, so the samples of the same cluster are adjacent in
+  /// memory. Requires another device buffer of the size of the samples and,
+  /// with Yinyang, another one of the size of the bounds.
+  /// The assignments are returned in the original order.
+  uint32_t reorder_interval;
+};
+
+/// @brief Quality metrics of the clustering returned by kmeans_cuda_ex().
+///        Lloyd accumulates them on the GPU in every assignment pass,
+///        Yinyang and the centroid k-NN graph in one extra pass after the
+///        last iteration.
+struct KMCUDAStatistics {
+  /// output: the sum of squared distances from the samples to their centroids.
+  /// It is summed in double in a fixed order, so the same clustering always
+  /// has the same inertia.
+  double inertia;
+  /// optional output array of cluster sizes of size clusters_size x 1.
+  KMCUDASampleIndex *ccounts;
+  /// optional output array of per-cluster sums of squared distances of size
+  /// clusters_size x 1.
+  float *sse;
+  /// optional output array of the maximal distances from the samples to their
+  /// centroids of size clusters_size x 1.
+  float *radiuses;
+  /// output: the number of performed iterations.
+  uint32_t iterations;
+  /// output: KMCUDAStopReason.
+  int stop_reason;
+  /// output: timings and counters summed over all the restarts.
+  KMCUDAProfile profile;
+};
+
+/// @brief The samples which are not dense row major, see kmeans_cuda_strided().
+///        Sample #i, feature #f is data[i * row_stride + f * column_stride].
+///        E.g. the column major samples have row_stride 1 and column_stride
+///        samples_size, the first features_size columns of the wider rows
+///        have column_stride 1 and row_stride equal to the full row length.
+struct KMCUDASamplesView {
+  const float *data;
+  /// the distance between the consecutive samples in elements.
+  uint64_t row_stride;
+  /// the distance between the consecutive features in elements.
+  uint64_t column_stride;
+};
+
 /// @brief Performs K-means clustering on GPU / CUDA.
 /// @param kmpp indicates whether to do kmeans++ initialization. If false,
 ///             ordinary random centroids will be picked.
@@ -21,7 +211,7 @@ extern "C" {
 /// @param samples_size number of samples.
 /// @param features_size number of features.
 /// @param clusters_size number of clusters.
-/// @param seed random generator seed passed to srand().
+/// @param seed random generator seed.
 /// @param device CUDA device index - usually 0.
 /// @param verbosity 0 - no output; 1 - progress output; >=2 - debug output.
 /// @param samples input array of size samples_size x features_size in row major format.
@@ -30,10 +220,273 @@ extern "C" {
 /// @param assignments output array of cluster indices for each sample of size
 ///                    samples_size x 1.
 /// @return KMCUDAResult.
-int kmeans_cuda(bool kmpp, float tolerance, float yinyang_t, uint32_t samples_size,
-                uint16_t features_size, uint32_t clusters_size, uint32_t seed,
+int kmeans_cuda(bool kmpp, float tolerance, float yinyang_t,
+                KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+                uint32_t clusters_size, uint32_t seed,
                 uint32_t device, int32_t verbosity, const float *samples,
                 float *centroids, uint32_t *assignments);
+
+/// @brief Performs K-means clustering on GPU / CUDA with the extended set of
+///        parameters.
+/// @param options see KMCUDAOptions.
+/// @param samples_size number of samples.
+/// @param features_size number of features.
+/// @param clusters_size number of clusters.
+/// @param samples input array of size samples_size x features_size in row major format.
+/// @param centroids output array of centroids of size clusters_size x features_size
+///                  in row major format.
+/// @param assignments output array of cluster indices for each sample of size
+///                    samples_size x 1.
+/// @param statistics optional output, see KMCUDAStatistics. May be nullptr.
+/// @return KMCUDAResult.
+int kmeans_cuda_ex(const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+                   KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+                   const float *samples, float *centroids, uint32_t *assignments,
+                   KMCUDAStatistics *statistics);
+
+/// @brief The double precision version of kmeans_cuda_ex(). The samples, the
+///        centroids, the distances and the Yinyang bounds are double on the
+///        device, so the result does not suffer from the float32 rounding on
+///        large or badly scaled data. It needs twice as much memory and is
+///        much slower on the GPUs with the throttled FP64 units.
+///        The statistics and the kmeans++ sampling weights remain float.
+/// @return KMCUDAResult.
+int kmeans_cuda_ex_f64(const KMCUDAOptions *options,
+                       KMCUDASampleIndex samples_size,
+                       KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+                       const double *samples, double *centroids,
+                       uint32_t *assignments, KMCUDAStatistics *statistics);
+
+/// @brief kmeans_cuda_ex() for the samples in an arbitrary strided layout,
+///        see KMCUDASamplesView. There is no transposed copy of the whole
+///        samples: the padded rows are uploaded as is, the column major samples
+///        are uploaded tile by tile and transposed on the device, the other
+///        layouts are gathered on the host tile by tile.
+/// @return KMCUDAResult.
+int kmeans_cuda_strided(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const KMCUDASamplesView *samples, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics);
+
+/// @brief Writes the samples [begin, begin + size) in the dense row major
+///        layout to dest, size x features_size elements of float or double
+///        depending on the function which uses it. See KMCUDASamplesSource.
+typedef void (*KMCUDASamplesFill)(
+    void *arg, KMCUDASampleIndex begin, KMCUDASampleIndex size, void *dest);
+
+/// @brief The samples which are produced on the fly, e.g. converted from
+///        another type. fill is called from the calling thread for
+///        consecutive tiles of rows while they are uploaded, so the converted
+///        copy never exceeds a tile.
+struct KMCUDASamplesSource {
+  KMCUDASamplesFill fill;
+  /// the first argument of fill.
+  void *arg;
+};
+
+/// @brief kmeans_cuda_ex() for the samples which are produced tile by tile,
+///        see KMCUDASamplesSource.
+/// @return KMCUDAResult.
+int kmeans_cuda_source(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const KMCUDASamplesSource *samples, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics);
+
+/// @brief kmeans_cuda_source() in double precision, fill writes double.
+/// @return KMCUDAResult.
+int kmeans_cuda_source_f64(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    const KMCUDASamplesSource *samples, double *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics);
+
+/// @brief The device workspace which is kept between the fits, see
+///        kmeans_cuda_session_create().
+struct KMCUDASession;
+
+/// @brief Creates the session which fits the same number of features and
+///        clusters many times without reallocating the device buffers and
+///        the stream. The buffers grow to the largest number of samples seen.
+///        A session must not be used by several threads at once.
+/// @param options see KMCUDAOptions, copied. The pointers in it must stay
+///                valid while the session lives. trace must be null.
+/// @param session output, destroy it with kmeans_cuda_session_destroy().
+/// @return KMCUDAResult.
+int kmeans_cuda_session_create(
+    const KMCUDAOptions *options, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, KMCUDASession **session);
+
+/// @brief kmeans_cuda_ex() or, if samples is nullptr, kmeans_cuda_source()
+///        in the buffers of the session.
+/// @return KMCUDAResult.
+int kmeans_cuda_session_fit(
+    KMCUDASession *session, KMCUDASampleIndex samples_size,
+    const float *samples, const KMCUDASamplesSource *source, float *centroids,
+    uint32_t *assignments, KMCUDAStatistics *statistics);
+
+/// @brief Frees the device buffers of the session. session may be nullptr.
+void kmeans_cuda_session_destroy(KMCUDASession *session);
+
+/// @brief Clusters many independent datasets with the same number of features
+///        in one call. Dataset #i consists of the samples
+///        [samples_offsets[i], samples_offsets[i + 1]) and gets the clusters
+///        [clusters_offsets[i], clusters_offsets[i + 1]). The datasets are
+///        scheduled over at most 8 OpenMP threads which run concurrently, each
+///        with its own device buffers and CUDA stream reused between the
+///        datasets. Fewer threads run if the device memory is short.
+/// @param options see KMCUDAOptions, applied to every dataset. trace must be null.
+/// @param batch_size number of datasets.
+/// @param features_size number of features.
+/// @param samples_offsets array of size batch_size + 1, the first row of each dataset.
+/// @param clusters_offsets array of size batch_size + 1, the first centroid of
+///                         each dataset.
+/// @param samples input array of size samples_offsets[batch_size] x features_size
+///                in row major format.
+/// @param centroids output array of size clusters_offsets[batch_size] x features_size
+///                  in row major format.
+/// @param assignments output array of size samples_offsets[batch_size] x 1, the
+///                    cluster indices are local to each dataset.
+/// @param statistics optional output array of size batch_size. May be nullptr.
+/// @param results optional output array of size batch_size with KMCUDAResult of
+///                each dataset. May be nullptr.
+/// @return kmcudaSuccess if all the datasets succeeded, otherwise one of the failures.
+int kmeans_cuda_batch(
+    const KMCUDAOptions *options, uint32_t batch_size,
+    KMCUDAFeatureIndex features_size,
+    const KMCUDASampleIndex *samples_offsets, const uint32_t *clusters_offsets,
+    const float *samples, float *centroids, uint32_t *assignments,
+    KMCUDAStatistics *statistics, int *results);
+
+/// @brief Two-level K-means for very large numbers of clusters. The samples
+///        are first clustered into coarse_size clusters, then each coarse
+///        partition is clustered independently by kmeans_cuda_batch() into
+///        the number of clusters proportional to its size. The fine centroids
+///        of each partition are contiguous. The partitions are gathered by a
+///        permutation straight into the device buffers of each fit, and those
+///        with a single fine cluster are averaged on the device instead of
+///        being clustered. The cost of an iteration drops from
+///        O(n K d) to O(n (coarse_size + K / coarse_size) d); coarse_size =
+///        sqrt(clusters_size) is the optimum.
+/// @param options see KMCUDAOptions, applied to both levels.
+/// @param samples_size number of samples.
+/// @param features_size number of features.
+/// @param clusters_size number of the fine clusters.
+/// @param coarse_size number of the coarse clusters, 2 <= coarse_size <= clusters_size.
+/// @param samples input array of size samples_size x features_size in row major format.
+/// @param centroids output array of the fine centroids of size
+///                  clusters_size x features_size in row major format.
+/// @param assignments output array of the fine cluster indices for each sample
+///                    of size samples_size x 1.
+/// @param coarse_centroids optional output array of size coarse_size x features_size.
+/// @param parents optional output array of size clusters_size x 1 with the coarse
+///                cluster of each fine cluster.
+/// @return KMCUDAResult.
+int kmeans_cuda_hierarchical(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size, uint32_t coarse_size, const float *samples,
+    float *centroids, uint32_t *assignments, float *coarse_centroids,
+    uint32_t *parents);
+
+/// @brief Trains the product quantization codebooks and encodes the samples.
+///        The features are split into subspaces_size contiguous subspaces of
+///        features_size / subspaces_size features each, and each subspace is
+///        clustered independently. The subspaces are scheduled like the
+///        datasets of kmeans_cuda_batch(). The subspace columns are uploaded
+///        straight from samples without making sliced copies on the host.
+/// @param options see KMCUDAOptions, applied to every subspace. trace must be null.
+/// @param samples_size number of samples.
+/// @param features_size number of features, must be divisible by subspaces_size.
+/// @param subspaces_size number of subspaces (M).
+/// @param clusters_size number of clusters in each subspace, 2 <= clusters_size <= 256.
+/// @param samples input array of size samples_size x features_size in row major format.
+/// @param codebooks output array of size
+///                  subspaces_size x clusters_size x (features_size / subspaces_size)
+///                  in row major format.
+/// @param codes output array of size samples_size x subspaces_size with the
+///              cluster of each subvector. A subspace with NaN subvectors
+///              fails with kmcudaInvalidArguments.
+/// @param statistics optional output array of size subspaces_size. May be nullptr.
+/// @param results optional output array of size subspaces_size with KMCUDAResult
+///                of each subspace. May be nullptr.
+/// @return kmcudaSuccess if all the subspaces succeeded, otherwise one of the failures.
+int kmeans_train_pq(
+    const KMCUDAOptions *options, KMCUDASampleIndex samples_size,
+    KMCUDAFeatureIndex features_size,
+    uint32_t subspaces_size, uint32_t clusters_size, const float *samples,
+    float *codebooks, uint8_t *codes, KMCUDAStatistics *statistics,
+    int *results);
+
+/// @brief Assigns the samples to the nearest given centroids on the host.
+///        The samples are split into contiguous ranges among the OpenMP
+///        threads, which are spread over the NUMA nodes, each node reading
+///        its own replica of the centroids.
+/// @param samples_size number of samples.
+/// @param features_size number of features.
+/// @param clusters_size number of centroids.
+/// @param samples input array of size samples_size x features_size in row major format.
+/// @param centroids input array of size clusters_size x features_size in row major format.
+/// @param assignments optional output array of size samples_size x 1 with the
+///                    nearest centroid of each sample, clusters_size for NaN samples.
+/// @param distances optional output array of size samples_size x clusters_size
+///                  with the Euclidean distances to every centroid.
+/// @param inertia optional output: the sum of squared distances from the samples
+///                to their nearest centroids.
+/// @return KMCUDAResult.
+int kmeans_host_predict(
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size,
+    const float *samples, const float *centroids, uint32_t *assignments,
+    float *distances, double *inertia);
+
+/// @brief The double precision version of kmeans_host_predict().
+/// @return KMCUDAResult.
+int kmeans_host_predict_f64(
+    KMCUDASampleIndex samples_size, KMCUDAFeatureIndex features_size,
+    uint32_t clusters_size,
+    const double *samples, const double *centroids, uint32_t *assignments,
+    double *distances, double *inertia);
+
+/// @brief The per-cluster sums of the samples on the host, one replica per
+///        NUMA node, which are kept between the calls of
+///        kmeans_host_accumulate(), see kmeans_host_accumulator_create().
+struct KMCUDAHostAccumulator;
+
+/// @brief Creates the accumulator of the per-cluster sums of the samples,
+///        which is the host half of the mini-batch update. It holds
+///        clusters_size x (features_size + 1) doubles per NUMA node, each
+///        first touched on its node; there are no per-thread copies.
+///        An accumulator must not be used by several threads at once.
+/// @param accumulator output, destroy it with kmeans_host_accumulator_destroy().
+/// @return KMCUDAResult, kmcudaMemoryAllocationFailure if the sums do not fit.
+int kmeans_host_accumulator_create(
+    KMCUDAFeatureIndex features_size, uint32_t clusters_size,
+    KMCUDAHostAccumulator **accumulator);
+
+/// @brief Assigns the samples like kmeans_host_predict() and adds each one
+///        to the sums of its nearest centroid in the replica of its node.
+///        The threads of a node update disjoint ranges of the clusters, so
+///        there are neither atomics nor per-thread sums. May be called many
+///        times, e.g. tile by tile, before kmeans_host_accumulator_reduce().
+/// @param assignments output array of size samples_size x 1, required.
+///                    NaN samples are assigned to clusters_size and skipped.
+/// @return KMCUDAResult.
+int kmeans_host_accumulate(
+    KMCUDAHostAccumulator *accumulator, KMCUDASampleIndex samples_size,
+    const float *samples, const float *centroids, uint32_t *assignments);
+
+/// @brief Sums the replicas of the nodes and starts over from zero.
+/// @param sums output array of size clusters_size x features_size.
+/// @param counts output array of size clusters_size x 1, the number of the
+///               samples accumulated into each cluster.
+/// @return KMCUDAResult.
+int kmeans_host_accumulator_reduce(
+    KMCUDAHostAccumulator *accumulator, double *sums, double *counts);
+
+/// @brief Frees the accumulator. accumulator may be nullptr.
+void kmeans_host_accumulator_destroy(KMCUDAHostAccumulator *accumulator);
 }
 
 #endif //KMCUDA_KMCUDA_H
@@ -0,0 +1,107 @@
+#ifndef KMCUDA_PHILOX_H
+#define KMCUDA_PHILOX_H
+
+#include <stdint.h>
+
+/// Philox4x32-10 counter-based random number generator, see
+/// "Parallel Random Numbers: As Easy as 1, 2, 3" by Salmon et al. (SC'11).
+/// The output is a pure function of (seed, stream, index), so any thread on
+/// the host or on the device can draw its numbers independently and the
+/// result does not depend on the scheduling.
+
+#ifdef __CUDACC__
+#define PHILOX_DECL __host__ __device__ __forceinline__
+#else
+#define PHILOX_DECL inline
+#endif
+
+struct KMCUDAPhilox4x32 {
+  uint32_t v[4];
+};
+
+PHILOX_DECL uint32_t philox_mulhilo(uint32_t a, uint32_t b, uint32_t *hi) {
+  uint64_t product = static_cast<uint64_t>(a) * b;
+  *hi = static_cast<uint32_t>(product >> 32);
+  return static_cast<uint32_t>(product);
+}
+
+/// Returns 4 random words for the given 128-bit counter and 64-bit key.
+PHILOX_DECL KMCUDAPhilox4x32 philox4x32(
+    uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t k0, uint32_t k1) {
+  for (int round = 0; round < 10; round++) {
+    uint32_t hi0, hi1;
+    uint32_t lo0 = philox_mulhilo(0xD2511F53u, c0, &hi0);
+    uint32_t lo1 = philox_mulhilo(0xCD9E8D57u, c2, &hi1);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  return {{c0, c1, c2, c3}};
+}
+
+/// Sequential view on a single stream: the n-th call to next() returns the
+/// n-th word of the stream identified by (seed, stream).
+class KMCUDARandom {
+ public:
+  PHILOX_DECL KMCUDARandom(uint32_t seed, uint64_t stream, uint64_t offset = 0)
+      : seed_(seed), stream_(stream), index_(offset) {}
+
+  /// Returns a uniformly distributed 32-bit word.
+  PHILOX_DECL uint32_t next() {
+    uint64_t block = index_ >> 2;
+    KMCUDAPhilox4x32 r = philox4x32(
+        static_cast<uint32_t>(block), static_cast<uint32_t>(block >> 32),
+        static_cast<uint32_t>(stream_), static_cast<uint32_t>(stream_ >> 32),
+        seed_, 0x6B6D6375u);
+    return r.v[index_++ & 3];
+  }
+
+  /// Returns a uniformly distributed integer in [0, bound) without the
+  /// modulo bias (Lemire's multiply and reject).
+  PHILOX_DECL uint32_t bounded(uint32_t bound) {
+    uint64_t m = static_cast<uint64_t>(next()) * bound;
+    uint32_t low = static_cast<uint32_t>(m);
+    if (low < bound) {
+      uint32_t threshold = (0u - bound) % bound;
+      while (low < threshold) {
+        m = static_cast<uint64_t>(next()) * bound;
+        low = static_cast<uint32_t>(m);
+      }
+    }
+    return static_cast<uint32_t>(m >> 32);
+  }
+
+  /// bounded() for 64-bit bounds. Draws the same words as bounded() if
+  /// bound fits into 32 bits, otherwise combines two words and rejects
+  /// the biased tail.
+  PHILOX_DECL uint64_t bounded64(uint64_t bound) {
+    if (bound <= 0xFFFFFFFFull) {
+      return bounded(static_cast<uint32_t>(bound));
+    }
+    uint64_t threshold = (0ull - bound) % bound;
+    uint64_t r;
+    do {
+      // the order of the operands of | is unspecified, the words must not be
+      uint64_t hi = next();
+      uint64_t lo = next();
+      r = (hi << 32) | lo;
+    } while (r < threshold);
+    return r % bound;
+  }
+
+  /// Returns a uniformly distributed double in [0, 1) with 53 random bits.
+  PHILOX_DECL double uniform() {
+    uint64_t hi = next() >> 5, lo = next() >> 6;
+    return (hi * 67108864.0 + lo) * (1.0 / 9007199254740992.0);
+  }
+
+ private:
+  uint32_t seed_;
+  uint64_t stream_;
+  uint64_t index_;
+};
+
+#endif  // KMCUDA_PHILOX_H
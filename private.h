@@ -1,6 +1,11 @@
 #ifndef KMCUDA_PRIVATE_H
 #define KMCUDA_PRIVATE_H
 
+#include <chrono>
+#include <cinttypes>
+#include <utility>
+#include <vector>
+#include <cuda_runtime_api.h>
 #include "kmcuda.h"
 
 enum KMCUDAInitMethod {
@@ -16,30 +21,316 @@ enum KMCUDAInitMethod {
   } \
 } while (false)
 
+#ifdef KMCUDA_INDEX64
+#define PRIuSAMPLE PRIu64
+#define PRIuFEATURE PRIu32
+/// the type of the device counters of the samples, see atomicAdd().
+typedef unsigned long long KMCUDACounter;
+#else
+#define PRIuSAMPLE PRIu32
+#define PRIuFEATURE PRIu16
+typedef uint32_t KMCUDACounter;
+#endif
+
 #define INFO(...) do { if (verbosity > 0) { printf(__VA_ARGS__); } } while (false)
 #define DEBUG(...) do { if (verbosity > 1) { printf(__VA_ARGS__); } } while (false)
 
+#ifdef PROFILE
+/// Measures the device time of each KMCUDAPhase with CUDA events and
+/// accumulates the counters. Used only through the PROFILE_* macros below.
+/// begin() / end() only record the events on the stream, finish() resolves
+/// them all at once after the run, so profiling does not serialize the host
+/// with the device. Every begin() / end() pair is also logged for the Chrome
+/// trace export.
+class KMCUDAProfiler {
+ public:
+  /// One begin() / end() pair, in microseconds since the profiler creation.
+  struct Event {
+    KMCUDAPhase phase;
+    uint32_t restart;
+    uint32_t iteration;
+    double host_begin, host_end;
+    double device_begin, device_end;
+  };
+
+  KMCUDAProfiler(KMCUDAProfile *profile, cudaStream_t stream);
+  ~KMCUDAProfiler();
+  void begin(KMCUDAPhase phase);
+  void end(KMCUDAPhase phase);
+  /// Waits for the recorded events and adds the exclusive device time of each
+  /// phase, that is, without the nested phases, to the profile.
+  KMCUDAResult finish();
+  KMCUDAProfile *profile() const { return profile_; }
+  const std::vector<Event> &events() const { return events_; }
+  void set_restart(uint32_t restart) { restart_ = restart; }
+  void set_iteration(uint32_t iteration) { iteration_ = iteration; }
+
+ private:
+  /// begin() / end() pair which has not been resolved by finish() yet.
+  struct Record {
+    Event event;
+    cudaEvent_t start, stop;
+    /// the index of the enclosing record, -1 if none.
+    int64_t parent;
+  };
+
+  double host_now() const;
+  cudaEvent_t acquire();
+
+  KMCUDAProfile *profile_;
+  cudaStream_t stream_;
+  std::chrono::steady_clock::time_point host_origin_;
+  cudaEvent_t origin_;
+  std::vector<Record> records_;
+  /// the indices of the started records, they may nest.
+  std::vector<int64_t> open_;
+  /// the events which are not in use, to avoid creating new ones.
+  std::vector<cudaEvent_t> pool_;
+  std::vector<Event> events_;
+  uint32_t restart_;
+  uint32_t iteration_;
+};
+
+class KMCUDAProfilerScope {
+ public:
+  KMCUDAProfilerScope(KMCUDAProfiler *profiler, KMCUDAPhase phase)
+      : profiler_(profiler), phase_(phase) {
+    if (profiler_) {
+      profiler_->begin(phase_);
+    }
+  }
+  ~KMCUDAProfilerScope() {
+    if (profiler_) {
+      profiler_->end(phase_);
+    }
+  }
+
+ private:
+  KMCUDAProfiler *profiler_;
+  KMCUDAPhase phase_;
+};
+
+#define PROFILE_SCOPE(profiler, phase) \
+  KMCUDAProfilerScope __profile_scope_##phase(profiler, phase)
+#define PROFILE_COUNT(profiler, counter, value) do { \
+  if (profiler) { (profiler)->profile()->counter += (value); } \
+} while (false)
+#define PROFILE_ITERATION(profiler, value) do { \
+  if (profiler) { (profiler)->set_iteration(value); } \
+} while (false)
+#else
+/// Opaque without PROFILE, the profiler pointers are always nullptr then.
+class KMCUDAProfiler;
+
+#define PROFILE_SCOPE(profiler, phase) do {} while (false)
+#define PROFILE_COUNT(profiler, counter, value) do {} while (false)
+#define PROFILE_ITERATION(profiler, value) do {} while (false)
+#endif
+
+/// the maximal KMCUDAOptions::neighbors.
+#define KMCUDA_MAX_NEIGHBORS 32
+
+/// the block size of kmeans_calc_stats() and of the Lloyd assignment which
+/// accumulates the same statistics, see stats_blocks().
+#define BS_STATS 256
+
+/// Device counters of a single run.
+struct KMCUDACounters {
+  /// the number of reassignments during the current iteration.
+  KMCUDACounter changed;
+  /// the number of samples which passed the Yinyang global filter or
+  /// failed the centroid graph certificate.
+  KMCUDACounter passed_number;
+  /// the number of passed samples taken by kmeans_yy_local_filter() blocks.
+  KMCUDACounter passed_cursor;
+  /// the maximal centroid drift of the iteration if the shift is tracked.
+  float max_shift;
+  /// the number of calculated distances, only with PROFILE.
+  unsigned long long distance_evaluations;
+};
+
+/// Problem sizes, the device counters and the stream of a single run.
+/// It is passed to every kernel by value, so any number of runs may
+/// proceed concurrently in the same process.
+struct KMCUDAContext {
+  KMCUDASampleIndex samples_size;
+  KMCUDAFeatureIndex features_size;
+  uint32_t clusters_size;
+  uint32_t yy_groups_size;
+  /// a reassignment record is (sample << cluster_bits) | previous cluster,
+  /// the fewest bits which fit clusters_size.
+  uint32_t cluster_bits;
+  /// the dynamic shared memory size per block in 32-bit words.
+  int shmem_size;
+  /// device memory owned by the caller.
+  KMCUDACounters *counters;
+  /// all the kernels and copies of the run are issued to this stream.
+  cudaStream_t stream;
+};
+
+/// The permutation of the device samples which sorts them by cluster,
+/// see KMCUDAOptions::reorder_interval. The original samples stay intact.
+struct KMCUDAReorder {
+  /// reorder every this many iterations.
+  uint32_t interval;
+  /// the reordered samples, samples_size x features_size F.
+  void *samples;
+  /// order[i] is the original index of the reordered sample #i.
+  KMCUDASampleIndex *order;
+  /// the scratch of the same size as order.
+  KMCUDASampleIndex *perm;
+  /// the scratch of the size of the Yinyang bounds to permute them, nullptr
+  /// without Yinyang.
+  void *bounds;
+  /// false if the samples have not been reordered yet during the restart.
+  bool active;
+};
+
+/// The device scratch of the thrust sorts of a run. It grows to the largest
+/// request and serves all the following sorts, so the iterations do not
+/// allocate and free the device memory each time.
+struct KMCUDASortStorage {
+  void *buffer;
+  size_t size;
+  /// a nested request gets its own allocation while the buffer is taken.
+  bool busy;
+};
+
+/// Stop conditions of the iterative refinement and how it actually stopped.
+struct KMCUDAConvergence {
+  /// stop if the ratio of reassignments drops below this value.
+  float tolerance;
+  /// stop after this number of iterations, 0 means no limit.
+  uint32_t max_iterations;
+  /// stop if no centroid shifts farther than this, 0 means disabled.
+  float shift_tolerance;
+  /// stop after this moment.
+  std::chrono::steady_clock::time_point deadline;
+  /// optional callback which is invoked after each iteration.
+  KMCUDAProgressCallback progress;
+  /// the last argument of progress().
+  void *progress_arg;
+  /// the moment when kmeans_cuda_ex() started.
+  std::chrono::steady_clock::time_point start;
+  /// the index of the current restart.
+  uint32_t restart;
+  /// the maximal centroid shift during the last iteration.
+  float shift;
+  /// the ratio of samples which passed the Yinyang global filter during
+  /// the last iteration.
+  float passed_ratio;
+  /// the number of reassignments during the last iteration.
+  KMCUDASampleIndex reassignments;
+  /// the size of the centroid graph neighborhood in Lloyd, 0 means disabled.
+  uint32_t neighbors;
+  /// skip the full scan if the graph neighborhood is not certified.
+  bool approximate_neighbors;
+  /// nullptr unless built with PROFILE.
+  KMCUDAProfiler *profiler;
+  /// nullptr unless the samples are reordered.
+  KMCUDAReorder *reorder;
+  /// the scratch of the reassignments sort, nullptr means thrust allocates
+  /// it every time.
+  KMCUDASortStorage *sort_storage;
+  /// output: the number of performed iterations.
+  uint32_t iterations;
+  /// output: the number of Yinyang bounds refreshes, counted with or without
+  /// PROFILE.
+  uint32_t refreshes;
+  /// output: why the refinement stopped.
+  KMCUDAStopReason stop_reason;
+};
+
 extern "C" {
 
+/// Fills the shared memory size and the reassignment record layout of ctx and
+/// resets its counters, which must already be allocated.
+KMCUDAResult kmeans_cuda_setup(KMCUDAContext *ctx, uint32_t device,
+                               int32_t verbosity);
+
+/// Returns and resets the number of distance evaluations counted by
+/// the kernels. Always 0 unless built with PROFILE.
+KMCUDAResult kmeans_cuda_distance_evaluations(
+    const KMCUDAContext *ctx, uint64_t *evaluations);
+}
+
+/// F is the element type of the samples and the centroids: float or double.
+/// The k-means++ sampling weights in dists are always float.
+template <typename F>
 KMCUDAResult kmeans_cuda_plus_plus(
-    uint32_t samples_size, uint32_t cc, float *samples, float *centroids,
+    const KMCUDAContext *ctx, uint32_t cc, const F *samples, const F *centroids,
     float *dists, float *distssum, float **dev_sums);
 
-KMCUDAResult kmeans_cuda_setup(uint32_t samples_size, uint16_t features_size,
-                               uint32_t clusters_size, uint32_t yy_groups_size,
-                               uint32_t device, int32_t verbosity);
+/// Picks ctx->clusters_size centroids out of ctx->samples_size samples.
+template <typename F>
+KMCUDAResult kmeans_init_centroids(
+    const KMCUDAContext *ctx, KMCUDAInitMethod method, uint32_t seed,
+    int32_t verbosity, const F *samples, void *dists, F *centroids,
+    KMCUDAProfiler *profiler);
+
+/// Packs the column major block of rows samples (features_size columns of
+/// rows elements each) into the dense row major samples on stream.
+template <typename F>
+KMCUDAResult kmeans_cuda_pack_columns(
+    cudaStream_t stream, const F *columns, uint32_t rows,
+    KMCUDAFeatureIndex features_size, F *samples);
+
+/// Writes the mean of each partition of the device samples to means
+/// (partitions_size x features_size) on stream. The partition #p consists of
+/// the samples order[offsets[p]] ... order[offsets[p + 1] - 1]; order and
+/// offsets are in device memory.
+template <typename F>
+KMCUDAResult kmeans_cuda_partition_means(
+    cudaStream_t stream, const F *samples, KMCUDAFeatureIndex features_size,
+    uint32_t partitions_size, const KMCUDASampleIndex *order,
+    const KMCUDASampleIndex *offsets, F *means);
 
+/// L is the cluster label type: uint16_t if clusters_size < UINT16_MAX,
+/// uint32_t otherwise. It halves the label memory and bandwidth for most
+/// practical numbers of clusters.
+/// stats is either nullptr or the device buffer of
+/// stats_size(clusters_size, samples_size) bytes which receives the
+/// statistics of the final assignments: the inertias of the
+/// stats_blocks(samples_size) sample blocks (double), then the per-cluster
+/// sizes (KMCUDACounter), sums of squared distances (float) and squared
+/// radiuses (float). The block inertias are summed in a fixed order, so
+/// the total does not depend on the schedule of the blocks.
+/// ccounts and passed_yy are the arrays of KMCUDASampleIndex.
+/// graph is either nullptr or the device buffer for the centroid k-NN graph:
+/// the radiuses and the squared norms of the centroids (2 x clusters_size F),
+/// then the uncertified samples (samples_size KMCUDASampleIndex) and the
+/// neighbors (clusters_size x conv->neighbors 32-bit words).
+/// The bounds, the drifts and the Yinyang centroids have the element type F.
+/// If conv->reorder is not nullptr, the iterations run on the reordered copy
+/// of samples and leave the assignments in the reordered order if
+/// conv->reorder->active, see kmeans_cuda_restore_order().
+template <typename F, typename L>
 KMCUDAResult kmeans_cuda_yy(
-    float tolerance, uint32_t yinyang_groups, uint32_t samples_size_,
-    uint32_t clusters_size_, uint16_t features_size, int32_t verbosity,
-    const float *samples, float *centroids, uint32_t *ccounts,
-    uint32_t *assignments_prev, uint32_t *assignments, uint32_t *assignments_yy,
-    float *centroids_yy, float *bounds_yy, float *drifts_yy, uint32_t *passed_yy);
+    const KMCUDAContext &ctx, KMCUDAConvergence *conv, int32_t verbosity,
+    const F *samples, F *centroids, KMCUDASampleIndex *ccounts,
+    uint64_t *reassignments, L *assignments, L *assignments_yy,
+    F *centroids_yy, F *bounds_yy, F *drifts_yy, KMCUDASampleIndex *passed_yy,
+    uint32_t *graph, uint32_t *stats);
 
-KMCUDAResult kmeans_init_centroids(
-    KMCUDAInitMethod method, uint32_t samples_size, uint16_t features_size,
-    uint32_t clusters_size, uint32_t seed, int32_t verbosity, float *samples,
-    void *dists, float *centroids);
+/// Writes the assignments of the reordered samples in the original order:
+/// dest[reorder.order[i]] = assignments[i].
+template <typename L>
+KMCUDAResult kmeans_cuda_restore_order(
+    const KMCUDAContext &ctx, const KMCUDAReorder &reorder, const L *assignments,
+    L *dest);
+
+/// The number of the partial inertias in the statistics buffer of
+/// kmeans_cuda_yy(), one per block of BS_STATS samples.
+inline KMCUDASampleIndex stats_blocks(KMCUDASampleIndex samples_size) {
+  return samples_size / BS_STATS + 1;
+}
+
+/// The size of the statistics buffer of kmeans_cuda_yy() in bytes.
+inline size_t stats_size(uint32_t clusters_size,
+                         KMCUDASampleIndex samples_size) {
+  return stats_blocks(samples_size) * sizeof(double) +
+      static_cast<size_t>(clusters_size) *
+      (sizeof(KMCUDACounter) + 2 * sizeof(float));
 }
 
 #endif //KMCUDA_PRIVATE_H
@@ -1,15 +1,26 @@
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
 #include <Python.h>
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include <numpy/arrayobject.h>
 #include "kmcuda.h"
 
+/// the size of the host tile of partial_fit() in bytes if the samples are
+/// converted, see PySamplesSource.
+#define PARTIAL_FIT_TILE_SIZE (16 << 20)
+
 static char module_docstring[] =
     "This module provides fast K-means implementation which uses CUDA.";
 static char kmeans_cuda_docstring[] =
     "Assigns cluster label to each sample and calculates cluster centers.";
 
 static PyObject *py_kmeans_cuda(PyObject *self, PyObject *args, PyObject *kwargs);
+static bool add_kmeans_type(PyObject *module);
 
 static PyMethodDef module_functions[] = {
   {"kmeans_cuda", reinterpret_cast<PyCFunction>(py_kmeans_cuda),
@@ -35,6 +46,10 @@ PyMODINIT_FUNC PyInit_libKMCUDA(void) {
     PyErr_SetString(PyExc_RuntimeError, "PyModule_Create() failed");
     return NULL;
   }
+  if (!add_kmeans_type(m)) {
+    Py_DECREF(m);
+    return NULL;
+  }
   // numpy
   import_array();
   return m;
@@ -49,89 +64,963 @@ class pyobj : public pyobj_parent {
       ptr, [](PyObject *p){ Py_DECREF(p); }) {}
 };
 
-static PyObject *py_kmeans_cuda(PyObject *self, PyObject *args, PyObject *kwargs) {
-  uint32_t clusters_size = 0, seed = static_cast<uint32_t>(time(NULL)), device = 0;
-  int32_t verbosity = 0;
-  float tolerance = .0, yinyang_t = .1;
-  PyObject *kmpp = Py_False;
-  PyObject *samples_obj;
-  static const char *kwlist[] = {"samples", "clusters", "tolerance", "kmpp",
-                                 "yinyang_t", "seed", "device", "verbosity", NULL};
+/// The numpy type number of KMCUDASampleIndex.
+static constexpr int npy_sample_index =
+    sizeof(KMCUDASampleIndex) == sizeof(uint64_t)? NPY_UINT64 : NPY_UINT32;
 
-  /* Parse the input tuple */
-  if (!PyArg_ParseTupleAndKeywords(
-      args, kwargs, "OI|fO!fIIi", const_cast<char**>(kwlist),
-      &samples_obj, &clusters_size, &tolerance, &PyBool_Type, &kmpp, &yinyang_t,
-      &seed, &device, &verbosity)) {
-    return NULL;
+/// The numpy type number of the engine element type D.
+template <typename D> struct npy_dtype;
+template <> struct npy_dtype<float> {
+  static constexpr int value = NPY_FLOAT32;
+  static constexpr const char *name = "float32";
+};
+template <> struct npy_dtype<double> {
+  static constexpr int value = NPY_FLOAT64;
+  static constexpr const char *name = "float64";
+};
+
+/// Converts a 2D array of T with arbitrary strides to the dense D row
+/// major layout. Does not touch any Python object, so it runs without the GIL.
+/// The rows are split among the threads with exactly the same static schedule
+/// as the scan in kmeans_host_predict(), so if dest is freshly allocated and not
+/// initialized, the first touch places its pages on the NUMA node of the thread
+/// which later reads them.
+template <typename T, typename D>
+static void convert_samples(
+    const char *data, npy_intp row_stride, npy_intp column_stride,
+    KMCUDASampleIndex samples_size, uint32_t features_size, D *dest) {
+  #pragma omp parallel for schedule(static) proc_bind(spread)
+  for (KMCUDASampleIndex i = 0; i < samples_size; i++) {
+    const char *row = data + i * row_stride;
+    D *dest_row = dest + static_cast<size_t>(i) * features_size;
+    for (uint32_t f = 0; f < features_size; f++) {
+      dest_row[f] = static_cast<D>(
+          *reinterpret_cast<const T*>(row + f * column_stride));
+    }
   }
-  if (clusters_size < 2 || clusters_size == UINT32_MAX) {
-    PyErr_SetString(PyExc_ValueError, "\"clusters\" must be greater than 1 and "
-                                      "less than (1 << 32) - 1");
-    return NULL;
+}
+
+template <typename D>
+using samples_converter = void (*)(
+    const char*, npy_intp, npy_intp, KMCUDASampleIndex, uint32_t, D*);
+
+/// Returns the converter from the dtype of array or nullptr if it is not
+/// supported natively.
+template <typename D>
+static samples_converter<D> pick_converter(PyArrayObject *array) {
+  if (!PyArray_ISALIGNED(array) || !PyArray_ISNOTSWAPPED(array)) {
+    return nullptr;
+  }
+  switch (PyArray_TYPE(array)) {
+    case NPY_FLOAT32: return convert_samples<npy_float32, D>;
+    case NPY_FLOAT64: return convert_samples<npy_float64, D>;
+    case NPY_INT8: return convert_samples<npy_int8, D>;
+    case NPY_UINT8: return convert_samples<npy_uint8, D>;
+    case NPY_INT16: return convert_samples<npy_int16, D>;
+    case NPY_UINT16: return convert_samples<npy_uint16, D>;
+    case NPY_INT32: return convert_samples<npy_int32, D>;
+    case NPY_UINT32: return convert_samples<npy_uint32, D>;
+    case NPY_INT64: return convert_samples<npy_int64, D>;
+    case NPY_UINT64: return convert_samples<npy_uint64, D>;
+    default: return nullptr;
   }
-  pyobj samples_array(PyArray_FROM_OTF(samples_obj, NPY_FLOAT32, NPY_ARRAY_IN_ARRAY));
+}
+
+/// Converts the samples tile by tile while the engine uploads them, see
+/// KMCUDASamplesSource.
+template <typename D>
+struct PySamplesSource {
+  KMCUDASamplesSource source;
+  samples_converter<D> converter;
+  const char *data;
+  npy_intp row_stride, column_stride;
+  uint32_t features_size;
+
+  static void fill(void *arg, KMCUDASampleIndex begin, KMCUDASampleIndex size,
+                   void *dest) {
+    auto self = reinterpret_cast<const PySamplesSource*>(arg);
+    self->converter(self->data + begin * self->row_stride, self->row_stride,
+                    self->column_stride, size, self->features_size,
+                    reinterpret_cast<D*>(dest));
+  }
+};
+
+/// Converts samples_obj to the dense D (float or double) row major layout.
+/// C-contiguous arrays of D are used in place, the others are converted.
+/// If view is not nullptr, the float32 arrays with positive strides are used
+/// in place as well and view describes their layout.
+/// If source is not nullptr, the arrays of the natively supported dtypes are
+/// not converted here: source->source.fill is set and converts them tile by
+/// tile during the upload, *samples is nullptr.
+/// holder keeps the memory of *samples (and of the source) alive.
+template <typename D>
+static bool parse_samples(
+    PyObject *samples_obj, pyobj *holder, D **samples,
+    KMCUDASampleIndex *samples_size_ptr, uint32_t *features_size_ptr,
+    KMCUDASamplesView *view = nullptr, PySamplesSource<D> *source = nullptr) {
+  // no copy for numpy arrays, including numpy.memmap, and for the objects
+  // which support the buffer protocol
+  pyobj samples_array(PyArray_FROM_O(samples_obj));
   if (samples_array == NULL) {
     PyErr_SetString(PyExc_TypeError, "\"samples\" must be a 2D numpy array");
-    return NULL;
+    return false;
   }
   auto ndims = PyArray_NDIM(reinterpret_cast<PyArrayObject*>(samples_array.get()));
   if (ndims != 2) {
     PyErr_SetString(PyExc_ValueError, "\"samples\" must be a 2D numpy array");
-    return NULL;
+    return false;
   }
   auto dims = PyArray_DIMS(reinterpret_cast<PyArrayObject*>(samples_array.get()));
-  uint32_t samples_size = static_cast<uint32_t>(dims[0]);
-  uint32_t features_size = static_cast<uint32_t>(dims[1]);
-  if (features_size > UINT16_MAX) {
+  if (static_cast<uint64_t>(dims[0]) >
+      std::numeric_limits<KMCUDASampleIndex>::max()) {
     char msg[128];
-    sprintf(msg, "\"samples\": more than %" PRIu32 " features is not supported",
-            features_size);
+    sprintf(msg, "\"samples\": more than %" PRIu64 " samples is not supported",
+            static_cast<uint64_t>(std::numeric_limits<KMCUDASampleIndex>::max()));
     PyErr_SetString(PyExc_ValueError, msg);
-    return NULL;
+    return false;
   }
-  float *samples = reinterpret_cast<float*>(PyArray_DATA(
-      reinterpret_cast<PyArrayObject*>(samples_array.get())));
-  npy_intp centroid_dims[] = {clusters_size, features_size, 0};
-  auto centroids_array = PyArray_EMPTY(2, centroid_dims, NPY_FLOAT32, false);
-  float *centroids = reinterpret_cast<float*>(PyArray_DATA(
-      reinterpret_cast<PyArrayObject*>(centroids_array)));
-  npy_intp assignments_dims[] = {samples_size, 0};
-  auto assignments_array = PyArray_EMPTY(1, assignments_dims, NPY_UINT32, false);
-  uint32_t *assignments = reinterpret_cast<uint32_t*>(PyArray_DATA(
-      reinterpret_cast<PyArrayObject*>(assignments_array)));
-
-  int result;
-  Py_BEGIN_ALLOW_THREADS
-  result = kmeans_cuda(
-      kmpp == Py_True, tolerance, yinyang_t, samples_size,
-      static_cast<uint16_t>(features_size), clusters_size, seed, device,
-      verbosity, -1, samples, centroids, assignments);
-  Py_END_ALLOW_THREADS
+  if (static_cast<uint64_t>(dims[1]) >
+      std::numeric_limits<KMCUDAFeatureIndex>::max()) {
+    char msg[128];
+    sprintf(msg, "\"samples\": more than %" PRIu64 " features is not supported",
+            static_cast<uint64_t>(std::numeric_limits<KMCUDAFeatureIndex>::max()));
+    PyErr_SetString(PyExc_ValueError, msg);
+    return false;
+  }
+  KMCUDASampleIndex samples_size = *samples_size_ptr = dims[0];
+  uint32_t features_size = *features_size_ptr = static_cast<uint32_t>(dims[1]);
+  auto samples_view = reinterpret_cast<PyArrayObject*>(samples_array.get());
+  npy_intp *strides = PyArray_STRIDES(samples_view);
+  if (view != nullptr && PyArray_TYPE(samples_view) == NPY_FLOAT32 &&
+      PyArray_ISALIGNED(samples_view) && PyArray_ISNOTSWAPPED(samples_view) &&
+      strides[0] > 0 && strides[1] > 0) {
+    // e.g. Fortran order or a slice of the columns, the engine packs them
+    view->data = reinterpret_cast<const float*>(PyArray_DATA(samples_view));
+    view->row_stride = strides[0] / sizeof(float);
+    view->column_stride = strides[1] / sizeof(float);
+    *samples = reinterpret_cast<D*>(PyArray_DATA(samples_view));
+  } else if (PyArray_TYPE(samples_view) == npy_dtype<D>::value &&
+      PyArray_ISCARRAY_RO(samples_view)) {
+    // used in place
+    *samples = reinterpret_cast<D*>(PyArray_DATA(samples_view));
+  } else if (source != nullptr && pick_converter<D>(samples_view) != nullptr) {
+    // the only extra memory is the upload tile
+    source->converter = pick_converter<D>(samples_view);
+    source->data = PyArray_BYTES(samples_view);
+    source->row_stride = strides[0];
+    source->column_stride = strides[1];
+    source->features_size = features_size;
+    source->source.fill = PySamplesSource<D>::fill;
+    source->source.arg = source;
+    *samples = nullptr;
+  } else if (auto converter = pick_converter<D>(samples_view)) {
+    // the only extra memory is the converted result
+    npy_intp converted_dims[] = {static_cast<npy_intp>(samples_size), features_size, 0};
+    pyobj converted(PyArray_EMPTY(2, converted_dims, npy_dtype<D>::value,
+                                  false));
+    if (converted == NULL) {
+      return false;
+    }
+    *samples = reinterpret_cast<D*>(PyArray_DATA(
+        reinterpret_cast<PyArrayObject*>(converted.get())));
+    const char *data = PyArray_BYTES(samples_view);
+    Py_BEGIN_ALLOW_THREADS
+    converter(data, strides[0], strides[1], samples_size, features_size,
+              *samples);
+    Py_END_ALLOW_THREADS
+    samples_array.swap(converted);
+  } else {
+    // exotic dtypes and byte orders
+    pyobj converted(PyArray_FROM_OTF(
+        samples_array.get(), npy_dtype<D>::value, NPY_ARRAY_IN_ARRAY));
+    if (converted == NULL) {
+      char msg[64];
+      sprintf(msg, "\"samples\" must be convertible to %s",
+              npy_dtype<D>::name);
+      PyErr_SetString(PyExc_TypeError, msg);
+      return false;
+    }
+    *samples = reinterpret_cast<D*>(PyArray_DATA(
+        reinterpret_cast<PyArrayObject*>(converted.get())));
+    samples_array.swap(converted);
+  }
+  holder->swap(samples_array);
+  return true;
+}
 
+/// Sets the Python exception which corresponds to the KMCUDAResult.
+/// Returns false if there is no error.
+static bool set_error(int result) {
   switch (result) {
+    case kmcudaSuccess:
+      return false;
     case kmcudaInvalidArguments:
       PyErr_SetString(PyExc_ValueError,
                       "Invalid arguments were passed to kmeans_cuda");
-      return NULL;
+      return true;
     case kmcudaNoSuchDevice:
       PyErr_SetString(PyExc_ValueError, "No such CUDA device exists");
-      return NULL;
+      return true;
     case kmcudaMemoryAllocationFailure:
       PyErr_SetString(PyExc_MemoryError,
                       "Failed to allocate memory on GPU");
-      return NULL;
+      return true;
     case kmcudaMemoryCopyError:
       PyErr_SetString(PyExc_RuntimeError, "cudaMemcpy failed");
-      return NULL;
+      return true;
     case kmcudaRuntimeError:
       PyErr_SetString(PyExc_AssertionError, "kmeans_cuda failure (bug?)");
-      return NULL;
-    case kmcudaSuccess:
-      return Py_BuildValue("OO", centroids_array, assignments_array);
+      return true;
     default:
       PyErr_SetString(PyExc_AssertionError,
                       "Unknown error code returned from kmeans_cuda");
+      return true;
+  }
+}
+
+/// The Python progress callback and the exception it raised. The concurrent
+/// restarts call it from the engine threads, whose temporary thread states
+/// would drop the exception, so it is fetched here and restored on the calling
+/// thread by raise_progress_error().
+struct PyProgress {
+  PyObject *callback;
+  PyObject *error_type, *error_value, *error_traceback;
+};
+
+/// Calls the Python progress callback from the native engine. An exception
+/// stops the run and is raised after kmeans_cuda_ex() returns. The engine
+/// never calls it concurrently.
+static int py_progress(const KMCUDAProgress *progress, void *arg) {
+  auto state = reinterpret_cast<PyProgress*>(arg);
+  if (state->error_type != NULL) {
+    return 1;
+  }
+  PyGILState_STATE gstate = PyGILState_Ensure();
+  PyObject *result = PyObject_CallFunction(
+      state->callback, "IIKfd", progress->restart, progress->iteration,
+      static_cast<unsigned long long>(progress->reassignments),
+      progress->passed_ratio, progress->elapsed);
+  int stop = 1;
+  if (result != NULL) {
+    stop = PyObject_IsTrue(result);
+    Py_DECREF(result);
+    if (stop < 0) {
+      stop = 1;
+    }
+  }
+  if (PyErr_Occurred()) {
+    PyErr_Fetch(&state->error_type, &state->error_value,
+                &state->error_traceback);
+  }
+  PyGILState_Release(gstate);
+  return stop;
+}
+
+/// Raises the exception of the progress callback on the calling thread, if any.
+static bool raise_progress_error(PyProgress *state) {
+  if (state->error_type == NULL) {
+    return false;
+  }
+  PyErr_Restore(state->error_type, state->error_value, state->error_traceback);
+  state->error_type = state->error_value = state->error_traceback = NULL;
+  return true;
+}
+
+/// Collects the per-iteration history for return_stats and forwards the
+/// progress to the Python callback, if any.
+struct PyHistory {
+  /// nullptr if there is no Python callback.
+  PyProgress *progress;
+  std::vector<uint32_t> restarts;
+  std::vector<KMCUDASampleIndex> reassignments;
+  std::vector<float> passed_ratios;
+};
+
+/// Invoked without the GIL, it is taken only for the Python callback.
+static int py_record_progress(const KMCUDAProgress *progress, void *arg) {
+  auto history = reinterpret_cast<PyHistory*>(arg);
+  history->restarts.push_back(progress->restart);
+  history->reassignments.push_back(progress->reassignments);
+  history->passed_ratios.push_back(progress->passed_ratio);
+  if (history->progress == nullptr) {
+    return 0;
+  }
+  return py_progress(progress, history->progress);
+}
+
+template <typename T>
+static PyObject *py_list(const std::vector<T> &values) {
+  PyObject *list = PyList_New(values.size());
+  if (list == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < values.size(); i++) {
+    PyList_SET_ITEM(list, i, std::is_floating_point<T>::value?
+        PyFloat_FromDouble(values[i]) :
+        PyLong_FromUnsignedLongLong(static_cast<unsigned long long>(values[i])));
+  }
+  return list;
+}
+
+static const char *stop_reason_names[] = {
+  "tolerance", "centroid_shift", "max_iterations", "time_budget", "cancelled"
+};
+
+#ifdef PROFILE
+static const char *phase_names[kmcudaPhaseCount] = {
+  "init", "lloyd", "yinyang_groups", "yinyang_refresh", "drifts",
+  "global_filter", "local_filter", "adjust", "kmeans_pp_step", "neighbors",
+  "reorder"
+};
+#endif
+
+/// Builds the return_stats dictionary of kmeans_cuda(). The profile keys are
+/// added only if the library was built with PROFILE, otherwise they are left
+/// out instead of being reported as zeros. The refreshes are always counted.
+static PyObject *py_stats(
+    const KMCUDAStatistics &statistics, const PyHistory &history,
+    PyObject *ccounts) {
+  pyobj stats(Py_BuildValue(
+      "{s:I,s:s,s:d,s:O,s:I,s:N,s:N,s:N}",
+      "iterations", statistics.iterations,
+      "stop_reason", stop_reason_names[statistics.stop_reason],
+      "inertia", statistics.inertia,
+      "ccounts", ccounts,
+      "refreshes", statistics.profile.refreshes,
+      "restarts", py_list(history.restarts),
+      "reassignments", py_list(history.reassignments),
+      "passed_ratios", py_list(history.passed_ratios)));
+  if (stats == NULL) {
+    return NULL;
+  }
+#ifdef PROFILE
+  const KMCUDAProfile &profile = statistics.profile;
+  pyobj phase_times(PyDict_New());
+  if (phase_times == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < kmcudaPhaseCount; i++) {
+    pyobj time(PyFloat_FromDouble(profile.phase_times[i]));
+    if (time == NULL ||
+        PyDict_SetItemString(phase_times.get(), phase_names[i], time.get()) < 0) {
+      return NULL;
+    }
+  }
+  pyobj profile_stats(Py_BuildValue(
+      "{s:K,s:K,s:K,s:O}",
+      "distance_evaluations",
+      static_cast<unsigned long long>(profile.distance_evaluations),
+      "passed", static_cast<unsigned long long>(profile.passed),
+      "bytes_touched", static_cast<unsigned long long>(profile.bytes_touched),
+      "phase_times", phase_times.get()));
+  if (profile_stats == NULL ||
+      PyDict_Update(stats.get(), profile_stats.get()) < 0) {
+    return NULL;
+  }
+#endif
+  return stats.release();
+}
+
+static PyObject *py_kmeans_cuda(PyObject *self, PyObject *args, PyObject *kwargs) {
+  uint32_t clusters_size = 0, seed = static_cast<uint32_t>(time(NULL)), device = 0;
+  uint32_t n_init = 1, max_iterations = 0, neighbors = 0, reorder_interval = 0;
+  int32_t verbosity = 0;
+  float tolerance = .0, yinyang_t = .1, shift_tolerance = .0, time_budget = .0;
+  PyObject *kmpp = Py_False, *progress = Py_None,
+      *approximate_neighbors = Py_False, *return_stats = Py_False,
+      *double_precision = Py_False;
+  PyObject *samples_obj;
+  const char *trace = nullptr;
+  static const char *kwlist[] = {"samples", "clusters", "tolerance", "kmpp",
+                                 "yinyang_t", "seed", "device", "verbosity",
+                                 "n_init", "max_iterations", "shift_tolerance",
+                                 "time_budget", "progress", "trace",
+                                 "neighbors", "approximate_neighbors",
+                                 "return_stats", "double_precision",
+                                 "reorder_interval", NULL};
+
+  /* Parse the input tuple */
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwargs, "OI|fO!fIIiIIffOzIO!O!O!I", const_cast<char**>(kwlist),
+      &samples_obj, &clusters_size, &tolerance, &PyBool_Type, &kmpp, &yinyang_t,
+      &seed, &device, &verbosity, &n_init, &max_iterations, &shift_tolerance,
+      &time_budget, &progress, &trace, &neighbors, &PyBool_Type,
+      &approximate_neighbors, &PyBool_Type, &return_stats, &PyBool_Type,
+      &double_precision, &reorder_interval)) {
+    return NULL;
+  }
+  if (progress != Py_None && !PyCallable_Check(progress)) {
+    PyErr_SetString(PyExc_TypeError, "\"progress\" must be callable");
+    return NULL;
+  }
+  if (clusters_size < 2 || clusters_size == UINT32_MAX) {
+    PyErr_SetString(PyExc_ValueError, "\"clusters\" must be greater than 1 and "
+                                      "less than (1 << 32) - 1");
+    return NULL;
+  }
+  // the samples and the centroids are either float32 or float64
+  bool f64 = double_precision == Py_True;
+  pyobj samples_array(nullptr);
+  float *samples = nullptr;
+  double *samples_f64 = nullptr;
+  KMCUDASamplesView samples_strided = {};
+  PySamplesSource<float> samples_source = {};
+  PySamplesSource<double> samples_source_f64 = {};
+  KMCUDASampleIndex samples_size;
+  uint32_t features_size;
+  if (f64? !parse_samples(samples_obj, &samples_array, &samples_f64,
+                          &samples_size, &features_size, nullptr,
+                          &samples_source_f64)
+         : !parse_samples(samples_obj, &samples_array, &samples,
+                          &samples_size, &features_size, &samples_strided,
+                          &samples_source)) {
+    return NULL;
+  }
+  npy_intp centroid_dims[] = {clusters_size, features_size, 0};
+  pyobj centroids_array(PyArray_EMPTY(
+      2, centroid_dims, f64? NPY_FLOAT64 : NPY_FLOAT32, false));
+  npy_intp assignments_dims[] = {static_cast<npy_intp>(samples_size), 0};
+  pyobj assignments_array(PyArray_EMPTY(1, assignments_dims, NPY_UINT32, false));
+  if (centroids_array == NULL || assignments_array == NULL) {
+    return NULL;
+  }
+  void *centroids = PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(centroids_array.get()));
+  uint32_t *assignments = reinterpret_cast<uint32_t*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(assignments_array.get())));
+
+  KMCUDAOptions options = {};
+  options.kmpp = kmpp == Py_True;
+  options.tolerance = tolerance;
+  options.yinyang_t = yinyang_t;
+  options.seed = seed;
+  options.device = device;
+  options.verbosity = verbosity;
+  options.n_init = n_init;
+  options.max_iterations = max_iterations;
+  options.shift_tolerance = shift_tolerance;
+  options.time_budget = time_budget;
+  options.trace = trace;
+  options.neighbors = neighbors;
+  options.approximate_neighbors = approximate_neighbors == Py_True;
+  options.reorder_interval = reorder_interval;
+  PyProgress progress_state = {progress, NULL, NULL, NULL};
+  if (progress != Py_None) {
+    options.progress = py_progress;
+    options.progress_arg = &progress_state;
+  }
+  bool with_stats = return_stats == Py_True;
+  PyHistory history = {progress != Py_None? &progress_state : nullptr,
+                       {}, {}, {}};
+  KMCUDAStatistics statistics = {};
+  pyobj ccounts_array(nullptr);
+  if (with_stats) {
+    npy_intp ccounts_dims[] = {clusters_size, 0};
+    ccounts_array.reset(PyArray_EMPTY(1, ccounts_dims, npy_sample_index, false));
+    if (ccounts_array == NULL) {
+      return NULL;
+    }
+    statistics.ccounts = reinterpret_cast<KMCUDASampleIndex*>(PyArray_DATA(
+        reinterpret_cast<PyArrayObject*>(ccounts_array.get())));
+    options.progress = py_record_progress;
+    options.progress_arg = &history;
+  }
+  int result;
+  Py_BEGIN_ALLOW_THREADS
+  if (f64 && samples_source_f64.source.fill != nullptr) {
+    result = kmeans_cuda_source_f64(
+        &options, samples_size, static_cast<KMCUDAFeatureIndex>(features_size),
+        clusters_size, &samples_source_f64.source,
+        reinterpret_cast<double*>(centroids), assignments,
+        with_stats? &statistics : nullptr);
+  } else if (f64) {
+    result = kmeans_cuda_ex_f64(
+        &options, samples_size, static_cast<KMCUDAFeatureIndex>(features_size),
+        clusters_size, samples_f64, reinterpret_cast<double*>(centroids),
+        assignments, with_stats? &statistics : nullptr);
+  } else if (samples_source.source.fill != nullptr) {
+    result = kmeans_cuda_source(
+        &options, samples_size, static_cast<KMCUDAFeatureIndex>(features_size),
+        clusters_size, &samples_source.source,
+        reinterpret_cast<float*>(centroids), assignments,
+        with_stats? &statistics : nullptr);
+  } else if (samples_strided.data != nullptr) {
+    result = kmeans_cuda_strided(
+        &options, samples_size, static_cast<KMCUDAFeatureIndex>(features_size),
+        clusters_size, &samples_strided, reinterpret_cast<float*>(centroids),
+        assignments, with_stats? &statistics : nullptr);
+  } else {
+    result = kmeans_cuda_ex(
+        &options, samples_size, static_cast<KMCUDAFeatureIndex>(features_size),
+        clusters_size, samples, reinterpret_cast<float*>(centroids),
+        assignments, with_stats? &statistics : nullptr);
+  }
+  Py_END_ALLOW_THREADS
+  if (raise_progress_error(&progress_state)) {
+    return NULL;
+  }
+
+  if (set_error(result)) {
+    return NULL;
+  }
+  if (with_stats) {
+    PyObject *stats = py_stats(statistics, history, ccounts_array.get());
+    if (stats == NULL) {
       return NULL;
+    }
+    return Py_BuildValue("NNN", centroids_array.release(),
+                         assignments_array.release(), stats);
+  }
+  return Py_BuildValue("NN", centroids_array.release(),
+                       assignments_array.release());
+}
+
+/// The stateful K-means model. The engine options are fixed at construction,
+/// fit() runs the engine and partial_fit() updates the centroids on the host.
+/// predict(), transform() and score() use them on the host without the GIL.
+struct PyKMeans {
+  PyObject_HEAD
+  KMCUDAOptions options;
+  uint32_t clusters_size;
+  /// float32 array of shape [clusters, features] or NULL before fit().
+  PyObject *centroids;
+  /// float64 array of shape [clusters], the number of samples seen by each
+  /// cluster; partial_fit() weighs the centroids with it.
+  PyObject *counts;
+  /// uint32 array with the assignments of the last fitted samples.
+  PyObject *assignments;
+  /// the device workspace which fit() reuses, created by the first fit().
+  KMCUDASession *session;
+  /// the number of features the session was created for.
+  uint32_t session_features;
+  /// fit() is running without the GIL and uses the session.
+  bool fitting;
+};
+
+static int py_kmeans_init(PyKMeans *self, PyObject *args, PyObject *kwargs) {
+  uint32_t clusters_size = 0, seed = static_cast<uint32_t>(time(NULL)), device = 0;
+  uint32_t n_init = 1, max_iterations = 0, neighbors = 0, reorder_interval = 0;
+  int32_t verbosity = 0;
+  float tolerance = .0, yinyang_t = .1, shift_tolerance = .0, time_budget = .0;
+  PyObject *kmpp = Py_False, *approximate_neighbors = Py_False;
+  static const char *kwlist[] = {"clusters", "tolerance", "kmpp", "yinyang_t",
+                                 "seed", "device", "verbosity", "n_init",
+                                 "max_iterations", "shift_tolerance",
+                                 "time_budget", "neighbors",
+                                 "approximate_neighbors", "reorder_interval",
+                                 NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+      args, kwargs, "I|fO!fIIiIIffIO!I", const_cast<char**>(kwlist),
+      &clusters_size, &tolerance, &PyBool_Type, &kmpp, &yinyang_t, &seed,
+      &device, &verbosity, &n_init, &max_iterations, &shift_tolerance,
+      &time_budget, &neighbors, &PyBool_Type, &approximate_neighbors,
+      &reorder_interval)) {
+    return -1;
+  }
+  if (clusters_size < 2 || clusters_size == UINT32_MAX) {
+    PyErr_SetString(PyExc_ValueError, "\"clusters\" must be greater than 1 and "
+                                      "less than (1 << 32) - 1");
+    return -1;
+  }
+  if (self->fitting) {
+    PyErr_SetString(PyExc_RuntimeError, "fit() is running");
+    return -1;
+  }
+  KMCUDAOptions options = {};
+  options.kmpp = kmpp == Py_True;
+  options.tolerance = tolerance;
+  options.yinyang_t = yinyang_t;
+  options.seed = seed;
+  options.device = device;
+  options.verbosity = verbosity;
+  options.n_init = n_init;
+  options.max_iterations = max_iterations;
+  options.shift_tolerance = shift_tolerance;
+  options.time_budget = time_budget;
+  options.neighbors = neighbors;
+  options.approximate_neighbors = approximate_neighbors == Py_True;
+  options.reorder_interval = reorder_interval;
+  self->options = options;
+  self->clusters_size = clusters_size;
+  // the session holds the old options
+  kmeans_cuda_session_destroy(self->session);
+  self->session = nullptr;
+  Py_CLEAR(self->centroids);
+  Py_CLEAR(self->counts);
+  Py_CLEAR(self->assignments);
+  return 0;
+}
+
+static void py_kmeans_dealloc(PyKMeans *self) {
+  kmeans_cuda_session_destroy(self->session);
+  Py_XDECREF(self->centroids);
+  Py_XDECREF(self->counts);
+  Py_XDECREF(self->assignments);
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+/// Runs the engine on the samples in the session of the model. Returns the new
+/// centroids, the assignments and the cluster sizes.
+static bool py_kmeans_run(
+    PyKMeans *self, PyObject *samples_obj,
+    pyobj *centroids_array, pyobj *assignments_array,
+    std::unique_ptr<KMCUDASampleIndex[]> *ccounts) {
+  pyobj samples_array(nullptr);
+  float *samples;
+  PySamplesSource<float> samples_source = {};
+  KMCUDASampleIndex samples_size;
+  uint32_t features_size;
+  if (!parse_samples(samples_obj, &samples_array, &samples, &samples_size,
+                     &features_size, nullptr, &samples_source)) {
+    return false;
+  }
+  npy_intp centroid_dims[] = {self->clusters_size, features_size, 0};
+  pyobj centroids(PyArray_EMPTY(2, centroid_dims, NPY_FLOAT32, false));
+  npy_intp assignments_dims[] = {static_cast<npy_intp>(samples_size), 0};
+  pyobj assignments(PyArray_EMPTY(1, assignments_dims, NPY_UINT32, false));
+  if (centroids == NULL || assignments == NULL) {
+    return false;
+  }
+  if (self->fitting) {
+    PyErr_SetString(PyExc_RuntimeError, "fit() is already running");
+    return false;
+  }
+  if (self->session != nullptr && self->session_features != features_size) {
+    kmeans_cuda_session_destroy(self->session);
+    self->session = nullptr;
+  }
+  if (self->session == nullptr) {
+    int result = kmeans_cuda_session_create(
+        &self->options, static_cast<KMCUDAFeatureIndex>(features_size),
+        self->clusters_size, &self->session);
+    if (set_error(result)) {
+      return false;
+    }
+    self->session_features = features_size;
+  }
+  ccounts->reset(new KMCUDASampleIndex[self->clusters_size]);
+  KMCUDASession *session = self->session;
+  KMCUDAStatistics statistics = {};
+  statistics.ccounts = ccounts->get();
+  float *centroids_data = reinterpret_cast<float*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(centroids.get())));
+  uint32_t *assignments_data = reinterpret_cast<uint32_t*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(assignments.get())));
+  int result;
+  const KMCUDASamplesSource *source =
+      samples_source.source.fill != nullptr? &samples_source.source : nullptr;
+  self->fitting = true;
+  Py_BEGIN_ALLOW_THREADS
+  result = kmeans_cuda_session_fit(
+      session, samples_size, source != nullptr? nullptr : samples, source,
+      centroids_data, assignments_data, &statistics);
+  Py_END_ALLOW_THREADS
+  self->fitting = false;
+  if (set_error(result)) {
+    return false;
+  }
+  centroids_array->swap(centroids);
+  assignments_array->swap(assignments);
+  return true;
+}
+
+static PyObject *py_kmeans_fit(PyKMeans *self, PyObject *samples_obj) {
+  pyobj centroids(nullptr), assignments(nullptr);
+  std::unique_ptr<KMCUDASampleIndex[]> ccounts;
+  if (!py_kmeans_run(self, samples_obj, &centroids, &assignments, &ccounts)) {
+    return NULL;
+  }
+  npy_intp counts_dims[] = {self->clusters_size, 0};
+  PyObject *counts = PyArray_EMPTY(1, counts_dims, NPY_FLOAT64, false);
+  if (counts == NULL) {
+    return NULL;
+  }
+  double *counts_data = reinterpret_cast<double*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(counts)));
+  for (uint32_t c = 0; c < self->clusters_size; c++) {
+    counts_data[c] = ccounts[c];
+  }
+  Py_XSETREF(self->centroids, centroids.release());
+  Py_XSETREF(self->counts, counts);
+  Py_XSETREF(self->assignments, assignments.release());
+  Py_INCREF(self);
+  return reinterpret_cast<PyObject*>(self);
+}
+
+/// Mini-batch K-means: assigns the samples to the current centroids once on
+/// the host and moves each centroid to the mean of all the samples it has got
+/// so far, weighted by counts. There are no Lloyd iterations over the batch.
+/// kmeans_host_accumulate() sums the samples per cluster into the per-node
+/// replicas of one accumulator for all the tiles, the merge is parallel over
+/// the clusters.
+static PyObject *py_kmeans_partial_fit(PyKMeans *self, PyObject *samples_obj) {
+  if (self->centroids == NULL) {
+    return py_kmeans_fit(self, samples_obj);
   }
-}
\ No newline at end of file
+  pyobj samples_array(nullptr);
+  float *samples;
+  PySamplesSource<float> samples_source = {};
+  KMCUDASampleIndex samples_size;
+  uint32_t features_size;
+  if (!parse_samples(samples_obj, &samples_array, &samples, &samples_size,
+                     &features_size, nullptr, &samples_source)) {
+    return NULL;
+  }
+  // fit() may replace the centroids while the GIL is released
+  pyobj old_holder(self->centroids);
+  Py_INCREF(self->centroids);
+  pyobj old_counts_holder(self->counts);
+  Py_INCREF(self->counts);
+  auto old_array = reinterpret_cast<PyArrayObject*>(old_holder.get());
+  if (static_cast<uint32_t>(PyArray_DIM(old_array, 1)) != features_size) {
+    PyErr_SetString(PyExc_ValueError,
+                    "\"samples\" have a different number of features");
+    return NULL;
+  }
+  pyobj centroids(PyArray_NewCopy(old_array, NPY_CORDER));
+  pyobj counts(PyArray_NewCopy(
+      reinterpret_cast<PyArrayObject*>(old_counts_holder.get()), NPY_CORDER));
+  npy_intp assignments_dims[] = {static_cast<npy_intp>(samples_size), 0};
+  pyobj assignments(PyArray_EMPTY(1, assignments_dims, NPY_UINT32, false));
+  if (centroids == NULL || counts == NULL || assignments == NULL) {
+    return NULL;
+  }
+  const float *old_centroids = reinterpret_cast<const float*>(
+      PyArray_DATA(old_array));
+  float *new_centroids = reinterpret_cast<float*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(centroids.get())));
+  double *counts_data = reinterpret_cast<double*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(counts.get())));
+  uint32_t *assignments_data = reinterpret_cast<uint32_t*>(PyArray_DATA(
+      reinterpret_cast<PyArrayObject*>(assignments.get())));
+  uint32_t clusters_size = self->clusters_size;
+  const KMCUDASamplesSource *source =
+      samples_source.source.fill != nullptr? &samples_source.source : nullptr;
+  int result = kmcudaSuccess;
+  Py_BEGIN_ALLOW_THREADS
+  // the converted samples go tile by tile, the rest is used in place
+  KMCUDASampleIndex tile_size = samples_size;
+  // not initialized: the first conversion touches the pages on the nodes of
+  // the threads which scan them, every tile of the same size reuses them so
+  std::unique_ptr<float[]> tile;
+  if (source != nullptr) {
+    tile_size = std::max<KMCUDASampleIndex>(
+        PARTIAL_FIT_TILE_SIZE / (std::max(features_size, 1u) * sizeof(float)),
+        1);
+    tile.reset(new (std::nothrow) float[static_cast<size_t>(
+        std::min(tile_size, samples_size)) * features_size]);
+    if (!tile) {
+      result = kmcudaMemoryAllocationFailure;
+    }
+  }
+  std::vector<double> sums(static_cast<size_t>(clusters_size) * features_size);
+  std::vector<double> batch_counts(clusters_size);
+  // the per-node sums live through all the tiles
+  KMCUDAHostAccumulator *accumulator = nullptr;
+  if (result == kmcudaSuccess) {
+    result = kmeans_host_accumulator_create(
+        static_cast<KMCUDAFeatureIndex>(features_size), clusters_size,
+        &accumulator);
+  }
+  std::unique_ptr<KMCUDAHostAccumulator, void (*)(KMCUDAHostAccumulator*)>
+      accumulator_holder(accumulator, kmeans_host_accumulator_destroy);
+  for (KMCUDASampleIndex begin = 0;
+       begin < samples_size && result == kmcudaSuccess; begin += tile_size) {
+    KMCUDASampleIndex size = std::min(tile_size, samples_size - begin);
+    const float *rows = tile.get();
+    if (source != nullptr) {
+      source->fill(source->arg, begin, size, tile.get());
+    } else {
+      rows = samples + static_cast<size_t>(begin) * features_size;
+    }
+    // NaN samples are assigned to clusters_size and not summed
+    result = kmeans_host_accumulate(
+        accumulator, size, rows, old_centroids, assignments_data + begin);
+  }
+  if (result == kmcudaSuccess) {
+    result = kmeans_host_accumulator_reduce(
+        accumulator, sums.data(), batch_counts.data());
+  }
+  if (result == kmcudaSuccess) {
+    #pragma omp parallel for schedule(static)
+    for (uint32_t c = 0; c < clusters_size; c++) {
+      if (batch_counts[c] == 0) {
+        continue;
+      }
+      double total = counts_data[c] + batch_counts[c];
+      const float *old_row = old_centroids + static_cast<size_t>(c) * features_size;
+      float *new_row = new_centroids + static_cast<size_t>(c) * features_size;
+      const double *sum = sums.data() + static_cast<size_t>(c) * features_size;
+      for (uint32_t f = 0; f < features_size; f++) {
+        new_row[f] = (old_row[f] * counts_data[c] + sum[f]) / total;
+      }
+      counts_data[c] = total;
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (set_error(result)) {
+    return NULL;
+  }
+  Py_XSETREF(self->centroids, centroids.release());
+  Py_XSETREF(self->counts, counts.release());
+  Py_XSETREF(self->assignments, assignments.release());
+  Py_INCREF(self);
+  return reinterpret_cast<PyObject*>(self);
+}
+
+/// Assigns the samples to the stored centroids on the host, optionally
+/// returning all the distances or the inertia.
+static PyObject *py_kmeans_apply(
+    PyKMeans *self, PyObject *samples_obj, bool with_distances,
+    double *inertia) {
+  if (self->centroids == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "fit() must be called first");
+    return NULL;
+  }
+  pyobj samples_array(nullptr);
+  float *samples;
+  KMCUDASampleIndex samples_size;
+  uint32_t features_size;
+  if (!parse_samples(samples_obj, &samples_array, &samples, &samples_size,
+                     &features_size)) {
+    return NULL;
+  }
+  // fit() may replace the centroids while the GIL is released
+  pyobj centroids_array(self->centroids);
+  Py_INCREF(self->centroids);
+  auto centroids_view = reinterpret_cast<PyArrayObject*>(centroids_array.get());
+  if (static_cast<uint32_t>(PyArray_DIM(centroids_view, 1)) != features_size) {
+    PyErr_SetString(PyExc_ValueError,
+                    "\"samples\" have a different number of features");
+    return NULL;
+  }
+  const float *centroids = reinterpret_cast<const float*>(
+      PyArray_DATA(centroids_view));
+  uint32_t clusters_size = self->clusters_size;
+  PyObject *output;
+  if (with_distances) {
+    npy_intp dims[] = {static_cast<npy_intp>(samples_size), clusters_size, 0};
+    output = PyArray_EMPTY(2, dims, NPY_FLOAT32, false);
+  } else {
+    npy_intp dims[] = {static_cast<npy_intp>(samples_size), 0};
+    output = PyArray_EMPTY(1, dims, NPY_UINT32, false);
+  }
+  if (output == NULL) {
+    return NULL;
+  }
+  void *data = PyArray_DATA(reinterpret_cast<PyArrayObject*>(output));
+  int result;
+  Py_BEGIN_ALLOW_THREADS
+  result = kmeans_host_predict(
+      samples_size, static_cast<KMCUDAFeatureIndex>(features_size), clusters_size,
+      samples, centroids,
+      with_distances? nullptr : reinterpret_cast<uint32_t*>(data),
+      with_distances? reinterpret_cast<float*>(data) : nullptr, inertia);
+  Py_END_ALLOW_THREADS
+  if (set_error(result)) {
+    Py_DECREF(output);
+    return NULL;
+  }
+  return output;
+}
+
+static PyObject *py_kmeans_predict(PyKMeans *self, PyObject *samples_obj) {
+  return py_kmeans_apply(self, samples_obj, false, nullptr);
+}
+
+static PyObject *py_kmeans_transform(PyKMeans *self, PyObject *samples_obj) {
+  return py_kmeans_apply(self, samples_obj, true, nullptr);
+}
+
+static PyObject *py_kmeans_score(PyKMeans *self, PyObject *samples_obj) {
+  double inertia = 0;
+  PyObject *assignments = py_kmeans_apply(self, samples_obj, false, &inertia);
+  if (assignments == NULL) {
+    return NULL;
+  }
+  Py_DECREF(assignments);
+  return PyFloat_FromDouble(-inertia);
+}
+
+static PyObject *py_kmeans_get(PyObject *value) {
+  if (value == NULL) {
+    Py_RETURN_NONE;
+  }
+  Py_INCREF(value);
+  return value;
+}
+
+static PyObject *py_kmeans_get_centroids(PyKMeans *self, void *) {
+  return py_kmeans_get(self->centroids);
+}
+
+static PyObject *py_kmeans_get_counts(PyKMeans *self, void *) {
+  return py_kmeans_get(self->counts);
+}
+
+static PyObject *py_kmeans_get_assignments(PyKMeans *self, void *) {
+  return py_kmeans_get(self->assignments);
+}
+
+static PyObject *py_kmeans_get_clusters(PyKMeans *self, void *) {
+  return PyLong_FromUnsignedLong(self->clusters_size);
+}
+
+static PyMethodDef kmeans_methods[] = {
+  {"fit", reinterpret_cast<PyCFunction>(py_kmeans_fit), METH_O,
+   "Clusters the samples from scratch. Returns self."},
+  {"partial_fit", reinterpret_cast<PyCFunction>(py_kmeans_partial_fit), METH_O,
+   "Mini-batch update on the host: assigns the samples to the current "
+   "centroids once and moves each centroid to the running mean of its samples "
+   "weighted by counts. Returns self."},
+  {"predict", reinterpret_cast<PyCFunction>(py_kmeans_predict), METH_O,
+   "Returns the nearest centroid of each sample."},
+  {"transform", reinterpret_cast<PyCFunction>(py_kmeans_transform), METH_O,
+   "Returns the distances from each sample to each centroid."},
+  {"score", reinterpret_cast<PyCFunction>(py_kmeans_score), METH_O,
+   "Returns the negated sum of squared distances to the nearest centroids."},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef kmeans_getset[] = {
+  {const_cast<char*>("centroids"),
+   reinterpret_cast<getter>(py_kmeans_get_centroids), NULL,
+   const_cast<char*>("the centroids or None before fit()"), NULL},
+  {const_cast<char*>("counts"),
+   reinterpret_cast<getter>(py_kmeans_get_counts), NULL,
+   const_cast<char*>("the number of samples seen by each cluster"), NULL},
+  {const_cast<char*>("assignments"),
+   reinterpret_cast<getter>(py_kmeans_get_assignments), NULL,
+   const_cast<char*>("the clusters of the last fitted samples"), NULL},
+  {const_cast<char*>("clusters"),
+   reinterpret_cast<getter>(py_kmeans_get_clusters), NULL,
+   const_cast<char*>("the number of clusters"), NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject kmeans_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static bool add_kmeans_type(PyObject *module) {
+  kmeans_type.tp_name = "libKMCUDA.KMeans";
+  kmeans_type.tp_basicsize = sizeof(PyKMeans);
+  kmeans_type.tp_flags = Py_TPFLAGS_DEFAULT;
+  kmeans_type.tp_doc = "Stateful K-means: fit(), partial_fit(), predict(), "
+                       "transform() and score().";
+  kmeans_type.tp_new = PyType_GenericNew;
+  kmeans_type.tp_init = reinterpret_cast<initproc>(py_kmeans_init);
+  kmeans_type.tp_dealloc = reinterpret_cast<destructor>(py_kmeans_dealloc);
+  kmeans_type.tp_methods = kmeans_methods;
+  kmeans_type.tp_getset = kmeans_getset;
+  if (PyType_Ready(&kmeans_type) < 0) {
+    return false;
+  }
+  Py_INCREF(&kmeans_type);
+  if (PyModule_AddObject(module, "KMeans",
+                         reinterpret_cast<PyObject*>(&kmeans_type)) < 0) {
+    Py_DECREF(&kmeans_type);
+    return false;
+  }
+  return true;
+}
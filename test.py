@@ -0,0 +1,575 @@
+"""Small-n regression tests of the engine paths against plain Lloyd.
+
+Every path is compared with the Lloyd run (yinyang_t=0) from the same seed on
+the same samples. The entry points which the Python module does not wrap are
+called through ctypes from the same shared library.
+
+    PYTHONPATH=<build dir> python3 test.py
+"""
+import ctypes
+import json
+import os
+import tempfile
+import threading
+import unittest
+
+import numpy
+
+import libKMCUDA
+from libKMCUDA import KMeans, kmeans_cuda
+
+
+SEED = 7
+
+
+def blobs(samples=4000, features=16, centers=8, spread=1.5, seed=0):
+    rs = numpy.random.RandomState(seed)
+    means = rs.uniform(-10, 10, (centers, features))
+    labels = rs.randint(0, centers, samples)
+    samples = means[labels] + rs.normal(0, spread, (samples, features))
+    return samples.astype(numpy.float32)
+
+
+def lloyd(samples, clusters, **kwargs):
+    """The reference: plain Lloyd from the same seed."""
+    kwargs.setdefault("seed", SEED)
+    return kmeans_cuda(samples, clusters, tolerance=0, yinyang_t=0, **kwargs)
+
+
+def cluster_means(samples, assignments, clusters):
+    sums = numpy.zeros((clusters, samples.shape[1]), numpy.float64)
+    numpy.add.at(sums, assignments, samples)
+    counts = numpy.bincount(assignments, minlength=clusters)
+    return sums / numpy.maximum(counts, 1)[:, None], counts
+
+
+def nearest(samples, centroids):
+    dists = ((samples[:, None, :].astype(numpy.float64) -
+              centroids[None, :, :]) ** 2).sum(axis=2)
+    return dists.argmin(axis=1)
+
+
+def inertia(samples, centroids, assignments):
+    return ((samples.astype(numpy.float64) - centroids[assignments]) ** 2).sum()
+
+
+class KMCUDAOptions(ctypes.Structure):
+    _fields_ = [("kmpp", ctypes.c_bool),
+                ("tolerance", ctypes.c_float),
+                ("yinyang_t", ctypes.c_float),
+                ("seed", ctypes.c_uint32),
+                ("device", ctypes.c_uint32),
+                ("verbosity", ctypes.c_int32),
+                ("n_init", ctypes.c_uint32),
+                ("max_iterations", ctypes.c_uint32),
+                ("shift_tolerance", ctypes.c_float),
+                ("time_budget", ctypes.c_float),
+                ("progress", ctypes.c_void_p),
+                ("progress_arg", ctypes.c_void_p),
+                ("trace", ctypes.c_char_p),
+                ("neighbors", ctypes.c_uint32),
+                ("approximate_neighbors", ctypes.c_bool),
+                ("init_centroids", ctypes.c_void_p),
+                ("reorder_interval", ctypes.c_uint32)]
+
+
+def lloyd_options():
+    options = KMCUDAOptions()
+    options.seed = SEED
+    return options
+
+
+def ptr(array):
+    return array.ctypes.data_as(ctypes.c_void_p)
+
+
+class EngineTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.samples = blobs()
+        cls.centroids, cls.assignments = lloyd(cls.samples, 8)
+        cls.lib = ctypes.CDLL(libKMCUDA.__file__)
+        # the ccounts dtype tells whether the library was built with INDEX64
+        _, _, stats = kmeans_cuda(cls.samples, 8, seed=SEED, return_stats=True)
+        cls.index64 = stats["ccounts"].dtype == numpy.uint64
+        cls.sample_index = numpy.uint64 if cls.index64 else numpy.uint32
+        cls.c_sample_index = ctypes.c_uint64 if cls.index64 else ctypes.c_uint32
+        cls.c_feature_index = ctypes.c_uint32 if cls.index64 else ctypes.c_uint16
+
+    def assertSameClustering(self, centroids, assignments, expected_centroids=None,
+                             expected_assignments=None, atol=1e-3):
+        if expected_centroids is None:
+            expected_centroids = self.centroids
+        if expected_assignments is None:
+            expected_assignments = self.assignments
+        self.assertEqual(centroids.shape, expected_centroids.shape)
+        numpy.testing.assert_allclose(centroids, expected_centroids, atol=atol)
+        self.assertGreaterEqual(
+            (assignments == expected_assignments).mean(), 0.999)
+
+    def assertFixedPoint(self, samples, centroids, assignments, atol=1e-3):
+        """The converged centroids are the means of their samples, which are
+        assigned to the nearest centroids."""
+        means, counts = cluster_means(samples, assignments, len(centroids))
+        nonempty = counts > 0
+        numpy.testing.assert_allclose(centroids[nonempty], means[nonempty],
+                                      atol=atol)
+        self.assertGreaterEqual(
+            (nearest(samples, centroids) == assignments).mean(), 0.999)
+
+
+class LloydTest(EngineTest):
+    def test_fixed_point(self):
+        self.assertFixedPoint(self.samples, self.centroids, self.assignments)
+
+    def test_reassignment_log(self):
+        # the first pass moves every sample and overflows the log, so the
+        # centroids are recalculated; the later passes go through the log
+        samples = numpy.random.RandomState(1).uniform(
+            -1, 1, (5000, 4)).astype(numpy.float32)
+        centroids, assignments, stats = kmeans_cuda(
+            samples, 50, tolerance=0, yinyang_t=0, seed=SEED, return_stats=True)
+        self.assertGreater(stats["iterations"], 10)
+        self.assertGreater(len(stats["reassignments"]), 2)
+        self.assertEqual(stats["reassignments"][0], len(samples))
+        self.assertTrue(any(0 < moved < len(samples) // 2
+                            for moved in stats["reassignments"]))
+        self.assertFixedPoint(samples, centroids, assignments)
+
+    def test_recalculate_fallback(self):
+        # every sample moves in the first pass, which is where the tolerance
+        # of 1 stops; with 0.9 the second pass sees the centroids recalculated
+        # from the first assignments and stops
+        _, first = kmeans_cuda(
+            self.samples, 8, tolerance=1.0, yinyang_t=0, seed=SEED)
+        centroids, assignments = kmeans_cuda(
+            self.samples, 8, tolerance=0.9, yinyang_t=0, seed=SEED)
+        self.assertLessEqual((assignments != first).mean(), 0.9)
+        means, counts = cluster_means(self.samples, first, 8)
+        numpy.testing.assert_allclose(centroids[counts > 0],
+                                      means[counts > 0], atol=1e-3)
+
+    def test_insane_label(self):
+        # NaN samples keep the clusters_size label through the narrow labels
+        samples = self.samples.copy()
+        samples[10, 0] = numpy.nan
+        centroids, assignments = lloyd(samples, 8)
+        self.assertEqual(assignments.dtype, numpy.uint32)
+        self.assertEqual(assignments[10], 8)
+        sane = numpy.arange(len(samples)) != 10
+        self.assertTrue((assignments[sane] < 8).all())
+        self.assertFixedPoint(samples[sane], centroids, assignments[sane])
+
+    def test_statistics(self):
+        centroids, assignments, stats = kmeans_cuda(
+            self.samples, 8, tolerance=0, yinyang_t=0, seed=SEED,
+            return_stats=True)
+        counts = numpy.bincount(assignments, minlength=8)
+        numpy.testing.assert_array_equal(stats["ccounts"], counts)
+        self.assertAlmostEqual(
+            stats["inertia"] / inertia(self.samples, centroids, assignments),
+            1, places=3)
+
+    def test_offset_statistics(self):
+        # far from the origin the expanded distance formula is off by ~1 per
+        # sample, the statistics must use the direct difference on every path
+        samples = self.samples + 1000
+        results = [kmeans_cuda(samples, 8, tolerance=0, yinyang_t=yinyang_t,
+                               seed=SEED, return_stats=True)
+                   for yinyang_t in (0, 0.5)]
+        for centroids, assignments, stats in results:
+            self.assertAlmostEqual(
+                stats["inertia"] / inertia(samples, centroids, assignments),
+                1, places=4)
+        self.assertAlmostEqual(
+            results[0][2]["inertia"] / results[1][2]["inertia"], 1, places=4)
+
+    def test_stop_rules(self):
+        # the iteration limit and an exhausted time budget stop after the
+        # first pass, as the tolerance which accepts every reassignment does
+        expected = kmeans_cuda(
+            self.samples, 8, tolerance=1.0, yinyang_t=0, seed=SEED)
+        for kwargs in ({"max_iterations": 1}, {"time_budget": 1e-9}):
+            centroids, assignments = lloyd(self.samples, 8, **kwargs)
+            numpy.testing.assert_array_equal(centroids, expected[0])
+            numpy.testing.assert_array_equal(assignments, expected[1])
+
+    def test_stop_reasons(self):
+        cases = [({}, "tolerance"),
+                 ({"max_iterations": 1}, "max_iterations"),
+                 ({"time_budget": 1e-9}, "time_budget"),
+                 # the shift is only known after the first update
+                 ({"shift_tolerance": 1e9}, "centroid_shift"),
+                 ({"progress": lambda *args: True}, "cancelled")]
+        for yinyang_t in (0, 0.1):
+            for kwargs, reason in cases:
+                _, _, stats = kmeans_cuda(
+                    self.samples, 8, tolerance=0, yinyang_t=yinyang_t,
+                    seed=SEED, return_stats=True, **kwargs)
+                self.assertEqual(stats["stop_reason"], reason)
+                if reason == "centroid_shift":
+                    self.assertEqual(stats["iterations"], 2)
+                elif reason != "tolerance":
+                    self.assertEqual(stats["iterations"], 1)
+
+    def test_progress(self):
+        reports = []
+
+        def progress(restart, iteration, reassignments, passed_ratio, elapsed):
+            reports.append((restart, iteration, reassignments, passed_ratio))
+
+        lloyd(self.samples, 8, progress=progress)
+        self.assertEqual([r[1] for r in reports],
+                         list(range(1, len(reports) + 1)))
+        self.assertEqual({r[0] for r in reports}, {0})
+        self.assertEqual({r[3] for r in reports}, {1})
+        self.assertEqual(reports[0][2], len(self.samples))
+        self.assertEqual(reports[-1][2], 0)
+        # returning True stops after the current iteration
+        cancelled = lloyd(self.samples, 8, progress=lambda *args: True)
+        expected = lloyd(self.samples, 8, max_iterations=1)
+        numpy.testing.assert_array_equal(cancelled[0], expected[0])
+        numpy.testing.assert_array_equal(cancelled[1], expected[1])
+
+    def test_profile(self):
+        _, _, stats = lloyd(self.samples, 8, return_stats=True)
+        if "phase_times" not in stats:
+            self.skipTest("the library was built without PROFILE")
+        self.assertGreaterEqual(stats["distance_evaluations"],
+                                stats["iterations"] * len(self.samples) * 8)
+        self.assertGreater(stats["phase_times"]["lloyd"], 0)
+
+    def test_trace(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "trace.json")
+            lloyd(self.samples, 8, trace=path)
+            if not os.path.exists(path):
+                self.skipTest("the library was built without PROFILE")
+            with open(path) as fin:
+                events = json.load(fin)["traceEvents"]
+        slices = [e for e in events if e["ph"] == "X"]
+        self.assertGreater(len(slices), 0)
+        self.assertEqual({e["cat"] for e in slices}, {"host", "device"})
+        self.assertEqual({e["args"]["restart"] for e in slices}, {0})
+
+    def test_yinyang(self):
+        centroids, assignments = kmeans_cuda(
+            self.samples, 8, tolerance=0, yinyang_t=0.5, seed=SEED)
+        self.assertSameClustering(centroids, assignments)
+        # the refreshes are counted without PROFILE, Lloyd has no bounds
+        _, _, stats = kmeans_cuda(self.samples, 8, tolerance=0, yinyang_t=0.5,
+                                  seed=SEED, return_stats=True)
+        self.assertIn("refreshes", stats)
+        self.assertEqual(lloyd(self.samples, 8, return_stats=True)[2]["refreshes"],
+                         0)
+
+    def test_yinyang_groups(self):
+        # many groups per sample share the local filter work
+        samples = blobs(samples=8000, centers=64, spread=1)
+        centroids, assignments = kmeans_cuda(
+            samples, 64, tolerance=0, yinyang_t=0.1, seed=SEED)
+        self.assertSameClustering(centroids, assignments, *lloyd(samples, 64))
+
+
+class RandomTest(EngineTest):
+    def test_same_seed(self):
+        for kmpp in (False, True):
+            first = kmeans_cuda(self.samples, 8, kmpp=kmpp, seed=SEED)
+            second = kmeans_cuda(self.samples, 8, kmpp=kmpp, seed=SEED)
+            numpy.testing.assert_array_equal(first[0], second[0])
+            numpy.testing.assert_array_equal(first[1], second[1])
+
+    def test_different_seeds(self):
+        first, _ = kmeans_cuda(self.samples, 8, max_iterations=1, seed=SEED)
+        second, _ = kmeans_cuda(self.samples, 8, max_iterations=1, seed=SEED + 1)
+        self.assertFalse(numpy.array_equal(first, second))
+
+    def test_n_init(self):
+        # the restart #i runs from seed + i and the best one is returned
+        runs = [kmeans_cuda(self.samples, 8, tolerance=0, seed=SEED + i)
+                for i in range(4)]
+        centroids, assignments = kmeans_cuda(
+            self.samples, 8, tolerance=0, seed=SEED, n_init=4)
+        self.assertTrue(any(
+            numpy.allclose(centroids, run[0], atol=1e-3) and
+            (assignments == run[1]).mean() >= 0.999 for run in runs))
+        self.assertLessEqual(
+            inertia(self.samples, centroids, assignments),
+            min(inertia(self.samples, *run) for run in runs) * (1 + 1e-4))
+
+    def test_n_init_progress_error(self):
+        # the restarts after the first one report from the worker threads
+        def progress(restart, iteration, reassignments, passed_ratio, elapsed):
+            if restart > 0:
+                raise ValueError("restart %d" % restart)
+
+        for return_stats in (False, True):
+            with self.assertRaises(ValueError):
+                kmeans_cuda(self.samples, 8, seed=SEED, n_init=4,
+                            progress=progress, return_stats=return_stats)
+
+    def test_concurrent_calls(self):
+        # the calls from several Python threads run side by side
+        expected = [lloyd(self.samples, 8, seed=SEED + i) for i in range(4)]
+        results = [None] * 4
+
+        def run(i):
+            results[i] = lloyd(self.samples, 8, seed=SEED + i)
+
+        threads = [threading.Thread(target=run, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for result, (centroids, assignments) in zip(results, expected):
+            self.assertSameClustering(*result, centroids, assignments, atol=0)
+
+
+class LayoutTest(EngineTest):
+    def test_column_major(self):
+        self.assertSameClustering(*lloyd(numpy.asfortranarray(self.samples), 8),
+                                  atol=0)
+
+    def test_padded_rows(self):
+        padded = numpy.zeros((len(self.samples), 24), numpy.float32)
+        padded[:, :16] = self.samples
+        self.assertSameClustering(*lloyd(padded[:, :16], 8), atol=0)
+
+    def test_strided(self):
+        wide = numpy.zeros((len(self.samples), 32), numpy.float32)
+        wide[:, ::2] = self.samples
+        self.assertSameClustering(*lloyd(wide[:, ::2], 8), atol=0)
+
+    def test_converted(self):
+        self.assertSameClustering(
+            *lloyd(self.samples.astype(numpy.float64), 8), atol=0)
+
+    def test_float64(self):
+        centroids, assignments = lloyd(
+            self.samples.astype(numpy.float64), 8, double_precision=True)
+        self.assertEqual(centroids.dtype, numpy.float64)
+        self.assertSameClustering(centroids, assignments)
+        self.assertFixedPoint(self.samples.astype(numpy.float64), centroids,
+                              assignments, atol=1e-9)
+
+    def test_index_types(self):
+        _, assignments, stats = lloyd(self.samples, 8, return_stats=True)
+        self.assertEqual(stats["ccounts"].dtype, self.sample_index)
+        numpy.testing.assert_array_equal(
+            stats["ccounts"], numpy.bincount(assignments, minlength=8))
+
+
+class AccelerationTest(EngineTest):
+    def test_neighbors(self):
+        samples = blobs(samples=8000, centers=64, spread=1)
+        expected = lloyd(samples, 64)
+        self.assertSameClustering(*lloyd(samples, 64, neighbors=8), *expected)
+
+    def test_feature_specializations(self):
+        # 3 is listed but not float4, 17 takes the generic kernels
+        for features in (3, 4, 17, 32):
+            samples = blobs(features=features)
+            expected = lloyd(samples, 8)
+            self.assertFixedPoint(samples, *expected)
+            self.assertSameClustering(
+                *kmeans_cuda(samples, 8, tolerance=0, yinyang_t=0.5, seed=SEED),
+                *expected)
+
+    def test_reorder(self):
+        self.assertSameClustering(*lloyd(self.samples, 8, reorder_interval=1))
+        centroids, assignments = kmeans_cuda(
+            self.samples, 8, tolerance=0, yinyang_t=0.5, seed=SEED,
+            reorder_interval=2)
+        self.assertSameClustering(centroids, assignments)
+
+
+class BatchTest(EngineTest):
+    def test_batch(self):
+        datasets = [blobs(samples=n, centers=k, seed=i)
+                    for i, (n, k) in enumerate(((500, 4), (1000, 8), (300, 2)))]
+        clusters = [4, 8, 2]
+        samples = numpy.concatenate(datasets)
+        samples_offsets = numpy.cumsum(
+            [0] + [len(d) for d in datasets]).astype(self.sample_index)
+        clusters_offsets = numpy.cumsum([0] + clusters).astype(numpy.uint32)
+        centroids = numpy.zeros((clusters_offsets[-1], 16), numpy.float32)
+        assignments = numpy.zeros(len(samples), numpy.uint32)
+        results = numpy.zeros(len(datasets), numpy.int32)
+        options = lloyd_options()
+        self.assertEqual(self.lib.kmeans_cuda_batch(
+            ctypes.byref(options), ctypes.c_uint32(len(datasets)),
+            self.c_feature_index(16), ptr(samples_offsets),
+            ptr(clusters_offsets), ptr(samples), ptr(centroids),
+            ptr(assignments), None, ptr(results)), 0)
+        numpy.testing.assert_array_equal(results, 0)
+        for i, dataset in enumerate(datasets):
+            self.assertSameClustering(
+                centroids[clusters_offsets[i]:clusters_offsets[i + 1]],
+                assignments[samples_offsets[i]:samples_offsets[i + 1]],
+                *lloyd(dataset, clusters[i]), atol=0)
+
+    def test_pq(self):
+        subspaces, clusters = 4, 16
+        codebooks = numpy.zeros((subspaces, clusters, 4), numpy.float32)
+        codes = numpy.zeros((len(self.samples), subspaces), numpy.uint8)
+        options = lloyd_options()
+        self.assertEqual(self.lib.kmeans_train_pq(
+            ctypes.byref(options), self.c_sample_index(len(self.samples)),
+            self.c_feature_index(16), ctypes.c_uint32(subspaces),
+            ctypes.c_uint32(clusters), ptr(self.samples), ptr(codebooks),
+            ptr(codes), None, None), 0)
+        for m in range(subspaces):
+            subspace = numpy.ascontiguousarray(self.samples[:, 4 * m:4 * m + 4])
+            self.assertSameClustering(codebooks[m], codes[:, m],
+                                      *lloyd(subspace, clusters), atol=0)
+
+    def test_pq_nan(self):
+        samples = self.samples.copy()
+        samples[10, 9] = numpy.nan
+        codebooks = numpy.zeros((4, 16, 4), numpy.float32)
+        codes = numpy.zeros((len(samples), 4), numpy.uint8)
+        results = numpy.zeros(4, numpy.int32)
+        options = lloyd_options()
+        # kmcudaInvalidArguments for the subspace with the NaN only
+        self.assertEqual(self.lib.kmeans_train_pq(
+            ctypes.byref(options), self.c_sample_index(len(samples)),
+            self.c_feature_index(16), ctypes.c_uint32(4), ctypes.c_uint32(16),
+            ptr(samples), ptr(codebooks), ptr(codes), None, ptr(results)), 1)
+        numpy.testing.assert_array_equal(results, [0, 0, 1, 0])
+
+    def test_hierarchical(self):
+        clusters, coarse = 24, 4
+        centroids = numpy.zeros((clusters, 16), numpy.float32)
+        assignments = numpy.zeros(len(self.samples), numpy.uint32)
+        coarse_centroids = numpy.zeros((coarse, 16), numpy.float32)
+        parents = numpy.zeros(clusters, numpy.uint32)
+        options = lloyd_options()
+        self.assertEqual(self.lib.kmeans_cuda_hierarchical(
+            ctypes.byref(options), self.c_sample_index(len(self.samples)),
+            self.c_feature_index(16), ctypes.c_uint32(clusters),
+            ctypes.c_uint32(coarse), ptr(self.samples), ptr(centroids),
+            ptr(assignments), ptr(coarse_centroids), ptr(parents)), 0)
+        expected_coarse, expected_labels = lloyd(self.samples, coarse)
+        self.assertSameClustering(coarse_centroids, parents[assignments],
+                                  expected_coarse, expected_labels, atol=0)
+        numpy.testing.assert_array_equal(parents, numpy.sort(parents))
+        for p in range(coarse):
+            partition = numpy.ascontiguousarray(
+                self.samples[expected_labels == p])
+            fine = numpy.flatnonzero(parents == p)
+            local = assignments[expected_labels == p] - fine[0]
+            if len(fine) == 1:
+                numpy.testing.assert_allclose(
+                    centroids[fine[0]], partition.mean(axis=0), atol=1e-4)
+                numpy.testing.assert_array_equal(local, 0)
+                continue
+            self.assertSameClustering(centroids[fine], local,
+                                      *lloyd(partition, len(fine)), atol=0)
+
+
+class ModelTest(EngineTest):
+    def test_fit(self):
+        model = KMeans(8, tolerance=0, yinyang_t=0, seed=SEED).fit(self.samples)
+        self.assertEqual(model.clusters, 8)
+        self.assertSameClustering(model.centroids, model.assignments, atol=0)
+        self.assertGreaterEqual(
+            (model.predict(self.samples) == self.assignments).mean(), 0.999)
+
+    def test_predict(self):
+        model = KMeans(8, tolerance=0, yinyang_t=0, seed=SEED).fit(self.samples)
+        self.assertGreaterEqual(
+            (model.predict(self.samples) ==
+             nearest(self.samples, model.centroids)).mean(), 0.999)
+        distances = model.transform(self.samples)
+        expected = numpy.sqrt(((self.samples[:, None, :].astype(numpy.float64) -
+                                model.centroids[None, :, :]) ** 2).sum(axis=2))
+        numpy.testing.assert_allclose(distances, expected, rtol=1e-4, atol=1e-4)
+        self.assertAlmostEqual(
+            -model.score(self.samples) /
+            inertia(self.samples, model.centroids, model.predict(self.samples)),
+            1, places=5)
+
+    def test_partial_fit(self):
+        model = KMeans(8, tolerance=0, yinyang_t=0, seed=SEED).fit(self.samples)
+        centroids, counts = model.centroids.copy(), model.counts.copy()
+        batch = self.samples[::8] + 0.5
+        model.partial_fit(batch)
+        # a single step: the batch is assigned to the old centroids
+        assignments = model.assignments
+        self.assertGreaterEqual(
+            (assignments == nearest(batch, centroids)).mean(), 0.999)
+        sums, batch_counts = cluster_means(batch, assignments, 8)
+        sums *= batch_counts[:, None]
+        totals = counts + batch_counts
+        expected = (centroids * counts[:, None] + sums) / totals[:, None]
+        numpy.testing.assert_allclose(model.centroids, expected, rtol=1e-5,
+                                      atol=1e-5)
+        numpy.testing.assert_array_equal(model.counts, totals)
+
+    def test_refit_features(self):
+        model = KMeans(8, tolerance=0, yinyang_t=0, seed=SEED).fit(self.samples)
+        # the session of 16 features is replaced
+        samples = numpy.ascontiguousarray(self.samples[:, :8])
+        model.fit(samples)
+        self.assertEqual(model.centroids.shape, (8, 8))
+        self.assertFixedPoint(samples, model.centroids, model.assignments)
+        expected = lloyd(samples, 8)
+        self.assertSameClustering(model.centroids, model.assignments,
+                                  *expected, atol=0)
+        with self.assertRaises(ValueError):
+            model.partial_fit(self.samples)
+
+    def test_host_predict(self):
+        assignments = numpy.zeros(len(self.samples), numpy.uint32)
+        distances = numpy.zeros((len(self.samples), 8), numpy.float32)
+        total = ctypes.c_double()
+        self.assertEqual(self.lib.kmeans_host_predict(
+            self.c_sample_index(len(self.samples)), self.c_feature_index(16),
+            ctypes.c_uint32(8), ptr(self.samples), ptr(self.centroids),
+            ptr(assignments), ptr(distances), ctypes.byref(total)), 0)
+        self.assertGreaterEqual(
+            (assignments == nearest(self.samples, self.centroids)).mean(), 0.999)
+        expected = numpy.sqrt(((self.samples[:, None, :].astype(numpy.float64) -
+                                self.centroids[None, :, :]) ** 2).sum(axis=2))
+        numpy.testing.assert_allclose(distances, expected, rtol=1e-4, atol=1e-4)
+        self.assertAlmostEqual(
+            total.value / inertia(self.samples, self.centroids, assignments),
+            1, places=5)
+
+    def test_host_accumulate(self):
+        accumulator = ctypes.c_void_p()
+        self.assertEqual(self.lib.kmeans_host_accumulator_create(
+            self.c_feature_index(16), ctypes.c_uint32(8),
+            ctypes.byref(accumulator)), 0)
+        assignments = numpy.zeros(len(self.samples), numpy.uint32)
+        sums = numpy.ones((8, 16), numpy.float64)
+        counts = numpy.ones(8, numpy.float64)
+        try:
+            # the same samples twice, as two tiles each
+            half = len(self.samples) // 2
+            for _ in range(2):
+                for begin, end in ((0, half), (half, len(self.samples))):
+                    self.assertEqual(self.lib.kmeans_host_accumulate(
+                        accumulator, self.c_sample_index(end - begin),
+                        ptr(self.samples[begin:end]), ptr(self.centroids),
+                        ptr(assignments[begin:end])), 0)
+            # the totals are written, not added to
+            self.assertEqual(self.lib.kmeans_host_accumulator_reduce(
+                accumulator, ptr(sums), ptr(counts)), 0)
+            self.assertGreaterEqual(
+                (assignments == nearest(self.samples, self.centroids)).mean(),
+                0.999)
+            means, expected_counts = cluster_means(self.samples, assignments, 8)
+            numpy.testing.assert_array_equal(counts, expected_counts * 2)
+            numpy.testing.assert_allclose(
+                sums, means * expected_counts[:, None] * 2, rtol=1e-6)
+            # and reset
+            self.assertEqual(self.lib.kmeans_host_accumulator_reduce(
+                accumulator, ptr(sums), ptr(counts)), 0)
+            numpy.testing.assert_array_equal(counts, 0)
+            numpy.testing.assert_array_equal(sums, 0)
+        finally:
+            self.lib.kmeans_host_accumulator_destroy(accumulator)
+
+if __name__ == "__main__":
+    unittest.main()
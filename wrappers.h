@@ -2,6 +2,7 @@
 #define KMCUDA_WRAPPERS_H
 
 #include <cuda_runtime_api.h>
+#include <functional>
 #include <memory>
 
 using unique_devptr_parent = std::unique_ptr<void, std::function<void(void*)>>;